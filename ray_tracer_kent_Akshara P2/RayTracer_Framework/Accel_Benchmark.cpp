@@ -0,0 +1,766 @@
+#include "Accel_Benchmark.h"
+#include "scene/Scene.h"
+#include "primitives/Sphere.h"
+#include "primitives/Triangle.h"
+#include "primitives/Triangle_Mesh.h"
+#include "Ray_Queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+static float frand()
+{
+    return rand() / (float)RAND_MAX;
+}
+
+static double seconds_since(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void add_spheres(Scene& scene, float dim, int count, bool clustered)
+{
+    const int cluster_count = 8;
+    M3DVector3f centers[cluster_count];
+    for (int c = 0; c < cluster_count; c++)
+        m3dLoadVector3(centers[c], dim * (0.15f + 0.7f * frand()), dim * (0.15f + 0.7f * frand()), dim * (0.15f + 0.7f * frand()));
+
+    // One material shared by every sphere
+    M3DVector3f color; m3dLoadVector3(color, 1.0f, 1.0f, 1.0f);
+    Material_Id material = scene.add_material(Sphere::default_material(color));
+    for (int i = 0; i < count; i++)
+    {
+        M3DVector3f pos;
+        if (clustered)
+        {
+            // Sum of three uniforms: a cheap bell shape around the cluster center
+            const float* center = centers[rand() % cluster_count];
+            for (int k = 0; k < 3; k++)
+                pos[k] = center[k] + 25.0f * (frand() + frand() + frand() - 1.5f);
+        }
+        else
+        {
+            m3dLoadVector3(pos, dim * frand(), dim * frand(), dim * frand());
+        }
+        scene.add_primitive(scene.create_primitive<Sphere>(pos, 2.0f + 4.0f * frand(), material));
+    }
+}
+
+// Rays from just outside the front face (where the camera looks in)
+// towards random points in the room, so no ray starts inside a primitive;
+// origin and unit direction per ray
+static void make_rays(float dim, int ray_count, std::vector<float>& rays)
+{
+    rays.resize(6 * ray_count);
+    for (int r = 0; r < ray_count; r++)
+    {
+        float* ray = &rays[6 * r];
+        m3dLoadVector3(ray, dim * frand(), dim * frand(), dim + 10.0f);
+        M3DVector3f target; m3dLoadVector3(target, dim * frand(), dim * frand(), dim * frand());
+        m3dSubtractVectors3(ray + 3, target, ray);
+        m3dNormalizeVector(ray + 3);
+    }
+}
+
+// Returns rays per second and fills the hit primitives
+static double trace_rays(Scene& scene, const std::vector<float>& rays, std::vector<Basic_Primitive*>& hits)
+{
+    int ray_count = (int)rays.size() / 6;
+    hits.resize(ray_count);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < ray_count; r++)
+    {
+        Hit_Record hit;
+        scene.intersection_check(&rays[6 * r], &rays[6 * r + 3], hit);
+        hits[r] = hit.prim;
+    }
+    return ray_count / seconds_since(start);
+}
+
+void run_accel_benchmark(int sphere_count, int ray_count)
+{
+    const float dim = 512.0f;
+    const char* distribution_names[2] = { "uniform", "clustered" };
+
+    printf("%-10s %-6s %10s %10s %8s %10s\n", "scene", "accel", "build ms", "Mrays/s", "hits", "mismatch");
+    for (int clustered = 0; clustered < 2; clustered++)
+    {
+        srand(1234 + clustered);
+        Scene scene;
+        M3DVector3f room; m3dLoadVector3(room, dim, dim, dim);
+        scene.set_dim(room);
+        add_spheres(scene, dim, sphere_count, clustered != 0);
+
+        std::vector<float> rays;
+        make_rays(dim, ray_count, rays);
+
+        std::vector<Basic_Primitive*> reference, hits;
+        Accel_Type types[2] = { _k_accel_bvh, _k_accel_grid };
+        const char* type_names[2] = { "bvh", "grid" };
+        for (int t = 0; t < 2; t++)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            scene.set_accel(types[t]);
+            double build_ms = 1000.0 * seconds_since(start);
+
+            double rays_per_second = trace_rays(scene, rays, t == 0 ? reference : hits);
+            const std::vector<Basic_Primitive*>& result = t == 0 ? reference : hits;
+            int hit_count = 0, mismatch = 0;
+            for (int r = 0; r < ray_count; r++)
+            {
+                if (result[r] != NULL) hit_count++;
+                if (result[r] != reference[r]) mismatch++;
+            }
+            printf("%-10s %-6s %10.2f %10.2f %8d %10d\n", distribution_names[clustered], type_names[t],
+                build_ms, rays_per_second * 1e-6, hit_count, mismatch);
+        }
+    }
+}
+
+// Shadow and reflection rays of one primary ray per pixel of a 512x512
+// image, looking into the room from the front like Ray_Tracer does, in
+// pixel order
+static void make_secondary_rays(Scene& scene, float dim, Ray_Queue& shadow, Ray_Queue& reflect)
+{
+    M3DVector3f eye; m3dLoadVector3(eye, dim / 2.0f, dim / 2.0f, dim + 2000.0f);
+    M3DVector3f light; scene.get_sp_light().get_light_pos(light);
+    const float eps = 1e-3f;
+
+    shadow.clear();
+    reflect.clear();
+    for (int j = 0; j < (int)dim; j++)
+    {
+        for (int i = 0; i < (int)dim; i++)
+        {
+            M3DVector3f start, dir;
+            m3dLoadVector3(start, (float)i, (float)j, dim);
+            m3dSubtractVectors3(dir, start, eye);
+            m3dNormalizeVector(dir);
+            Hit_Record hit;
+            if (scene.intersection_check(start, dir, hit) == _k_miss) continue;
+
+            M3DVector3f to_light, origin;
+            m3dSubtractVectors3(to_light, light, hit.point);
+            float dist = sqrtf(m3dDotProduct(to_light, to_light));
+            m3dNormalizeVector(to_light);
+            m3dCopyVector3(origin, to_light); m3dScaleVector3(origin, eps); m3dAddVectors3(origin, origin, hit.point);
+            shadow.push(shadow.size(), origin, to_light, dist - eps);
+
+            M3DVector3f mirror;
+            hit.prim->get_reflect_direct(dir, hit, mirror);
+            m3dCopyVector3(origin, mirror); m3dScaleVector3(origin, eps); m3dAddVectors3(origin, origin, hit.point);
+            reflect.push(reflect.size(), origin, mirror, FLT_MAX);
+        }
+    }
+}
+
+struct Sort_Result
+{
+    double ns;              // per ray
+    double coherent;        // share of packets traced as packets
+    Traversal_Stats stats;
+};
+
+// Traces the rays as packets of RT_PACKET_SIZE consecutive rays, ray by ray
+// where a packet's directions fall into different octants
+static void trace_secondary(Scene& scene, const Ray_Queue& rays, bool shadow, Sort_Result& result)
+{
+    const int n = rays.size();
+    int packets = 0, coherent = 0;
+    traversal_stats().clear();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < n; r += RT_PACKET_SIZE)
+    {
+        int count = n - r < RT_PACKET_SIZE ? n - r : RT_PACKET_SIZE;
+        Ray_Packet packet;
+        rays.get_packet(r, count, packet);
+        packets++;
+        if (packet.coherent() && count > 1)
+        {
+            coherent++;
+            if (shadow)
+            {
+                float tmax[RT_PACKET_SIZE];
+                for (int k = 0; k < RT_PACKET_SIZE; k++) tmax[k] = k < count ? rays.tmax[r + k] : 0.0f;
+                scene.occluded_packet(packet, tmax);
+            }
+            else
+            {
+                Hit_Record hit[RT_PACKET_SIZE];
+                scene.intersection_check_packet(packet, hit);
+            }
+            continue;
+        }
+        for (int k = 0; k < count; k++)
+        {
+            M3DVector3f org, dir;
+            rays.get(r + k, org, dir);
+            if (shadow)
+            {
+                scene.occluded(org, dir, rays.tmax[r + k]);
+            }
+            else
+            {
+                Hit_Record hit;
+                scene.intersection_check(org, dir, hit);
+            }
+        }
+    }
+    result.ns = n > 0 ? 1e9 * seconds_since(start) / n : 0.0;
+    result.coherent = packets > 0 ? (double)coherent / packets : 0.0;
+    result.stats = traversal_stats();
+}
+
+void run_ray_sort_benchmark(int sphere_count)
+{
+    const float dim = 512.0f;
+    const char* scene_names[3] = { "room", "uniform", "clustered" };
+
+    // The node, miss and primitive columns only exist with the counters compiled in
+#if RT_TRAVERSAL_STATS
+    printf("%-10s %-8s %-8s %8s %8s %9s %8s %9s %8s\n",
+        "scene", "rays", "order", "count", "ns/ray", "coherent", "nodes", "L1 miss", "prims");
+#else
+    printf("Built without RT_TRAVERSAL_STATS: no node, L1 miss or primitive counts\n");
+    printf("%-10s %-8s %-8s %8s %8s %9s\n", "scene", "rays", "order", "count", "ns/ray", "coherent");
+#endif
+    for (int s = 0; s < 3; s++)
+    {
+        srand(4321 + s);
+        Scene scene;
+        M3DVector3f room; m3dLoadVector3(room, dim, dim, dim);
+        scene.set_dim(room);
+        if (s == 0)
+        {
+            scene.assemble();
+        }
+        else
+        {
+            add_spheres(scene, dim, sphere_count, s == 2);
+            scene.set_accel(_k_accel_bvh);
+        }
+
+        Ray_Queue batches[2], sorted;
+        std::vector<unsigned long long> keys;
+        make_secondary_rays(scene, dim, batches[0], batches[1]);
+        const char* batch_names[2] = { "shadow", "reflect" };
+        for (int b = 0; b < 2; b++)
+        {
+            batches[b].sort_coherent(sorted, keys);
+            for (int o = 0; o < 2; o++)
+            {
+                const Ray_Queue& rays = o == 0 ? batches[b] : sorted;
+                Sort_Result result;
+                trace_secondary(scene, rays, b == 0, result);
+                printf("%-10s %-8s %-8s %8d %8.1f %8.1f%%", scene_names[s], batch_names[b],
+                    o == 0 ? "pixel" : "sorted", rays.size(), result.ns, 100.0 * result.coherent);
+#if RT_TRAVERSAL_STATS
+                double n = rays.size() > 0 ? (double)rays.size() : 1.0;
+                printf(" %8.2f %9.2f %8.2f", result.stats.node_fetches / n, result.stats.line_misses / n, result.stats.prim_tests / n);
+#endif
+                printf("\n");
+            }
+        }
+    }
+}
+
+// What Ray_Tracer::ray_tracing makes of one ray: the closest hit, the
+// shadow test toward the scene light, with the offset of
+// Ray_Tracer::shadow_ray, and the shaded color
+struct Shaded_Ray
+{
+    bool        hit;
+    bool        shadow;
+    float       t;
+    float       light_cos;      // normal against the direction to the light
+    int         face;           // mesh triangle, -1 for other primitives
+    float       edge;           // barycentric distance to the triangle's nearest edge
+    M3DVector3f point;
+    M3DVector3f normal;
+    M3DVector3f color;
+};
+
+static const float k_shadow_eps = 1e-3f;     // as in Ray_Tracer::shadow_ray
+
+static void shade_rays(Scene& scene, const std::vector<float>& rays, std::vector<Shaded_Ray>& out)
+{
+    const int ray_count = (int)rays.size() / 6;
+    const float eps = k_shadow_eps;
+    M3DVector3f light, am_light;
+    scene.get_sp_light().get_light_pos(light);
+    scene.get_amb_light(am_light);
+
+    out.resize(ray_count);
+    for (int r = 0; r < ray_count; r++)
+    {
+        Shaded_Ray& result = out[r];
+        M3DVector3f dir; m3dCopyVector3(dir, &rays[6 * r + 3]);
+        Hit_Record hit;
+        result.hit = scene.intersection_check(&rays[6 * r], dir, hit) != _k_miss;
+        result.shadow = false;
+        if (!result.hit) continue;
+
+        M3DVector3f to_light, origin;
+        m3dSubtractVectors3(to_light, light, hit.point);
+        float dist = sqrtf(m3dDotProduct(to_light, to_light));
+        m3dNormalizeVector(to_light);
+        m3dCopyVector3(origin, to_light); m3dScaleVector3(origin, eps); m3dAddVectors3(origin, origin, hit.point);
+        result.shadow = scene.occluded(origin, to_light, dist - eps);
+
+        result.t = hit.t;
+        result.light_cos = m3dDotProduct(hit.normal, to_light);
+        result.face = hit.face;
+        result.edge = hit.face >= 0 ? std::min(std::min(hit.u, hit.v), 1.0f - hit.u - hit.v) : 1.0f;
+        m3dCopyVector3(result.point, hit.point);
+        m3dCopyVector3(result.normal, hit.normal);
+        hit.prim->shade(dir, hit, scene.get_sp_light(), am_light, scene.get_material(hit.material), result.color, result.shadow);
+    }
+}
+
+static bool near(const M3DVector3f a, const M3DVector3f b, float tol)
+{
+    return fabsf(a[0] - b[0]) <= tol && fabsf(a[1] - b[1]) <= tol && fabsf(a[2] - b[2]) <= tol;
+}
+
+// Spacing of floats around the largest coordinate of p
+static float coordinate_ulp(const M3DVector3f p)
+{
+    float m = std::max(std::max(fabsf(p[0]), fabsf(p[1])), fabsf(p[2]));
+    return m > 0.0f ? ldexpf(1.0f, ilogbf(m) - 23) : 0.0f;
+}
+
+// Rays on which a and b disagree, and the rays that rounding alone may
+// split (only with a tolerance, when a and b compute in different spaces):
+//  - edge: both hit mesh triangles, different ones, and the nearer hit lies
+//    within k_edge_band of its triangle's edge: the other ray landed on the
+//    neighbouring facet or slipped between the two
+//  - terminator: the shadow answers differ where the light grazes the
+//    surface so closely that the shadow ray offset lifts the origin by no
+//    more than k_surface_ulps float steps of the hit point off it
+// Those rays are counted apart; everything else must agree on hit or miss,
+// shadow, t (relative), point (relative to the room size), normal and color
+// to tol.
+struct Mismatch_Count
+{
+    int     mismatch;
+    int     edge;
+    int     terminator;
+};
+
+static const float k_edge_band = 1e-3f;
+static const float k_surface_ulps = 4.0f;
+
+static Mismatch_Count count_mismatches(const std::vector<Shaded_Ray>& a, const std::vector<Shaded_Ray>& b, float dim, float tol)
+{
+    Mismatch_Count count = { 0, 0, 0 };
+    for (size_t r = 0; r < a.size(); r++)
+    {
+        const Shaded_Ray& x = a[r];
+        const Shaded_Ray& y = b[r];
+        if (x.hit != y.hit) { count.mismatch++; continue; }
+        if (!x.hit) continue;
+        if (tol > 0.0f && x.face != y.face && x.face >= 0 && y.face >= 0 && (x.t <= y.t ? x : y).edge < k_edge_band)
+        {
+            count.edge++;
+            continue;
+        }
+        if (fabsf(x.t - y.t) > tol * x.t || !near(x.point, y.point, tol * dim)) { count.mismatch++; continue; }
+
+        if (tol > 0.0f && x.shadow != y.shadow && near(x.normal, y.normal, tol) &&
+            fabsf(x.light_cos) * k_shadow_eps <= k_surface_ulps * coordinate_ulp(x.point))
+            count.terminator++;
+        else if (x.shadow != y.shadow || !near(x.normal, y.normal, tol) || !near(x.color, y.color, tol))
+            count.mismatch++;
+    }
+    return count;
+}
+
+// Turns triangle 'first' of indices around when its normal (e1 x e2) points
+// away from 'outside' - a point for closed shapes, a direction otherwise
+static void orient_triangle(const std::vector<float>& positions, std::vector<unsigned int>& indices, size_t first,
+    const M3DVector3f outside, bool is_point)
+{
+    const float* v0 = &positions[3 * indices[first]];
+    const float* v1 = &positions[3 * indices[first + 1]];
+    const float* v2 = &positions[3 * indices[first + 2]];
+    M3DVector3f e1, e2, n, out;
+    m3dSubtractVectors3(e1, v1, v0);
+    m3dSubtractVectors3(e2, v2, v0);
+    m3dCrossProduct(n, e1, e2);
+    if (is_point) m3dSubtractVectors3(out, v0, outside);
+    else m3dCopyVector3(out, outside);
+    if (m3dDotProduct(n, out) < 0.0f)
+    {
+        unsigned int tmp = indices[first + 1];
+        indices[first + 1] = indices[first + 2];
+        indices[first + 2] = tmp;
+    }
+}
+
+// Latitude-longitude sphere around the origin with outward normals; the
+// pole rows get one triangle per segment instead of a degenerate pair
+static void make_sphere_mesh(float radius, int rings, int segments, std::vector<float>& positions, std::vector<unsigned int>& indices)
+{
+    positions.clear();
+    indices.clear();
+    for (int r = 0; r <= rings; r++)
+    {
+        float theta = 3.14159265f * r / rings;
+        for (int s = 0; s < segments; s++)
+        {
+            float phi = 2.0f * 3.14159265f * s / segments;
+            positions.push_back(radius * sinf(theta) * cosf(phi));
+            positions.push_back(radius * cosf(theta));
+            positions.push_back(radius * sinf(theta) * sinf(phi));
+        }
+    }
+    M3DVector3f center = { 0.0f, 0.0f, 0.0f };
+    for (int r = 0; r < rings; r++)
+    {
+        for (int s = 0; s < segments; s++)
+        {
+            unsigned int a = r * segments + s, b = r * segments + (s + 1) % segments;
+            unsigned int c = a + segments, d = b + segments;
+            if (r > 0)
+            {
+                indices.push_back(a); indices.push_back(b); indices.push_back(c);
+                orient_triangle(positions, indices, indices.size() - 3, center, true);
+            }
+            if (r < rings - 1)
+            {
+                indices.push_back(b); indices.push_back(d); indices.push_back(c);
+                orient_triangle(positions, indices, indices.size() - 3, center, true);
+            }
+        }
+    }
+}
+
+// Adds the triangles of a mesh to the scene one Triangle primitive each, in
+// face order, so ties between triangles resolve the same way as in the mesh
+static void add_triangles(Scene& scene, const std::vector<float>& positions, const std::vector<unsigned int>& indices, Material_Id material)
+{
+    for (size_t i = 0; i < indices.size(); i += 3)
+    {
+        M3DVector3f v[3];
+        for (int c = 0; c < 3; c++) m3dCopyVector3(v[c], &positions[3 * indices[i + c]]);
+        scene.add_primitive(scene.create_primitive<Triangle>(v[0], v[1], v[2], material));
+    }
+}
+
+void run_mesh_benchmark(int ray_count)
+{
+    const float dim = 512.0f;
+    const int sphere_count = 8;
+    srand(2468);
+
+    // The meshes: tessellated spheres spread through the room and a soup of
+    // small triangles parallel to the view plane, facing the camera. Every
+    // ray comes from the front, so only front faces are seen: Triangle::shade
+    // does not turn the normal toward the viewer like the mesh does.
+    std::vector<std::vector<float> > positions(sphere_count + 1);
+    std::vector<std::vector<unsigned int> > indices(sphere_count + 1);
+    for (int m = 0; m < sphere_count; m++)
+    {
+        make_sphere_mesh(20.0f + 40.0f * frand(), 24, 48, positions[m], indices[m]);
+        M3DVector3f center; m3dLoadVector3(center, dim * (0.15f + 0.7f * frand()), dim * (0.15f + 0.7f * frand()), dim * (0.15f + 0.7f * frand()));
+        for (size_t i = 0; i < positions[m].size(); i += 3)
+            m3dAddVectors3(&positions[m][i], &positions[m][i], center);
+    }
+    M3DVector3f toward_camera = { 0.0f, 0.0f, 1.0f };
+    for (int i = 0; i < 2000; i++)
+    {
+        M3DVector3f p; m3dLoadVector3(p, dim * frand(), dim * frand(), dim * frand());
+        for (int c = 0; c < 3; c++)
+        {
+            indices[sphere_count].push_back((unsigned int)(positions[sphere_count].size() / 3));
+            for (int k = 0; k < 2; k++) positions[sphere_count].push_back(p[k] + 12.0f * (frand() - 0.5f));
+            positions[sphere_count].push_back(p[2]);
+        }
+        orient_triangle(positions[sphere_count], indices[sphere_count], indices[sphere_count].size() - 3, toward_camera, false);
+    }
+
+    std::vector<float> rays;
+    make_rays(dim, ray_count, rays);
+
+    const char* names[2] = { "meshes", "triangles" };
+    std::vector<Shaded_Ray> results[2];
+    printf("%-10s %8s %10s %10s %8s %10s\n", "scene", "prims", "build ms", "Mrays/s", "hits", "mismatch");
+    for (int s = 0; s < 2; s++)
+    {
+        Scene scene;
+        M3DVector3f room; m3dLoadVector3(room, dim, dim, dim);
+        scene.set_dim(room);
+        M3DVector3f color; m3dLoadVector3(color, 0.8f, 0.8f, 0.8f);
+        Material_Id material = scene.add_material(Triangle_Mesh::default_material(color));
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int prims = 0;
+        for (size_t m = 0; m < positions.size(); m++)
+        {
+            if (s == 0)
+            {
+                scene.add_primitive(scene.create_primitive<Triangle_Mesh>(positions[m], indices[m], material));
+                prims++;
+            }
+            else
+            {
+                add_triangles(scene, positions[m], indices[m], material);
+                prims += (int)indices[m].size() / 3;
+            }
+        }
+        scene.set_accel(_k_accel_bvh);
+        double build_ms = 1000.0 * seconds_since(start);
+
+        std::vector<Basic_Primitive*> hits;
+        double rays_per_second = trace_rays(scene, rays, hits);
+        shade_rays(scene, rays, results[s]);
+        int hit_count = 0;
+        for (int r = 0; r < ray_count; r++)
+            if (results[s][r].hit) hit_count++;
+
+        // Both trace the same Möller-Trumbore test on the same edges, so
+        // nothing may differ at all
+        printf("%-10s %8d %10.2f %10.2f %8d %10d\n", names[s], prims, build_ms, rays_per_second * 1e-6, hit_count,
+            count_mismatches(results[0], results[s], dim, 0.0f).mismatch);
+    }
+}
+
+void run_instance_benchmark(int ray_count)
+{
+    const float dim = 512.0f;
+    const int grid = 4;     // grid^3 placed copies, one per cell so none overlap
+    srand(1357);
+
+    // Shared geometry in object space: a tessellated and an analytic unit sphere
+    std::vector<float> positions;
+    std::vector<unsigned int> indices;
+    make_sphere_mesh(1.0f, 24, 48, positions, indices);
+    const int mesh_triangles = (int)indices.size() / 3;
+
+    // Per copy: object to world transform, a random rotation, a uniform scale
+    // that keeps it inside its cell, and a position jittered in the cell
+    std::vector<float> xforms;
+    const float cell = dim / grid;
+    for (int c = 0; c < grid * grid * grid; c++)
+    {
+        M3DMatrix44f rotation, xform;
+        M3DVector3f axis; m3dLoadVector3(axis, frand() - 0.5f, frand() - 0.5f, frand() - 0.5f);
+        m3dNormalizeVector(axis);
+        m3dRotationMatrix44(rotation, 6.2831853f * frand(), axis[0], axis[1], axis[2]);
+        float scale = cell * (0.2f + 0.15f * frand());
+        for (int k = 0; k < 16; k++) xform[k] = k % 4 < 3 && k < 12 ? rotation[k] * scale : rotation[k];
+        xform[12] = cell * (c % grid + 0.5f) + (cell / 2.0f - scale) * (frand() - 0.5f);
+        xform[13] = cell * (c / grid % grid + 0.5f) + (cell / 2.0f - scale) * (frand() - 0.5f);
+        xform[14] = cell * (c / (grid * grid) + 0.5f) + (cell / 2.0f - scale) * (frand() - 0.5f);
+        xforms.insert(xforms.end(), xform, xform + 16);
+    }
+    const int copies = (int)xforms.size() / 16;
+
+    std::vector<float> rays;
+    make_rays(dim, ray_count, rays);
+
+    // Every other copy is the mesh; the rest are the analytic sphere
+    const char* names[2] = { "instances", "copies" };
+    std::vector<Shaded_Ray> results[2];
+    printf("%-10s %8s %10s %10s %10s %8s %10s %8s %10s\n", "scene", "prims", "triangles", "build ms", "Mrays/s", "hits", "mismatch",
+        "edge", "terminator");
+    for (int s = 0; s < 2; s++)
+    {
+        Scene scene;
+        M3DVector3f room; m3dLoadVector3(room, dim, dim, dim);
+        scene.set_dim(room);
+        M3DVector3f mesh_color; m3dLoadVector3(mesh_color, 0.8f, 0.8f, 0.8f);
+        M3DVector3f sphere_color; m3dLoadVector3(sphere_color, 1.0f, 0.41f, 0.71f);
+        Material_Id mesh_material = scene.add_material(Triangle_Mesh::default_material(mesh_color));
+        Material_Id sphere_material = scene.add_material(Sphere::default_material(sphere_color));
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int triangles = 0;
+        if (s == 0)
+        {
+            M3DVector3f origin = { 0.0f, 0.0f, 0.0f };
+            Basic_Primitive* mesh = scene.add_geometry(scene.create_primitive<Triangle_Mesh>(positions, indices, mesh_material));
+            Basic_Primitive* sphere = scene.add_geometry(scene.create_primitive<Sphere>(origin, 1.0f, sphere_material));
+            for (int c = 0; c < copies; c++)
+                scene.add_instance(c % 2 == 0 ? mesh : sphere, &xforms[16 * c]);
+            triangles = mesh_triangles;
+        }
+        else
+        {
+            // The same transforms applied up front
+            for (int c = 0; c < copies; c++)
+            {
+                const float* xform = &xforms[16 * c];
+                if (c % 2 == 0)
+                {
+                    std::vector<float> moved(positions.size());
+                    for (size_t i = 0; i < positions.size(); i += 3)
+                        m3dTransformVector3(&moved[i], &positions[i], xform);
+                    scene.add_primitive(new Triangle_Mesh(moved, indices, mesh_material));
+                    triangles += mesh_triangles;
+                }
+                else
+                {
+                    M3DVector3f center; m3dLoadVector3(center, xform[12], xform[13], xform[14]);
+                    scene.add_primitive(new Sphere(center, sqrtf(m3dDotProduct(xform, xform)), sphere_material));
+                }
+            }
+        }
+        scene.set_accel(_k_accel_bvh);
+        double build_ms = 1000.0 * seconds_since(start);
+
+        std::vector<Basic_Primitive*> hits;
+        double rays_per_second = trace_rays(scene, rays, hits);
+        shade_rays(scene, rays, results[s]);
+        int hit_count = 0;
+        for (int r = 0; r < ray_count; r++)
+            if (results[s][r].hit) hit_count++;
+
+        // Object space tracing rounds differently, so values only agree to a tolerance
+        Mismatch_Count count = count_mismatches(results[0], results[s], dim, 1e-3f);
+        printf("%-10s %8d %10d %10.2f %10.2f %8d %10d %8d %10d\n", names[s], copies, triangles, build_ms, rays_per_second * 1e-6,
+            hit_count, count.mismatch, count.edge, count.terminator);
+    }
+}
+
+// A sphere or, one time in four, a small triangle at a random place in the
+// room; drawn once and made in each scene that gets it
+struct Prim_Spec
+{
+    bool        sphere;
+    M3DVector3f v[3];       // center, or the three corners
+    float       rad;
+};
+
+static void random_spec(float dim, Prim_Spec& spec)
+{
+    spec.sphere = rand() % 4 != 0;
+    m3dLoadVector3(spec.v[0], dim * frand(), dim * frand(), dim * frand());
+    for (int c = 1; c < 3; c++)
+        for (int k = 0; k < 3; k++) spec.v[c][k] = spec.v[0][k] + 10.0f * (frand() - 0.5f);
+    spec.rad = 2.0f + 4.0f * frand();
+}
+
+static Basic_Primitive* make_primitive(Scene& scene, Prim_Spec& spec, Material_Id material)
+{
+    if (spec.sphere) return scene.create_primitive<Sphere>(spec.v[0], spec.rad, material);
+    return scene.create_primitive<Triangle>(spec.v[0], spec.v[1], spec.v[2], material);
+}
+
+// Rays that find a different closest primitive or distance, or a different
+// shadow answer within tmax, in the two scenes
+static int compare_scenes(Scene& a, Scene& b, const std::vector<float>& rays, float tmax)
+{
+    int mismatch = 0;
+    for (size_t r = 0; r < rays.size(); r += 6)
+    {
+        Hit_Record hit_a, hit_b;
+        a.intersection_check(&rays[r], &rays[r + 3], hit_a);
+        b.intersection_check(&rays[r], &rays[r + 3], hit_b);
+        bool same = hit_a.prim_id == hit_b.prim_id && (hit_a.prim == NULL || hit_a.t == hit_b.t);
+        if (!same || a.occluded(&rays[r], &rays[r + 3], tmax) != b.occluded(&rays[r], &rays[r + 3], tmax)) mismatch++;
+    }
+    return mismatch;
+}
+
+void run_update_benchmark(int update_count, int ray_count)
+{
+    const float dim = 512.0f;
+    const int sizes[3] = { 1000, 10000, 100000 };
+    const int check_interval = 250;
+
+    printf("%8s %9s %9s %9s %9s %9s %11s %8s %10s\n", "prims", "move us", "jump us", "add us", "remove us", "worst ms", "rebuild ms", "checks", "mismatch");
+    for (int s = 0; s < 3; s++)
+    {
+        srand(97531 + s);
+
+        // Both scenes get the same primitives and the same updates; 'live'
+        // follows them incrementally, 'fresh' is rebuilt before every check
+        Scene live, fresh;
+        Scene* scenes[2] = { &live, &fresh };
+        std::vector<Basic_Primitive*> prims[2];     // by id, mirroring the scenes' swap-remove
+        Material_Id material[2];
+        M3DVector3f room; m3dLoadVector3(room, dim, dim, dim);
+        M3DVector3f color; m3dLoadVector3(color, 1.0f, 1.0f, 1.0f);
+        for (int k = 0; k < 2; k++)
+        {
+            scenes[k]->set_dim(room);
+            material[k] = scenes[k]->add_material(Sphere::default_material(color));
+        }
+        for (int i = 0; i < sizes[s]; i++)
+        {
+            Prim_Spec spec;
+            random_spec(dim, spec);
+            for (int k = 0; k < 2; k++)
+            {
+                prims[k].push_back(make_primitive(*scenes[k], spec, material[k]));
+                scenes[k]->add_primitive(prims[k].back());
+            }
+        }
+        live.set_accel(_k_accel_bvh);
+
+        std::vector<float> rays;
+        make_rays(dim, ray_count, rays);
+
+        // Mostly small moves, as in an animation, with the odd jump across
+        // the room, and as many adds as removes so the size stays put
+        enum { k_move, k_jump, k_add, k_remove, k_ops };
+        std::vector<double> op_us[k_ops];
+        double rebuild_ms = 0.0;
+        int checks = 0, mismatch = 0;
+        for (int u = 1; u <= update_count; u++)
+        {
+            int roll = rand() % 20;
+            int op = roll < 11 ? k_move : (roll < 12 ? k_jump : (roll < 16 ? k_add : k_remove));
+            int id = rand() % (int)prims[0].size();
+            float reach = op == k_jump ? dim / 2.0f : 4.0f;
+            M3DVector3f offset; m3dLoadVector3(offset, reach * (frand() - 0.5f), reach * (frand() - 0.5f), reach * (frand() - 0.5f));
+            Prim_Spec spec;
+            random_spec(dim, spec);
+            for (int k = 0; k < 2; k++)
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                if (op == k_move || op == k_jump)
+                {
+                    scenes[k]->move_primitive(prims[k][id], offset);
+                }
+                else if (op == k_add)
+                {
+                    prims[k].push_back(make_primitive(*scenes[k], spec, material[k]));
+                    scenes[k]->add_primitive(prims[k].back());
+                }
+                else
+                {
+                    scenes[k]->remove_primitive(prims[k][id]);
+                    prims[k][id] = prims[k].back();
+                    prims[k].pop_back();
+                }
+                if (k == 0) op_us[op].push_back(1e6 * seconds_since(start));
+            }
+
+            if (u % check_interval == 0)
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                fresh.set_accel(_k_accel_bvh);
+                rebuild_ms += 1000.0 * seconds_since(start);
+                mismatch += compare_scenes(live, fresh, rays, dim);
+                checks++;
+            }
+        }
+
+        // Medians: the odd update that rebuilds a degraded subtree shows up
+        // in the worst case instead
+        double median[k_ops], worst = 0.0;
+        for (int op = 0; op < k_ops; op++)
+        {
+            std::sort(op_us[op].begin(), op_us[op].end());
+            median[op] = op_us[op].empty() ? 0.0 : op_us[op][op_us[op].size() / 2];
+            if (!op_us[op].empty()) worst = std::max(worst, op_us[op].back());
+        }
+        printf("%8d %9.2f %9.2f %9.2f %9.2f %9.2f %11.2f %8d %10d\n", sizes[s], median[k_move], median[k_jump], median[k_add],
+            median[k_remove], worst * 1e-3, checks ? rebuild_ms / checks : 0.0, checks, mismatch);
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+// Times the acceleration structures on particle-style scenes: sphere_count
+// similar-sized spheres spread evenly through a 512^3 room, then the same
+// count gathered into a few dense clusters. For each backend it prints the
+// build time and closest-hit throughput for ray_count random rays, and how
+// many of those rays hit a different primitive than with the BVH.
+// Run with "RayTracer -bench_accel".
+void run_accel_benchmark(int sphere_count = 20000, int ray_count = 500000);
+
+// Measures what Ray_Queue::sort_coherent buys secondary rays. The room
+// scene and uniform / clustered sphere_count sphere scenes are hit by one
+// primary ray per pixel; the shadow rays toward the scene light and the
+// mirror reflection rays of those hits are then traced as packets of
+// consecutive rays, once in pixel order and once sorted. Prints per ray the
+// time, the BVH node fetches, the modelled L1 misses and the primitive
+// tests, and the share of packets coherent enough to trace together. The
+// node, miss and primitive columns are only printed in a build with
+// RT_TRAVERSAL_STATS=1.
+// Run with "RayTracer -bench_sort".
+void run_ray_sort_benchmark(int sphere_count = 100000);
+
+// Checks Triangle_Mesh against the same triangles as separate Triangle
+// primitives: tessellated spheres and a triangle soup go into one scene as
+// meshes, each with its own BLAS, and into another triangle by triangle.
+// ray_count random rays must give the same hit, point, normal, shadow and
+// shaded color in both. Prints build time, closest-hit throughput and the
+// rays that differ. Run with "RayTracer -bench_mesh".
+void run_mesh_benchmark(int ray_count = 200000);
+
+// Checks Instance against transformed copies: 64 rotated, scaled and
+// placed references to one shared tessellated sphere and one analytic
+// sphere, and the same 64 made with new, their vertices and centers moved
+// by the transforms up front. ray_count random rays must give the same
+// hit, point, normal, shadow and shaded color in both, to float rounding.
+// Prints the triangles stored, build time, closest-hit throughput and the
+// rays that differ, which must be none. Rays that rounding alone decides
+// are listed apart: hits on a shared mesh edge that land on the other facet
+// (edge), and shadows where the light grazes the surface closer than float
+// resolves at the renderer's shadow offset (terminator).
+// Run with "RayTracer -bench_instance".
+void run_instance_benchmark(int ray_count = 200000);
+
+// Checks the scene update API against rebuilding: scenes of 1000, 10000
+// and 100000 spheres and triangles take update_count random moves (mostly
+// small, now and then across the room), adds and removes. A twin scene
+// takes the same updates and is rebuilt with set_accel() every 250 of
+// them; then ray_count random rays must find the same closest primitive at
+// the same distance and the same shadow answer in both. Prints the median
+// cost of each kind of update (small moves and jumps apart), the worst
+// single update (one that rebuilt a degraded subtree), the full rebuild
+// time for comparison and the rays that differ. Run with "RayTracer -bench_update".
+void run_update_benchmark(int update_count = 2000, int ray_count = 20000);
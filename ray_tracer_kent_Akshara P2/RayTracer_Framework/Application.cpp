@@ -1,9 +1,23 @@
 #include "Application.h"
 
 Application::Application()
+	: _ray_tracer("scene_accel.cache")
 {
+#if RT_CHECKPOINT_SECONDS > 0
+	_ray_tracer.set_checkpoint("results_ray_tracing.ckpt", true, RT_CHECKPOINT_SECONDS);
+#endif
+#if RT_PIPELINED_OUTPUT
+	// A single frame only gains from the pipeline with a fixed white point
+	if (_ray_tracer.white_point_known())
+	{
+		_ray_tracer.run_to_file(view_result, "results_ray_tracing.ppm");
+		return;
+	}
+#endif
 	_ray_tracer.run(view_result);
-	WriteFile();
+	// The checkpoint is only dropped once the frame is safely on disk
+	if (WriteFile())
+		_ray_tracer.discard_checkpoint();
 }
 
 Application::~Application()
@@ -95,14 +109,14 @@ void Application::ReadFile(char * file)
 
 }
 
-void Application::WriteFile()
+bool Application::WriteFile()
 {
    FILE *fp;
    char imageType[3],str[100];
    int dummy,i;
    char *file = "results_ray_tracing.ppm";
    if(file == NULL)
-		return;
+		return false;
 
    // Write PGM image file with filename "file"
 
@@ -119,6 +133,8 @@ void Application::WriteFile()
    // binary pixel data with three bytes per pixel (one byte for each R,G,B)
 
     fp=fopen(file,"wb");
+    if(fp == NULL)
+		return false;
 
     // write the first ASCII line with the file type
 	if(view_result.ncolorChannels==1)
@@ -137,7 +153,8 @@ void Application::WriteFile()
     for(i=view_result.ny-1;i>=0;i--)
   	  fwrite(&view_result.data[i*view_result.nx*view_result.ncolorChannels],sizeof(unsigned char),view_result.nx*view_result.ncolorChannels,fp);
 
-	fclose(fp);
+	bool ok = ferror(fp) == 0;
+	return fclose(fp) == 0 && ok;
 }
 
 // flips an image upside down
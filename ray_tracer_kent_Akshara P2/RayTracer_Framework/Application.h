@@ -17,7 +17,7 @@ public:
 	const Image & get_image() const {	return view_result; }
 private:
 	void ReadFile(char * file);
-	void WriteFile();
+	bool WriteFile();
 	void FlipImage(Image *img);
 private:
 	Ray_Tracer	_ray_tracer;
@@ -0,0 +1,160 @@
+#include "Frame_Pipeline.h"
+#include <string.h>
+#include <algorithm>
+
+bool Frame_Pipeline::start(Image& image, float white_point, const char* path)
+{
+    finish();
+    _file = NULL;
+    if (path != NULL)
+    {
+        _file = fopen(path, "wb");
+        if (_file == NULL) return false;
+        fprintf(_file, "P%d\n%d %d\n255\n", image.ncolorChannels == 1 ? 5 : 6, image.nx, image.ny);
+        _header = ftell(_file);
+    }
+    _image = &image;
+    _white_point = white_point > 0.0f ? white_point : 1.0f;
+
+    _bands.clear();
+    _queued_pixels = 0;
+    _rows.clear();
+    _row_pixels.assign(image.ny, 0);
+    _rendering = true;
+    _tonemapping = true;
+    _rows_left = _file != NULL ? image.ny : 0;
+    _ok = true;
+    _frame_max = 0.0f;
+    _tonemapper = std::thread(&Frame_Pipeline::tonemap_loop, this);
+    if (_file != NULL) _writer = std::thread(&Frame_Pipeline::write_loop, this);
+    return true;
+}
+
+void Frame_Pipeline::push(const Tile& band)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _bands.push_back(band);
+    _queued_pixels += band.pixel_count();
+
+    // Wake the tonemapper for batches of rows rather than every band, so
+    // it does not keep taking turns with the render threads
+    if (_queued_pixels >= k_batch_rows * _image->nx)
+    {
+        _queued_pixels = 0;
+        _band_ready.notify_one();
+    }
+}
+
+bool Frame_Pipeline::finish()
+{
+    if (_image == NULL) return _ok;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _rendering = false;
+        _band_ready.notify_one();
+    }
+    if (_tonemapper.joinable()) _tonemapper.join();
+    if (_writer.joinable()) _writer.join();
+    if (_file != NULL)
+    {
+        if (fclose(_file) != 0) _ok = false;
+        _file = NULL;
+    }
+    _image = NULL;
+    return _ok;
+}
+
+void Frame_Pipeline::tonemap_loop()
+{
+    const int channels = _image->ncolorChannels;
+    std::unique_lock<std::mutex> lock(_lock);
+    for (;;)
+    {
+        _band_ready.wait(lock, [&]() { return !_bands.empty() || !_rendering; });
+        if (_bands.empty())
+        {
+            _tonemapping = false;
+            _row_ready.notify_one();
+            return;
+        }
+        Tile band = _bands.front();
+        _bands.pop_front();
+        lock.unlock();
+
+        // Same quantization as Ray_Tracer::run with max_v = _white_point
+        float band_max = 0.0f;
+        for (int j = band.y0; j < band.y1; ++j)
+        {
+            int first = (j * _image->nx + band.x0) * channels, last = (j * _image->nx + band.x1) * channels;
+            for (int k = first; k < last; ++k)
+            {
+                if (_image->fdata[k] > band_max) band_max = _image->fdata[k];
+                float v = (_image->fdata[k] / _white_point) * 255.0f;
+                if (v < 0.0f) v = 0.0f;
+                if (v > 255.0f) v = 255.0f;
+                _image->data[k] = (unsigned char)(v);
+            }
+        }
+
+        lock.lock();
+        if (band_max > _frame_max) _frame_max = band_max;
+        for (int j = band.y0; j < band.y1; ++j)
+        {
+            _row_pixels[j] += band.width();
+            if (_row_pixels[j] == _image->nx && _file != NULL)
+            {
+                _rows.push_back(j);
+                _row_ready.notify_one();
+            }
+        }
+    }
+}
+
+void Frame_Pipeline::write_loop()
+{
+    const size_t row_bytes = (size_t)_image->nx * _image->ncolorChannels;
+    std::vector<int> rows;
+    std::vector<unsigned char> run;
+    std::unique_lock<std::mutex> lock(_lock);
+    while (_rows_left > 0)
+    {
+        // No more rows complete once the tonemapper has stopped
+        _row_ready.wait(lock, [&]() { return !_rows.empty() || !_tonemapping; });
+        if (_rows.empty()) return;
+        rows.assign(_rows.begin(), _rows.end());
+        _rows.clear();
+        _rows_left -= (int)rows.size();
+        lock.unlock();
+
+        // The file holds the bottom row first, as Application::WriteFile
+        // stores it: rows j, j - 1, ... are one contiguous run there
+        std::sort(rows.begin(), rows.end());
+        bool ok = true;
+        for (int last = (int)rows.size() - 1; last >= 0 && ok; )
+        {
+            int first = last;
+            while (first > 0 && rows[first - 1] == rows[first] - 1) first--;
+            run.resize((last - first + 1) * row_bytes);
+            for (int k = last; k >= first; k--)
+                memcpy(&run[(last - k) * row_bytes], &_image->data[(size_t)rows[k] * row_bytes], row_bytes);
+            long offset = _header + (long)(_image->ny - 1 - rows[last]) * (long)row_bytes;
+            ok = fseek(_file, offset, SEEK_SET) == 0 && fwrite(&run[0], 1, run.size(), _file) == run.size();
+            last = first - 1;
+        }
+
+        lock.lock();
+        if (!ok) _ok = false;
+    }
+}
+
+bool Frame_Pipeline::write_file(const Image& image, const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) return false;
+    fprintf(file, "P%d\n%d %d\n255\n", image.ncolorChannels == 1 ? 5 : 6, image.nx, image.ny);
+    const size_t row_bytes = (size_t)image.nx * image.ncolorChannels;
+    bool ok = true;
+    for (int j = image.ny - 1; j >= 0; j--)
+        ok = ok && fwrite(&image.data[j * row_bytes], 1, row_bytes, file) == row_bytes;
+    return fclose(file) == 0 && ok;
+}
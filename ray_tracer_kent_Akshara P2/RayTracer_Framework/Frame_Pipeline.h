@@ -0,0 +1,72 @@
+#pragma once
+#include "common/image_volume.h"
+#include "Tile_Scheduler.h"
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Output stages that run beside the render threads. Render workers push
+// every band of pixels they finish; a tonemap thread turns the band's
+// image.fdata into image.data right away, and once a whole image row is
+// done a writer thread stores it at its place in the PPM file. The file
+// holds the rows bottom up, like Application::WriteFile writes them.
+//
+// Tonemapping a band before the frame is finished needs the white point
+// up front, so the pipeline scales by a given value instead of the frame's
+// maximum; frame_max() tells afterwards whether that was the right one.
+class Frame_Pipeline
+{
+public:
+    Frame_Pipeline() : _image(NULL), _white_point(1.0f), _file(NULL), _header(0), _queued_pixels(0), _rendering(false), _tonemapping(false), _rows_left(0), _ok(true), _frame_max(0.0f) {}
+    ~Frame_Pipeline() { finish(); }
+
+    // Starts the stages for an allocated image (nx, ny, fdata and data set).
+    // 'path' may be NULL to tonemap without writing a file. False if the
+    // file cannot be created; the stages then do not run.
+    bool start(Image& image, float white_point, const char* path);
+
+    // Pixels [x0, x1) x [y0, y1) of image.fdata are final
+    void push(const Tile& band);
+
+    // Waits for every pushed pixel to be tonemapped and written; false if
+    // a write failed
+    bool finish();
+
+    static const int    k_batch_rows = 16;  // image rows' worth of bands per tonemapper wake-up
+
+    // Brightest channel of the pushed pixels, valid after finish()
+    inline float frame_max() const { return _frame_max; }
+
+    // The whole of image.data as a PPM file, the same bytes the stages write
+    static bool write_file(const Image& image, const char* path);
+
+private:
+    Frame_Pipeline(const Frame_Pipeline&);
+    Frame_Pipeline& operator=(const Frame_Pipeline&);
+
+    void tonemap_loop();
+    void write_loop();
+
+private:
+    Image*                  _image;
+    float                   _white_point;
+    FILE*                   _file;
+    long                    _header;        // bytes before the first pixel row
+    std::mutex              _lock;
+    std::condition_variable _band_ready;    // wakes the tonemapper
+    std::condition_variable _row_ready;     // wakes the writer
+    std::deque<Tile>        _bands;         // rendered, not tonemapped yet
+    int                     _queued_pixels; // pushed since the tonemapper was last woken
+    std::vector<int>        _row_pixels;    // per row, pixels tonemapped so far
+    std::deque<int>         _rows;          // complete rows, not written yet
+    bool                    _rendering;     // cleared by finish(): no more bands
+    bool                    _tonemapping;   // cleared when the tonemapper stops
+    int                     _rows_left;     // rows the writer has still to store
+    bool                    _ok;
+    float                   _frame_max;
+    std::thread             _tonemapper;
+    std::thread             _writer;
+};
@@ -1,71 +1,140 @@
-#ifdef __APPLE__
-#include <OpenGL/gl.h>
-#include <GLUT/glut.h>
-#else
-#include <GL/gl.h>
-#include <GL/glut.h>
-#endif
-#include <stdlib.h>
-#include "Application.h"
-Application application;
-GLuint texture_id;
-
-void display()
-{
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);   
-	glClearColor(1.0, 1.0, 1.0,0.0);	
-	glBegin(GL_QUADS);
-		glTexCoord2f(0.0,0.0);
-		glVertex2f(0.0, 0.0);
-
-		glTexCoord2f(0.0, 1.0);
-		glVertex2f(0.0, 1.0);
-
-		glTexCoord2f(1.0, 1.0);
-		glVertex2f(1.0, 1.0);
-
-		glTexCoord2f(1.0, 0.0);
-		glVertex2f(1.0, 0.0);
-	glEnd();
-	
-	glutSwapBuffers();
-}
-
-void reshape(int w, int h)
-{
-	if(h == 0) h = 1;
-	glViewport(0, 0, w, h ); 
-	
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity(); 
-	gluOrtho2D(-0.1, 1.1, -0.1, 1.1);
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
-}
-
-void create_texture()
-{
-	glGenTextures(1, &texture_id);
-	glBindTexture(GL_TEXTURE_2D, texture_id);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	const Image & view_result = application.get_image();
-	glTexImage2D(GL_TEXTURE_2D, 0, 3, view_result.nx, view_result.ny, 0, GL_RGB, GL_UNSIGNED_BYTE, view_result.data);
-	glEnable(GL_TEXTURE_2D);
-}
-
-int main(int argc, char *argv[])
-{
-	glutInit(&argc, (char **)argv);
-	glutInitDisplayMode(GLUT_DOUBLE|GLUT_RGB);
-	glutInitWindowSize(600, 600);
-	glutCreateWindow("Ray Tracing");
-	glutReshapeFunc(reshape);
-	glutDisplayFunc(display);
-	create_texture();
-	glutMainLoop();
-	glDeleteTextures( 1, &texture_id);
-	return 0;
-}
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#include <GLUT/glut.h>
+#else
+#include <GL/gl.h>
+#include <GL/glut.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "Application.h"
+#include "Accel_Benchmark.h"
+#include "Render_Benchmark.h"
+#include "Render_Cluster.h"
+Application * application = NULL;	// renders in its constructor, so made only for the window
+GLuint texture_id;
+
+void display()
+{
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);   
+	glClearColor(1.0, 1.0, 1.0,0.0);	
+	glBegin(GL_QUADS);
+		glTexCoord2f(0.0,0.0);
+		glVertex2f(0.0, 0.0);
+
+		glTexCoord2f(0.0, 1.0);
+		glVertex2f(0.0, 1.0);
+
+		glTexCoord2f(1.0, 1.0);
+		glVertex2f(1.0, 1.0);
+
+		glTexCoord2f(1.0, 0.0);
+		glVertex2f(1.0, 0.0);
+	glEnd();
+	
+	glutSwapBuffers();
+}
+
+void reshape(int w, int h)
+{
+	if(h == 0) h = 1;
+	glViewport(0, 0, w, h ); 
+	
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity(); 
+	gluOrtho2D(-0.1, 1.1, -0.1, 1.1);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+}
+
+void create_texture()
+{
+	glGenTextures(1, &texture_id);
+	glBindTexture(GL_TEXTURE_2D, texture_id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	const Image & view_result = application->get_image();
+	glTexImage2D(GL_TEXTURE_2D, 0, 3, view_result.nx, view_result.ny, 0, GL_RGB, GL_UNSIGNED_BYTE, view_result.data);
+	glEnable(GL_TEXTURE_2D);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "-bench_accel") == 0)
+	{
+		run_accel_benchmark();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "-bench_mesh") == 0)
+	{
+		run_mesh_benchmark();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "-bench_instance") == 0)
+	{
+		run_instance_benchmark();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "-bench_update") == 0)
+	{
+		run_update_benchmark();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "-bench_sort") == 0)
+	{
+		run_ray_sort_benchmark(argc > 2 ? atoi(argv[2]) : 100000);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "-bench_numa") == 0)
+	{
+		run_numa_benchmark();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "-bench_pipeline") == 0)
+	{
+		run_pipeline_benchmark();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "-bench_progressive") == 0)
+	{
+		run_progressive_benchmark(argc > 2 ? atof(argv[2]) : 200.0);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "-bench_render") == 0)
+	{
+		run_render_benchmark(argc > 2 ? atoi(argv[2]) : 0);
+		return 0;
+	}
+	if (argc > 2 && strcmp(argv[1], "-worker") == 0)
+	{
+		return run_render_worker(argv[2], argc > 3 ? atoi(argv[3]) : -1, "scene_accel.cache") < 0 ? 1 : 0;
+	}
+	if (argc > 2 && strcmp(argv[1], "-coordinator") == 0)
+	{
+		// One frame on the workers that connect, plus any started here; the
+		// tracer is built first so local workers find the BVH cache
+		Render_Coordinator coordinator;
+		if (!coordinator.listen(argv[2])) return 1;
+		Ray_Tracer tracer("scene_accel.cache");
+		coordinator.spawn_local_workers(argc > 3 ? atoi(argv[3]) : 0, "scene_accel.cache");
+		Image image = Image();
+		if (!tracer.run_distributed(image, coordinator)) return 1;
+		return Frame_Pipeline::write_file(image, "results_ray_tracing.ppm") ? 0 : 1;
+	}
+
+	application = new Application();
+
+	glutInit(&argc, (char **)argv);
+	glutInitDisplayMode(GLUT_DOUBLE|GLUT_RGB);
+	glutInitWindowSize(600, 600);
+	glutCreateWindow("Ray Tracing");
+	glutReshapeFunc(reshape);
+	glutDisplayFunc(display);
+	create_texture();
+	glutMainLoop();
+	glDeleteTextures( 1, &texture_id);
+	delete application;
+	return 0;
+}
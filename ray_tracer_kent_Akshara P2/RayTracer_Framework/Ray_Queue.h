@@ -0,0 +1,141 @@
+#pragma once
+#include "common/ray_packet.h"
+#include "primitives/Basic_Primitive.h"
+#include <algorithm>
+#include <vector>
+
+// Spreads the low 10 bits of v three bits apart, for 30-bit Morton codes
+inline unsigned int morton_spread(unsigned int v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Rays waiting for one wavefront stage, as structure-of-arrays. Each ray
+// remembers the entry of the previous stage it came from (a pixel, or a
+// hit); stages append only the rays that still have work to the next
+// queue, so every queue stays dense.
+struct Ray_Queue
+{
+    std::vector<float>  org[3];
+    std::vector<float>  dir[3];
+    std::vector<float>  tmax;       // shadow rays: how far the ray must stay clear
+    std::vector<int>    source;
+
+    inline int  size() const { return (int)source.size(); }
+
+    inline void clear()
+    {
+        for (int i = 0; i < 3; i++) { org[i].clear(); dir[i].clear(); }
+        tmax.clear();
+        source.clear();
+    }
+
+    inline void push(int from, const M3DVector3f start, const M3DVector3f direction, float t)
+    {
+        for (int i = 0; i < 3; i++) { org[i].push_back(start[i]); dir[i].push_back(direction[i]); }
+        tmax.push_back(t);
+        source.push_back(from);
+    }
+
+    inline void get(int r, M3DVector3f start, M3DVector3f direction) const
+    {
+        for (int i = 0; i < 3; i++) { start[i] = org[i][r]; direction[i] = dir[i][r]; }
+    }
+
+    // Rays [first, first + count) as one packet, count <= RT_PACKET_SIZE
+    inline void get_packet(int first, int count, Ray_Packet & packet) const
+    {
+        packet.active = 0;
+        for (int k = 0; k < count; k++)
+        {
+            M3DVector3f start, direction;
+            get(first + k, start, direction);
+            packet.set(k, start, direction);
+        }
+        packet.finish();
+    }
+
+    // Copy of the rays into 'out', ordered by direction octant and then by
+    // the Morton code of the origin within the bounds of all origins. Rays
+    // next to each other then start close together and head the same way,
+    // so packets taken from consecutive rays are coherent and walk the same
+    // BVH nodes. 'keys' is scratch space.
+    inline void sort_coherent(Ray_Queue & out, std::vector<unsigned long long> & keys) const
+    {
+        const int n = size();
+        float lo[3], scale[3];
+        for (int i = 0; i < 3; i++)
+        {
+            float hi = lo[i] = n > 0 ? org[i][0] : 0.0f;
+            for (int r = 1; r < n; r++)
+            {
+                if (org[i][r] < lo[i]) lo[i] = org[i][r];
+                if (org[i][r] > hi) hi = org[i][r];
+            }
+            scale[i] = hi > lo[i] ? 1023.0f / (hi - lo[i]) : 0.0f;
+        }
+
+        // octant (3 bits) | Morton code (30 bits) | ray index (31 bits)
+        keys.resize(n);
+        for (int r = 0; r < n; r++)
+        {
+            unsigned int octant = (dir[0][r] < 0.0f ? 1 : 0) | (dir[1][r] < 0.0f ? 2 : 0) | (dir[2][r] < 0.0f ? 4 : 0);
+            unsigned int morton = 0;
+            for (int i = 0; i < 3; i++)
+                morton |= morton_spread((unsigned int)((org[i][r] - lo[i]) * scale[i])) << i;
+            keys[r] = ((unsigned long long)octant << 61) | ((unsigned long long)morton << 31) | (unsigned long long)r;
+        }
+        std::sort(keys.begin(), keys.end());
+
+        out.clear();
+        for (int k = 0; k < n; k++)
+        {
+            int r = (int)(keys[k] & 0x7fffffff);
+            M3DVector3f start, direction;
+            get(r, start, direction);
+            out.push(source[r], start, direction, tmax[r]);
+        }
+    }
+};
+
+// Closest hits found by the intersection stage, one per primary ray that
+// hit something
+struct Hit_Queue
+{
+    std::vector<Hit_Record>         record;
+    std::vector<int>                ray;        // index into the primary queue
+    std::vector<char>               shadow;     // filled by the shadow stage
+
+    inline int  size() const { return (int)ray.size(); }
+
+    inline void clear()
+    {
+        record.clear();
+        ray.clear();
+        shadow.clear();
+    }
+
+    inline void push(int r, const Hit_Record& hit)
+    {
+        record.push_back(hit);
+        ray.push_back(r);
+        shadow.push_back(0);
+    }
+};
+
+// Everything one render thread needs for the wavefront stages; kept
+// between tiles so the queues are allocated once per frame
+struct Wavefront_Queues
+{
+    Ray_Queue           primary;
+    Hit_Queue           hits;
+    Ray_Queue           shadow;
+    Ray_Queue           sorted;         // shadow rays after sort_coherent
+    std::vector<unsigned long long> sort_keys;
+    std::vector<int>    shade_order;    // hits grouped by primitive type
+};
@@ -1,14 +1,59 @@
 ﻿#include "Ray_Tracer.h"
+#include "common/aligned_allocator.h"
+#include "common/hash.h"
+#include "common/simd_vector.h"
+#include "common/thread_affinity.h"
+#include "Render_Cluster.h"
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 
-Ray_Tracer::Ray_Tracer(void)
+static const int k_max_tile_size = 64;  // starting tile side; slow tiles are split from there
+static const int k_tiles_per_thread = 4;
+
+// Pixel block traced as one packet: 2x2 with SSE, 4x2 with AVX2
+static const int k_packet_rows = 2;
+static const int k_packet_width = RT_PACKET_SIZE / k_packet_rows;
+
+// Rows of a tile that go through the wavefront stages together; with
+// 64-pixel tiles a wavefront holds up to 1024 primary rays
+static const int k_wavefront_rows = 16;
+
+// Grid spacing of the first progressive pass; it ignores the budget, so
+// every pixel has a color however early the passes after it are cut off
+static const int k_progressive_seed_step = 32;
+
+// Frame maximum within this fraction of the white point run_to_file() guessed:
+// no channel moves by more than one code value, so the pipelined bytes are kept
+static const float k_white_point_slack = 1.0f / 512.0f;
+
+Ray_Tracer::Ray_Tracer(const char* accel_cache)
+    : _thread_count(RT_RENDER_THREADS)
+    , _show_progress(true)
+    , _render_mode((Render_Mode)RT_RENDER_MODE)
+    , _sort_rays(RT_SORT_RAYS != 0)
+    , _pin_threads(RT_PIN_THREADS != 0)
+    , _first_touch(RT_FIRST_TOUCH != 0)
+    , _tile_buffers(RT_TILE_BUFFERS != 0)
+    , _white_point(RT_WHITE_POINT)
+    , _last_max(0.0f)
+    , _checkpoint_resume(true)
+    , _checkpoint_flush(5.0)
+    , _resumed_pixels(0)
+    , _ray_count(0)
 {
     // Scene dimensions
     float dim = 512.0f;
     _dim[0] = dim; _dim[1] = dim; _dim[2] = dim;
 
-    // Build scene
+    // Build scene; with a cache file the BVH comes from it when the scene is unchanged
     _scene.set_dim(_dim);
+    _scene.set_accel_cache(accel_cache);
     _scene.assemble();
 
     // Setup view plane (orthonormal basis, pinhole eye)
@@ -23,6 +68,48 @@ Ray_Tracer::~Ray_Tracer(void)
 }
 
 void Ray_Tracer::run(Image& image)
+{
+    render(image, NULL);
+}
+
+bool Ray_Tracer::run_to_file(Image& image, const char* path)
+{
+    return render(image, path);
+}
+
+void Ray_Tracer::set_checkpoint(const char* path, bool resume, double flush_seconds)
+{
+    _checkpoint_path = path ? path : "";
+    _checkpoint_resume = resume;
+    _checkpoint_flush = flush_seconds;
+}
+
+void Ray_Tracer::discard_checkpoint()
+{
+    if (!_checkpoint_path.empty()) remove(_checkpoint_path.c_str());
+}
+
+unsigned long long Ray_Tracer::image_key() const
+{
+    M3DVector3f view[4];
+    _view_plane.get_origin(view[0]);
+    _view_plane.get_eye(view[1]);
+    _view_plane.get_u(view[2]);
+    _view_plane.get_v(view[3]);
+
+    unsigned long long h = _scene.content_hash();
+    h = fnv1a(view, sizeof(view), h);
+    return fnv1a(_dim, sizeof(_dim), h);
+}
+
+unsigned long long Ray_Tracer::frame_key() const
+{
+    const int mode = (int)_render_mode;
+    unsigned long long h = fnv1a(&mode, sizeof(mode), image_key());
+    return fnv1a(&_white_point, sizeof(_white_point), h);
+}
+
+bool Ray_Tracer::render(Image& image, const char* path)
 {
     // Image buffer setup
     image.ncolorChannels = 3;
@@ -33,45 +120,239 @@ void Ray_Tracer::run(Image& image)
     image.data = new unsigned char[image.n];
     image.fdata = new float[image.n];
 
-    // Ray gen / color buffers
-    M3DVector3f ray;
-    M3DVector3f color;
-    M3DVector3f pij;
+    // Output stages for run_to_file, running beside the render threads; the
+    // first frame without a fixed white point is written once it is done
+    Frame_Pipeline stages;
+    Frame_Pipeline* pipeline = NULL;
+    const float white_point = _white_point > 0.0f ? _white_point : _last_max;
+    if (path != NULL && white_point_known())
+    {
+        if (!stages.start(image, white_point, path)) return false;
+        pipeline = &stages;
+    }
 
-    printf("Start Ray Tracing (local shading only)...\n");
-    int lastPercent = -1;
+    // Bands restored from the checkpoint are skipped below; every band
+    // traced goes to its writer thread
+    Render_Checkpoint saved;
+    Render_Checkpoint* checkpoint = NULL;
+    if (!_checkpoint_path.empty() && saved.start(image, _checkpoint_path.c_str(), frame_key(), _checkpoint_resume, _checkpoint_flush))
+        checkpoint = &saved;
+    _resumed_pixels = checkpoint ? checkpoint->resumed_pixels() : 0;
+    if (_show_progress && _resumed_pixels > 0)
+        printf("Resuming: %d pixels restored from %s\n", _resumed_pixels, _checkpoint_path.c_str());
+
+    // Start with about k_tiles_per_thread tiles per thread, a multiple of the
+    // smallest tile the scheduler splits down to
+    const int threads = get_thread_count();
+    int tile_size = (int)sqrtf((float)image.nx * image.ny / (threads * k_tiles_per_thread));
+    tile_size -= tile_size % Tile_Scheduler::k_min_tile_size;
+    if (tile_size < Tile_Scheduler::k_min_tile_size) tile_size = Tile_Scheduler::k_min_tile_size;
+    if (tile_size > k_max_tile_size) tile_size = k_max_tile_size;
+    _scheduler.reset(threads, image.nx, image.ny, tile_size);
 
-    for (int j = 0; j < image.ny; ++j)
+    if (_show_progress)
+        printf("Start Ray Tracing (local shading only, %d threads)...\n", threads);
+
+    // Workers render a tile one band of rows at a time (a packet row, or a
+    // wavefront) so a tile that turns out to be expensive can hand its
+    // remaining rows back to the scheduler. This thread only prints the
+    // progress.
+    const int pixel_count = image.nx * image.ny;
+    const bool wavefront = _render_mode == _k_render_wavefront;
+    const int band_rows = wavefront ? k_wavefront_rows : k_packet_rows;
+    _ray_count = 0;
+    std::mutex progress_mutex;
+    std::condition_variable progress_changed;
+
+    std::vector<Cpu_Info> cpus;
+    if (_pin_threads) list_cpus(cpus);
+    int touching = threads;             // shares not zeroed yet; under touch_mutex
+    std::mutex touch_mutex;
+    std::condition_variable touched;
+    const bool first_touch = _first_touch && _resumed_pixels == 0;   // restored pixels are placed already
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
     {
-        for (int i = 0; i < image.nx; ++i)
-        {
-            // Pixel sample on view plane, then primary ray
-            _view_plane.get_pij(pij, (float)i, (float)j);
-            _view_plane.get_per_ray(ray, pij);
+        workers.push_back(std::thread([&, t]() {
+            if (_pin_threads) pin_current_thread(cpus[t % cpus.size()].cpu);
+
+            // Thread t's tiles were seeded from about this share of the rows.
+            // Nobody renders before every share is touched, or a stolen tile
+            // could place another thread's pages.
+            if (first_touch)
+            {
+                size_t row = (size_t)image.nx * 3;
+                size_t first = row * (image.ny * t / threads), last = row * (image.ny * (t + 1) / threads);
+                memset(image.fdata + first, 0, (last - first) * sizeof(float));
+                memset(image.data + first, 0, last - first);
+                std::unique_lock<std::mutex> lock(touch_mutex);
+                if (--touching == 0) touched.notify_all();
+                else touched.wait(lock, [&]() { return touching == 0; });
+            }
 
-            // Local Phong shading only (no recursion)
-            ray_tracing(pij, ray, color);
+            // Allocated and first written here, so it lives on this thread's node
+            std::vector<float, Aligned_Allocator<float, 64> > buffer;
+            const int buffer_stride = (tile_size * 3 + 15) & ~15;
+            if (_tile_buffers) buffer.resize((size_t)buffer_stride * band_rows);
 
-            const unsigned int idx = (j * image.nx + i) * 3u;
-            image.fdata[idx + 0] = color[0];
-            image.fdata[idx + 1] = color[1];
-            image.fdata[idx + 2] = color[2];
+            Wavefront_Queues queues;
+            Tile tile;
+            while (_scheduler.next(t, tile))
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                long long ns = 0;
+                int y = tile.y0;
+                while (y < tile.y1)
+                {
+                    int y_end = y + band_rows < tile.y1 ? y + band_rows : tile.y1;
+                    Tile band = { tile.x0, y, tile.x1, y_end };
+                    if (!checkpoint || !checkpoint->is_done(band))
+                    {
+                        Frame_Target target = { image.fdata, image.nx * 3, 0, 0 };
+                        if (_tile_buffers)
+                        {
+                            Frame_Target buffered = { &buffer[0], buffer_stride, tile.x0, y };
+                            target = buffered;
+                        }
+                        if (wavefront)
+                            render_tile_wavefront(target, tile.x0, y, tile.x1, y_end, queues);
+                        else
+                            render_tile(target, tile.x0, y, tile.x1, y_end);
+                        if (_tile_buffers)
+                        {
+                            for (int j = y; j < y_end; ++j)
+                                memcpy(image.fdata + ((size_t)j * image.nx + tile.x0) * 3, target.pixel(tile.x0, j), tile.width() * 3 * sizeof(float));
+                        }
+                        if (checkpoint) checkpoint->push(band);
+                    }
+                    if (pipeline) pipeline->push(band);
+                    y = y_end;
+                    ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                    if (y < tile.y1 && _scheduler.should_split(tile, y - tile.y0, ns))
+                    {
+                        Tile rest = { tile.x0, y, tile.x1, tile.y1 };
+                        _scheduler.split(t, rest);
+                        break;
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                _scheduler.finish(tile.width() * (y - tile.y0), ns);
+                progress_changed.notify_one();
+            }
+        }));
+    }
+
+    int lastPercent = -1;
+    {
+        std::unique_lock<std::mutex> lock(progress_mutex);
+        for (;;)
+        {
+            int pending = _scheduler.pending_pixels();
+            int percent = (int)((pixel_count - pending) * 100.0f / pixel_count);
+            if (_show_progress && percent != lastPercent) {
+                lastPercent = percent;
+                printf("\rProgress: %3d%%", percent);
+                fflush(stdout);
+            }
+            if (pending == 0) break;
+            progress_changed.wait(lock, [&]() { return _scheduler.pending_pixels() != pending; });
         }
+    }
+    for (size_t t = 0; t < workers.size(); ++t)
+        workers[t].join();
+    if (_show_progress)
+        printf("\nRay Tracing Finished! (%d steals, %d splits)\n", _scheduler.steal_count(), _scheduler.split_count());
+
+    // Every pixel is in image.fdata now, but the file is only removed once
+    // the frame is on disk: below for run_to_file, by the caller after run()
+    if (checkpoint) checkpoint->finish(false);
 
-        int percent = (int)((j + 1) * 100.0f / image.ny);
-        if (percent != lastPercent) {
-            lastPercent = percent;
-            printf("\rProgress: %3d%%", percent);
-            fflush(stdout);
+    float max_v = 0.0f;
+    if (pipeline)
+    {
+        if (!pipeline->finish()) return false;
+        max_v = pipeline->frame_max();
+        _last_max = max_v < 1e-8f ? 1.0f : max_v;
+        if (_white_point > 0.0f || fabsf(_last_max - white_point) <= white_point * k_white_point_slack)
+        {
+            discard_checkpoint();
+            return true;
         }
     }
-    printf("\nRay Tracing Finished!\n");
+    else
+    {
+        for (int k = 0; k < image.n; ++k)
+            if (image.fdata[k] > max_v) max_v = image.fdata[k];
+        _last_max = max_v < 1e-8f ? 1.0f : max_v;
+    }
 
     // Normalize to 0..255
+    if (_white_point > 0.0f) max_v = _white_point;
+    quantize(image, max_v);
+
+    // No white point to start a pipeline with, or it guessed one too far off
+    if (path != NULL)
+    {
+        if (!Frame_Pipeline::write_file(image, path)) return false;
+        discard_checkpoint();
+    }
+    return true;
+}
+
+bool Ray_Tracer::run_distributed(Image& image, Render_Coordinator& coordinator)
+{
+    image.ncolorChannels = 3;
+    image.nx = (int)_dim[0];
+    image.ny = (int)_dim[1];
+    image.n = image.nx * image.ny * image.ncolorChannels;
+
+    image.data = new unsigned char[image.n];
+    image.fdata = new float[image.n];
+
+    if (_show_progress)
+        printf("Start Ray Tracing (local shading only, on render workers)...\n");
+    if (!coordinator.render_frame(image, image_key(), k_max_tile_size)) return false;
+    if (_show_progress)
+        printf("Ray Tracing Finished! (%d workers, %d tiles re-queued)\n", coordinator.worker_count(), coordinator.requeue_count());
+
+    // Same tonemapping as run()
     float max_v = 0.0f;
     for (int k = 0; k < image.n; ++k)
         if (image.fdata[k] > max_v) max_v = image.fdata[k];
+    _last_max = max_v < 1e-8f ? 1.0f : max_v;
+    if (_white_point > 0.0f) max_v = _white_point;
+    quantize(image, max_v);
+    return true;
+}
+
+void Ray_Tracer::render_region(const Tile& region, float* out)
+{
+    // The threads take bands of rows of the region in turn
+    const bool wavefront = _render_mode == _k_render_wavefront;
+    const int band_rows = wavefront ? k_wavefront_rows : k_packet_rows;
+    const Frame_Target target = { out, region.width() * 3, region.x0, region.y0 };
+    std::atomic<int> next_band(0);
 
+    // A worker calls this once per tile, so the threads stay in the pool
+    _pool.run(get_thread_count(), [&](int) {
+        Wavefront_Queues queues;
+        for (;;)
+        {
+            int y = region.y0 + band_rows * next_band++;
+            if (y >= region.y1) return;
+            int y_end = y + band_rows < region.y1 ? y + band_rows : region.y1;
+            if (wavefront)
+                render_tile_wavefront(target, region.x0, y, region.x1, y_end, queues);
+            else
+                render_tile(target, region.x0, y, region.x1, y_end);
+        }
+    });
+}
+
+void Ray_Tracer::quantize(Image& image, float max_v)
+{
     if (max_v < 1e-8f) max_v = 1.0f; // avoid divide-by-zero; produce black
 
     for (int k = 0; k < image.n; ++k)
@@ -83,27 +364,326 @@ void Ray_Tracer::run(Image& image)
     }
 }
 
+int Ray_Tracer::run_progressive(Image& image, double budget_ms, const std::atomic<bool>* cancel)
+{
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point begin = Clock::now();
+    const Clock::time_point deadline = begin + std::chrono::microseconds((long long)(budget_ms * 1000.0));
+
+    image.ncolorChannels = 3;
+    image.nx = (int)_dim[0];
+    image.ny = (int)_dim[1];
+    image.n = image.nx * image.ny * image.ncolorChannels;
+    image.data = new unsigned char[image.n];
+    image.fdata = new float[image.n];
+
+    const int nx = image.nx, ny = image.ny;
+    const int threads = get_thread_count();
+    std::vector<float> sum;             // sample passes: color sums per pixel
+    std::vector<int> row_samples;       // sample passes: samples every pixel of the row has
+    _passes.clear();
+
+    // Each pass hands out rows (of its grid) to the pool threads; after the
+    // seed pass a thread stops taking rows once the time is up, so a
+    // cut-short pass still leaves only whole rows behind
+    int complete = 0;
+    for (int step = k_progressive_seed_step, samples = 1; samples <= k_max_samples; )
+    {
+        Progressive_Pass pass = { step, samples, 0.0, false };
+        const Clock::time_point pass_begin = Clock::now();
+        const int rows = (ny + step - 1) / step;
+        std::atomic<int> next_row(0), rows_done(0);
+
+        if (step == 1 && samples > 1 && sum.empty())
+        {
+            sum.assign(image.fdata, image.fdata + image.n);
+            row_samples.assign(ny, 1);
+        }
+
+        _pool.run(threads, [&](int) {
+            for (;;)
+            {
+                if (step < k_progressive_seed_step && ((cancel && *cancel) || Clock::now() >= deadline)) return;
+                int r = next_row++;
+                if (r >= rows) return;
+
+                if (samples == 1)
+                {
+                    // Grid points of the coarser passes are traced already;
+                    // every new one paints its step x step block
+                    int j = r * step;
+                    for (int i = 0; i < nx; i += step)
+                    {
+                        if (step < k_progressive_seed_step && i % (2 * step) == 0 && j % (2 * step) == 0) continue;
+                        M3DVector3f color;
+                        trace_sample((float)i, (float)j, color);
+                        for (int y = j; y < j + step && y < ny; ++y)
+                            for (int x = i; x < i + step && x < nx; ++x)
+                            {
+                                float* out = image.fdata + ((size_t)y * nx + x) * 3;
+                                out[0] = color[0]; out[1] = color[1]; out[2] = color[2];
+                            }
+                    }
+                }
+                else
+                {
+                    // Jittered samples n = row_samples .. samples - 1 on a
+                    // 2D golden-ratio sequence around the pixel position
+                    int j = r;
+                    for (int i = 0; i < nx; ++i)
+                    {
+                        float* acc = &sum[((size_t)j * nx + i) * 3];
+                        for (int n = row_samples[j]; n < samples; ++n)
+                        {
+                            float dx = (float)fmod(0.5 + n * 0.7548776662466927, 1.0) - 0.5f;
+                            float dy = (float)fmod(0.5 + n * 0.5698402909980532, 1.0) - 0.5f;
+                            M3DVector3f color;
+                            trace_sample(i + dx, j + dy, color);
+                            acc[0] += color[0]; acc[1] += color[1]; acc[2] += color[2];
+                        }
+                        float* out = image.fdata + ((size_t)j * nx + i) * 3;
+                        for (int c = 0; c < 3; ++c) out[c] = acc[c] / samples;
+                    }
+                    row_samples[j] = samples;
+                }
+                ++rows_done;
+            }
+        });
+
+        pass.complete = rows_done == rows;
+        pass.ms = std::chrono::duration<double, std::milli>(Clock::now() - pass_begin).count();
+        _passes.push_back(pass);
+        if (!pass.complete) break;
+        ++complete;
+        if (step > 1) step /= 2;
+        else samples *= 2;
+    }
+
+    // Same tonemapping as run()
+    float max_v = _white_point;
+    if (max_v <= 0.0f)
+    {
+        for (int k = 0; k < image.n; ++k)
+            if (image.fdata[k] > max_v) max_v = image.fdata[k];
+    }
+    quantize(image, max_v);
+    return complete;
+}
+
+void Ray_Tracer::trace_sample(float x, float y, M3DVector3f color)
+{
+    M3DVector3f ray, pij;
+    _view_plane.get_pij(pij, x, y);
+    _view_plane.get_per_ray(ray, pij);
+    ray_tracing(pij, ray, color);
+}
+
+int Ray_Tracer::get_thread_count() const
+{
+    if (_thread_count > 0) return _thread_count;
+    int hw = (int)std::thread::hardware_concurrency();
+    return hw > 0 ? hw : 1;
+}
+
+void Ray_Tracer::render_tile(const Frame_Target& target, int x0, int y0, int x1, int y1)
+{
+    M3DVector3f color[RT_PACKET_SIZE];
+
+    for (int j = y0; j < y1; j += k_packet_rows)
+    {
+        for (int i = x0; i < x1; i += k_packet_width)
+        {
+            Ray_Packet packet;
+            _view_plane.get_per_ray_packet(packet, i, j, k_packet_width);
+            for (int k = 0; k < RT_PACKET_SIZE; ++k)
+                if (i + k % k_packet_width < x1 && j + k / k_packet_width < y1) packet.active |= 1 << k;
+
+            // Rays fanning into different octants (blocks on the image center
+            // lines) and leftover single pixels are traced one by one
+            if (!packet.coherent() || lane_count(packet.active) < 2)
+            {
+                for (int k = 0; k < RT_PACKET_SIZE; ++k)
+                    if (packet.active & (1 << k)) render_pixel(target, i + k % k_packet_width, j + k / k_packet_width);
+                continue;
+            }
+
+            ray_tracing_packet(packet, color);
+            for (int k = 0; k < RT_PACKET_SIZE; ++k)
+            {
+                if (!(packet.active & (1 << k))) continue;
+                float* out = target.pixel(i + k % k_packet_width, j + k / k_packet_width);
+                out[0] = color[k][0];
+                out[1] = color[k][1];
+                out[2] = color[k][2];
+            }
+        }
+    }
+}
+
+void Ray_Tracer::render_tile_wavefront(const Frame_Target& target, int x0, int y0, int x1, int y1, Wavefront_Queues& queues)
+{
+    Ray_Queue& primary = queues.primary;
+    Hit_Queue& hits = queues.hits;
+    Ray_Queue& shadow = queues.shadow;
+    primary.clear();
+    hits.clear();
+    shadow.clear();
+
+    // Generate: primary rays of every pixel; the source is the pixel's
+    // offset in the target
+    for (int j = y0; j < y1; j += k_packet_rows)
+    {
+        for (int i = x0; i < x1; i += k_packet_width)
+        {
+            Ray_Packet packet;
+            _view_plane.get_per_ray_packet(packet, i, j, k_packet_width);
+            for (int k = 0; k < RT_PACKET_SIZE; ++k)
+            {
+                int pi = i + k % k_packet_width, pj = j + k / k_packet_width;
+                if (pi >= x1 || pj >= y1) continue;
+                M3DVector3f start, dir;
+                packet.get(k, start, dir);
+                primary.push((int)(target.pixel(pi, pj) - target.data), start, dir, 1e30f);
+            }
+        }
+    }
+
+    // Intersect: consecutive rays of the queue go as one packet; hits are
+    // compacted into the hit queue and misses are finished right here
+    const int ray_count = primary.size();
+    for (int r = 0; r < ray_count; r += RT_PACKET_SIZE)
+    {
+        int n = ray_count - r < RT_PACKET_SIZE ? ray_count - r : RT_PACKET_SIZE;
+        Hit_Record hit[RT_PACKET_SIZE];
+
+        Ray_Packet packet;
+        primary.get_packet(r, n, packet);
+        if (packet.coherent() && n > 1)
+        {
+            _scene.intersection_check_packet(packet, hit);
+        }
+        else
+        {
+            for (int k = 0; k < n; ++k)
+            {
+                M3DVector3f start, dir;
+                primary.get(r + k, start, dir);
+                _scene.intersection_check(start, dir, hit[k]);
+            }
+        }
+
+        for (int k = 0; k < n; ++k)
+        {
+            if (hit[k].cond != _k_miss)
+            {
+                hits.push(r + k, hit[k]);
+            }
+            else
+            {
+                float* out = target.data + primary.source[r + k];
+                out[0] = out[1] = out[2] = 0.0f;
+            }
+        }
+    }
+
+    // Shadow: one ray per hit toward the light, traced as packets
+    const int hit_count = hits.size();
+    for (int h = 0; h < hit_count; ++h)
+    {
+        M3DVector3f origin, dir;
+        float tmax;
+        shadow_ray(hits.record[h].point, origin, dir, tmax);
+        shadow.push(h, origin, dir, tmax);
+    }
+
+    // Binned by octant and origin, so the packets below hold neighbouring
+    // rays; the source index takes each result back to its hit
+    const Ray_Queue* rays = &shadow;
+    if (_sort_rays)
+    {
+        shadow.sort_coherent(queues.sorted, queues.sort_keys);
+        rays = &queues.sorted;
+    }
+    for (int r = 0; r < hit_count; r += RT_PACKET_SIZE)
+    {
+        int n = hit_count - r < RT_PACKET_SIZE ? hit_count - r : RT_PACKET_SIZE;
+        Ray_Packet packet;
+        rays->get_packet(r, n, packet);
+        if (packet.coherent() && n > 1)
+        {
+            float tmax[RT_PACKET_SIZE];
+            for (int k = 0; k < RT_PACKET_SIZE; ++k) tmax[k] = k < n ? rays->tmax[r + k] : 0.0f;
+            int blocked = _scene.occluded_packet(packet, tmax);
+            for (int k = 0; k < n; ++k) hits.shadow[rays->source[r + k]] = (blocked >> k) & 1;
+        }
+        else
+        {
+            for (int k = 0; k < n; ++k)
+            {
+                M3DVector3f start, dir;
+                rays->get(r + k, start, dir);
+                hits.shadow[rays->source[r + k]] = _scene.occluded(start, dir, rays->tmax[r + k]);
+            }
+        }
+    }
+
+    // Shade: hits grouped by primitive type, so each shade() variant runs
+    // over a run of hits instead of alternating per pixel
+    std::vector<int>& order = queues.shade_order;
+    order.resize(hit_count);
+    int type_start[Basic_Primitive::_k_instance + 2] = { 0 };
+    for (int h = 0; h < hit_count; ++h) type_start[hits.record[h].prim->get_type() + 1]++;
+    for (int t = 1; t <= Basic_Primitive::_k_instance + 1; ++t) type_start[t] += type_start[t - 1];
+    for (int h = 0; h < hit_count; ++h) order[type_start[hits.record[h].prim->get_type()]++] = h;
+
+    M3DVector3f am_light;
+    _scene.get_amb_light(am_light);
+    for (int o = 0; o < hit_count; ++o)
+    {
+        int h = order[o];
+        const Hit_Record& hit = hits.record[h];
+        M3DVector3f start, direct, color;
+        primary.get(hits.ray[h], start, direct);
+        hit.prim->shade(direct, hit, _scene.get_sp_light(), am_light, _scene.get_material(hit.material), color, hits.shadow[h] != 0);
+
+        float* out = target.data + primary.source[hits.ray[h]];
+        out[0] = color[0];
+        out[1] = color[1];
+        out[2] = color[2];
+    }
+
+    _ray_count += ray_count + hit_count;
+}
+
+void Ray_Tracer::render_pixel(const Frame_Target& target, int i, int j)
+{
+    // Pixel sample on view plane, primary ray, local Phong shading only
+    M3DVector3f color;
+    trace_sample((float)i, (float)j, color);
+
+    float* out = target.pixel(i, j);
+    out[0] = color[0];
+    out[1] = color[1];
+    out[2] = color[2];
+}
+
 void Ray_Tracer::ray_tracing(M3DVector3f start,
     M3DVector3f direct,
     M3DVector3f color)
 {
-    // Normalize ray direction
-    m3dNormalizeVector(direct);
-
-    // Find closest hit
-    Basic_Primitive* prim = NULL;
-    M3DVector3f hitPoint;
-    if (_scene.intersection_check(start, direct, &prim, hitPoint) != _k_miss)
+    // Find closest hit; the direction is already unit length
+    Hit_Record hit;
+    if (_scene.intersection_check(start, direct, hit) != _k_miss)
     {
         // Ambient light
         M3DVector3f am_light;
         _scene.get_amb_light(am_light);
 
         // Hard shadow test (point to light)
-        bool shadow = check_shadow(hitPoint);
+        bool shadow = check_shadow(hit.point);
 
         // Local Phong shading
-        prim->shade(direct, hitPoint, _scene.get_sp_light(), am_light, color, shadow);
+        hit.prim->shade(direct, hit, _scene.get_sp_light(), am_light, _scene.get_material(hit.material), color, shadow);
     }
     else
     {
@@ -112,33 +692,87 @@ void Ray_Tracer::ray_tracing(M3DVector3f start,
     }
 }
 
-bool Ray_Tracer::check_shadow(M3DVector3f intersect_point)
+void Ray_Tracer::ray_tracing_packet(Ray_Packet& packet, M3DVector3f color[RT_PACKET_SIZE])
+{
+    packet.finish();
+
+    Hit_Record hits[RT_PACKET_SIZE];
+    _scene.intersection_check_packet(packet, hits);
+
+    int hit = 0;
+    for (int k = 0; k < RT_PACKET_SIZE; ++k)
+        if ((packet.active & (1 << k)) && hits[k].cond != _k_miss) hit |= 1 << k;
+    int shadow = check_shadow_packet(hits, hit);
+
+    M3DVector3f am_light;
+    _scene.get_amb_light(am_light);
+    for (int k = 0; k < RT_PACKET_SIZE; ++k)
+    {
+        if (!(packet.active & (1 << k))) continue;
+        if (hit & (1 << k))
+        {
+            M3DVector3f start, direct;
+            packet.get(k, start, direct);
+            const Material& material = _scene.get_material(hits[k].material);
+            hits[k].prim->shade(direct, hits[k], _scene.get_sp_light(), am_light, material, color[k], (shadow & (1 << k)) != 0);
+        }
+        else
+        {
+            m3dLoadVector3(color[k], 0.0f, 0.0f, 0.0f);
+        }
+    }
+}
+
+int Ray_Tracer::check_shadow_packet(Hit_Record hit[RT_PACKET_SIZE], int mask)
+{
+    Ray_Packet packet;
+    float tmax[RT_PACKET_SIZE];
+    for (int k = 0; k < RT_PACKET_SIZE; ++k)
+    {
+        if (!(mask & (1 << k))) continue;
+        M3DVector3f origin, dir;
+        shadow_ray(hit[k].point, origin, dir, tmax[k]);
+        packet.set(k, origin, dir);
+    }
+
+    // Shadow rays that split up (hit points on both sides of the light) go one by one
+    if (!packet.coherent() || lane_count(mask) < 2)
+    {
+        int shadow = 0;
+        for (int k = 0; k < RT_PACKET_SIZE; ++k)
+            if ((mask & (1 << k)) && check_shadow(hit[k].point)) shadow |= 1 << k;
+        return shadow;
+    }
+
+    packet.finish();
+    for (int k = 0; k < RT_PACKET_SIZE; ++k)
+        if (!(mask & (1 << k))) tmax[k] = 0.0f;
+    return _scene.occluded_packet(packet, tmax);
+}
+
+void Ray_Tracer::shadow_ray(const M3DVector3f intersect_point, M3DVector3f origin, M3DVector3f dir, float& tmax) const
 {
     const Light& light = _scene.get_sp_light();
 
     // Vector from hit point to light
-    M3DVector3f Lpos; light.get_light_pos(Lpos);
-    M3DVector3f toLight;
-    m3dSubtractVectors3(toLight, Lpos, intersect_point);
-    float dist2 = m3dDotProduct(toLight, toLight);
-    m3dNormalizeVector(toLight);
+    Vec3 Lpos; light.get_light_pos(Lpos);
+    Vec3 p(intersect_point);
+    Vec3 to_light = Lpos - p;
+    float dist = vec_length(to_light);
+    Vec3 d = vec_normalize(to_light);
 
     // Offset origin slightly along the shadow ray to avoid acne
-    M3DVector3f origin;
-    m3dCopyVector3(origin, intersect_point);
-    M3DVector3f eps; m3dCopyVector3(eps, toLight); m3dScaleVector3(eps, 1e-3f);
-    m3dAddVectors3(origin, origin, eps);
-
-    // Trace toward the light
-    Basic_Primitive* blocker = NULL;
-    M3DVector3f pHit;
-    if (_scene.intersection_check(origin, toLight, &blocker, pHit) == _k_hit)
-    {
-        // If blocker is between point and light, it's in shadow
-        M3DVector3f remain;
-        m3dSubtractVectors3(remain, Lpos, pHit);
-        float newDist2 = m3dDotProduct(remain, remain);
-        return (newDist2 < dist2);
-    }
-    return false;
+    const float eps = 1e-3f;
+    (p + d * eps).store(origin);
+    d.store(dir);
+    tmax = dist - eps;
+}
+
+bool Ray_Tracer::check_shadow(M3DVector3f intersect_point)
+{
+    // In shadow if anything sits between the point and the light
+    M3DVector3f origin, toLight;
+    float tmax;
+    shadow_ray(intersect_point, origin, toLight, tmax);
+    return _scene.occluded(origin, toLight, tmax);
 }
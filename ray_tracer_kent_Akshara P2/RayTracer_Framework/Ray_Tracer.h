@@ -2,25 +2,272 @@
 #include "scene/Scene.h"
 #include "scene/view_plane.h"
 #include "common/image_volume.h"
+#include "common/thread_pool.h"
+#include "Tile_Scheduler.h"
+#include "Ray_Queue.h"
+#include "Frame_Pipeline.h"
+#include "Render_Checkpoint.h"
+#include <atomic>
+#include <string>
+
+class Render_Coordinator;
+
+// Render threads Ray_Tracer::run starts; 0 uses every hardware thread.
+// Override from the project settings, e.g. /D RT_RENDER_THREADS=1.
+#ifndef RT_RENDER_THREADS
+#define RT_RENDER_THREADS 0
+#endif
+
+// How Ray_Tracer::run traces a tile:
+//   _k_render_pixel     - pixel block by pixel block, each block one ray packet
+//   _k_render_wavefront - whole bands of the tile per stage: generate, intersect,
+//                         shadow, shade, with the surviving rays compacted into
+//                         SoA queues between stages
+enum Render_Mode { _k_render_pixel = 0, _k_render_wavefront = 1 };
+
+#ifndef RT_RENDER_MODE
+#define RT_RENDER_MODE 0
+#endif
+
+// 1 - the wavefront mode bins its shadow rays by direction octant and origin
+// Morton code before tracing them (Ray_Queue::sort_coherent). Off by
+// default: in the room the pixel order is already coherent and the sort
+// does not pay for itself; "-bench_sort" shows where it does.
+#ifndef RT_SORT_RAYS
+#define RT_SORT_RAYS 0
+#endif
+
+// Placement of the render threads and the framebuffer, for machines with
+// several NUMA nodes. All off by default; every combination renders the
+// same image.
+//   RT_PIN_THREADS  - worker t runs on the t-th CPU of list_cpus(), so the
+//                     workers alternate between sockets
+//   RT_FIRST_TOUCH  - each worker zeroes its share of the framebuffer rows
+//                     before rendering, so the OS puts those pages on the
+//                     node of the thread that writes most of them
+//   RT_TILE_BUFFERS - workers render into a private buffer whose rows are
+//                     padded to whole cache lines and copy finished rows
+//                     into the image, so threads on neighbouring tiles do
+//                     not write to the same lines while tracing
+#ifndef RT_PIN_THREADS
+#define RT_PIN_THREADS 0
+#endif
+#ifndef RT_FIRST_TOUCH
+#define RT_FIRST_TOUCH 0
+#endif
+#ifndef RT_TILE_BUFFERS
+#define RT_TILE_BUFFERS 0
+#endif
+
+// Channel value that maps to 255 in image.data. 0 scales by the brightest
+// channel of the frame, which is only known once every pixel is done:
+// run_to_file() then tonemaps with the previous frame's maximum and, when
+// the new frame's maximum is off by more than 1/512 of it, encodes and
+// writes the frame once more at the end. The first frame has no previous
+// maximum and is written after rendering, like run() and a write. Repeated
+// frames of a scene thus overlap output with rendering.
+#ifndef RT_WHITE_POINT
+#define RT_WHITE_POINT 0.0f
+#endif
+
+// 1 - Application renders with run_to_file() when the white point is known
+// up front (RT_WHITE_POINT > 0), 0 - always run() and then WriteFile()
+#ifndef RT_PIPELINED_OUTPUT
+#define RT_PIPELINED_OUTPUT 1
+#endif
+
+// Seconds between checkpoint flushes of Application's render: the tiles it
+// finishes are kept in results_ray_tracing.ckpt, and a start after a crash
+// traces only what is missing there. Every pixel is written a second time
+// (12 bytes of floats each), so it is off by default: 0 turns it off.
+#ifndef RT_CHECKPOINT_SECONDS
+#define RT_CHECKPOINT_SECONDS 0
+#endif
+
+// One pass of Ray_Tracer::run_progressive: a resolution pass traces one
+// pixel in every step x step block (step 32, 16, 8, 4, 2, then 1 for every pixel),
+// a sample pass brings every pixel up to 'samples' jittered samples
+struct Progressive_Pass
+{
+    int     step;
+    int     samples;
+    double  ms;         // wall time of the pass
+    bool    complete;   // false if the budget or the cancel flag cut it short
+};
+
+// Where the render functions store colors: pixel (i, j) is the RGB triple at
+// pixel(i, j), either in image.fdata or in a worker's tile buffer
+struct Frame_Target
+{
+    float*  data;
+    int     stride;     // floats per row
+    int     x0, y0;     // pixel stored at data[0]
+
+    inline float* pixel(int i, int j) const { return data + (j - y0) * stride + (i - x0) * 3; }
+};
 
 class Ray_Tracer
 {
 public:
-    Ray_Tracer(void);
+    // accel_cache names the file the built BVH is loaded from and saved to
+    // (see Accel_Cache); NULL builds it on every start and writes no file
+    explicit Ray_Tracer(const char* accel_cache = NULL);
     ~Ray_Tracer(void);
 
-    // Render the image (local Phong shading only)
+    // Render the image (local Phong shading only). The image is cut into
+    // square tiles that the render threads share through a work-stealing
+    // Tile_Scheduler; every pixel is traced on its own, so the result does
+    // not depend on the thread count or on how the tiles were split.
     void run(Image& image);
 
+    // run(), with tonemapping to image.data and writing the PPM file done by
+    // a Frame_Pipeline while the tiles are still rendering (see
+    // RT_WHITE_POINT). False if the file could not be written.
+    bool run_to_file(Image& image, const char* path);
+
+    // Whether run_to_file() can tonemap while rendering: a fixed white point
+    // is set or an earlier frame left its maximum
+    inline bool white_point_known() const { return _white_point > 0.0f || _last_max > 0.0f; }
+
+    // The best image within a wall-clock budget: a step 32 pass that always
+    // runs to the end, then passes that refine the resolution and then the
+    // samples per pixel (up to k_max_samples), until budget_ms has passed or
+    // *cancel turns true. image always holds a complete image when this
+    // returns: pixels not traced at full resolution yet repeat the nearest
+    // coarser sample, and a cut-short pass keeps every row it finished.
+    // After the step 1 pass the image equals run(). Returns the number of
+    // complete passes.
+    int run_progressive(Image& image, double budget_ms, const std::atomic<bool>* cancel = NULL);
+
+    // run(), with the tiles traced by the worker processes connected to the
+    // coordinator instead of local threads; the same image. False if the
+    // coordinator ran out of workers.
+    bool run_distributed(Image& image, Render_Coordinator& coordinator);
+
+    // Trace the pixels of 'region' with the render threads into 'out',
+    // region.width() * region.height() RGB floats with rows top down:
+    // what a worker process does with the tiles it is sent
+    void render_region(const Tile& region, float* out);
+
+    // Size of the image run() renders
+    inline int get_width() const { return (int)_dim[0]; }
+    inline int get_height() const { return (int)_dim[1]; }
+
+    // Passes of the last run_progressive(), in order
+    inline const std::vector<Progressive_Pass>& get_passes() const { return _passes; }
+
+    static const int k_max_samples = 16;
+
+    // Keep the finished tiles of run() and run_to_file() in a checkpoint
+    // file, flushed every flush_seconds, or only per batch of bands when it
+    // is 0 (see Render_Checkpoint); NULL turns it off. With resume, the
+    // pixels in a file left by an interrupted frame with the same
+    // frame_key() are restored instead of traced. run_to_file() removes the
+    // file once the frame is written; after run(), call discard_checkpoint()
+    // when the image has been saved.
+    void set_checkpoint(const char* path, bool resume = true, double flush_seconds = 5.0);
+
+    // Removes the checkpoint file: the last frame's output is safe elsewhere
+    void discard_checkpoint();
+
+    // Hash of what the floats of a frame depend on: the scene content, the
+    // view plane and the image size. Render workers must agree on it.
+    unsigned long long image_key() const;
+
+    // image_key() plus the render mode and white point: everything the
+    // pixels of a frame depend on
+    unsigned long long frame_key() const;
+
+    // Pixels the last run() restored from the checkpoint
+    inline int get_resumed_pixels() const { return _resumed_pixels; }
+
+    // See RT_WHITE_POINT
+    inline void set_white_point(float white_point) { _white_point = white_point < 0.0f ? 0.0f : white_point; }
+    inline float get_white_point() const { return _white_point; }
+
+    // 0 = one thread per hardware thread
+    inline void set_thread_count(int count) { _thread_count = count < 0 ? 0 : count; }
+    int get_thread_count() const;
+
+    // Progress output from run(); on by default
+    inline void set_progress(bool show) { _show_progress = show; }
+
+    // Steal and split counts of the last run()
+    inline const Tile_Scheduler& get_scheduler() const { return _scheduler; }
+
+    // Both modes produce the same image
+    inline void set_render_mode(Render_Mode mode) { _render_mode = mode; }
+    inline Render_Mode get_render_mode() const { return _render_mode; }
+
+    // Sort batched shadow rays for coherence (wavefront mode only)
+    inline void set_ray_sorting(bool sort) { _sort_rays = sort; }
+    inline bool get_ray_sorting() const { return _sort_rays; }
+
+    // Thread and framebuffer placement (see RT_PIN_THREADS above)
+    inline void set_thread_pinning(bool pin) { _pin_threads = pin; }
+    inline bool get_thread_pinning() const { return _pin_threads; }
+    inline void set_first_touch(bool first_touch) { _first_touch = first_touch; }
+    inline bool get_first_touch() const { return _first_touch; }
+    inline void set_tile_buffers(bool tile_buffers) { _tile_buffers = tile_buffers; }
+    inline bool get_tile_buffers() const { return _tile_buffers; }
+
+    // Primary plus shadow rays traced by the last wavefront run()
+    inline long long get_ray_count() const { return _ray_count; }
+
 private:
-    // Local shading only: start, direction, output color
+    // Both run variants: with a path, every finished band goes through a
+    // Frame_Pipeline writing to it
+    bool render(Image& image, const char* path);
+
+    // image.fdata to image.data, with max_v mapping to 255
+    static void quantize(Image& image, float max_v);
+
+    // Color of one primary ray through view plane position (x, y)
+    void trace_sample(float x, float y, M3DVector3f color);
+
+    // Trace pixels [x0, x1) x [y0, y1) into the target, in blocks of
+    // k_packet_width x k_packet_rows pixels traced as one ray packet
+    void render_tile(const Frame_Target& target, int x0, int y0, int x1, int y1);
+    void render_pixel(const Frame_Target& target, int i, int j);
+
+    // Same pixels through the wavefront stages, using one thread's queues
+    void render_tile_wavefront(const Frame_Target& target, int x0, int y0, int x1, int y1, Wavefront_Queues& queues);
+
+    // Local shading only: start, unit direction, output color
     void ray_tracing(M3DVector3f start, M3DVector3f direct, M3DVector3f color);
 
+    // ray_tracing for the active lanes of a packet; same colors, lane by lane
+    void ray_tracing_packet(Ray_Packet& packet, M3DVector3f color[RT_PACKET_SIZE]);
+
     // Shadow test from hit point toward the point light
     bool check_shadow(M3DVector3f intersect_point);
 
+    // check_shadow for the hits of the lanes in 'mask'; returns the lanes in shadow
+    int check_shadow_packet(Hit_Record hit[RT_PACKET_SIZE], int mask);
+
+    // Shadow ray from a hit point: origin nudged toward the light, unit
+    // direction and the distance the ray has to stay clear for
+    void shadow_ray(const M3DVector3f intersect_point, M3DVector3f origin, M3DVector3f dir, float& tmax) const;
+
 private:
     Scene       _scene;
     View_Plane  _view_plane;
     M3DVector3f _dim;
+    int         _thread_count;
+    bool        _show_progress;
+    Render_Mode _render_mode;
+    bool        _sort_rays;
+    bool        _pin_threads;
+    bool        _first_touch;
+    bool        _tile_buffers;
+    float       _white_point;
+    float       _last_max;      // brightest channel of the last frame, 0 before the first
+    std::string _checkpoint_path;
+    bool        _checkpoint_resume;
+    double      _checkpoint_flush;
+    int         _resumed_pixels;
+    std::atomic<long long> _ray_count;
+    Tile_Scheduler _scheduler;
+    std::vector<Progressive_Pass> _passes;
+    Thread_Pool _pool;          // threads of the progressive passes and of render_region()
 };
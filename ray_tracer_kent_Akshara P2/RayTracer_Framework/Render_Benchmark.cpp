@@ -0,0 +1,240 @@
+#include "Render_Benchmark.h"
+#include "Ray_Tracer.h"
+#include "common/thread_affinity.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+static double render_seconds(Ray_Tracer& tracer, Image& image)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    tracer.run(image);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void free_image(Image& image)
+{
+    delete[] image.data;
+    delete[] image.fdata;
+    image.data = NULL;
+    image.fdata = NULL;
+}
+
+void run_render_benchmark(int max_threads, int repeats)
+{
+    Ray_Tracer tracer;
+    tracer.set_progress(false);
+    if (max_threads <= 0)
+    {
+        tracer.set_thread_count(0);
+        max_threads = tracer.get_thread_count();
+    }
+
+    std::vector<int> counts;
+    for (int n = 1; n < max_threads; n *= 2) counts.push_back(n);
+    counts.push_back(max_threads);
+
+    std::vector<float> reference;
+    double base = 0.0;
+    printf("%8s %10s %8s %11s %8s %8s %s\n", "threads", "frame ms", "speedup", "efficiency", "steals", "splits", "image");
+    for (size_t c = 0; c < counts.size(); c++)
+    {
+        tracer.set_thread_count(counts[c]);
+        double best = 1e30;
+        bool same = true;
+        for (int r = 0; r < repeats; r++)
+        {
+            Image image = Image();
+            double s = render_seconds(tracer, image);
+            if (s < best) best = s;
+            if (reference.empty())
+                reference.assign(image.fdata, image.fdata + image.n);
+            else
+                same = same && memcmp(&reference[0], image.fdata, reference.size() * sizeof(float)) == 0;
+            free_image(image);
+        }
+        if (c == 0) base = best;
+
+        double speedup = base / best;
+        printf("%8d %10.2f %8.2f %10.1f%% %8d %8d %s\n", counts[c], best * 1000.0, speedup,
+            100.0 * speedup / counts[c], tracer.get_scheduler().steal_count(), tracer.get_scheduler().split_count(),
+            same ? "identical" : "DIFFERS");
+    }
+
+    // Both modes trace the same rays; only the wavefront run counts them
+    static const Render_Mode modes[] = { _k_render_pixel, _k_render_wavefront };
+    static const char* names[] = { "per-pixel", "wavefront" };
+    double seconds[2];
+    bool same[2];
+    tracer.set_thread_count(max_threads);
+    for (int m = 0; m < 2; m++)
+    {
+        tracer.set_render_mode(modes[m]);
+        seconds[m] = 1e30;
+        same[m] = true;
+        for (int r = 0; r < repeats; r++)
+        {
+            Image image = Image();
+            double s = render_seconds(tracer, image);
+            if (s < seconds[m]) seconds[m] = s;
+            same[m] = same[m] && memcmp(&reference[0], image.fdata, reference.size() * sizeof(float)) == 0;
+            free_image(image);
+        }
+    }
+    tracer.set_render_mode((Render_Mode)RT_RENDER_MODE);
+
+    double rays = (double)tracer.get_ray_count();
+    printf("\n%10s %10s %8s %s\n", "mode", "frame ms", "Mrays/s", "image");
+    for (int m = 0; m < 2; m++)
+        printf("%10s %10.2f %8.2f %s\n", names[m], seconds[m] * 1000.0, rays / seconds[m] * 1e-6,
+            same[m] ? "identical" : "DIFFERS");
+}
+
+void run_numa_benchmark(int repeats)
+{
+    std::vector<Cpu_Info> cpus;
+    list_cpus(cpus);
+    const int nodes = numa_node_count(cpus);
+    printf("%d CPUs on %d NUMA node(s)\n", (int)cpus.size(), nodes);
+
+    Ray_Tracer tracer;
+    tracer.set_progress(false);
+    tracer.set_render_mode(_k_render_pixel);
+
+    // One socket: this thread and so the workers it starts are restricted
+    // to the first node's CPUs. Both sockets: every CPU.
+    std::vector<Cpu_Info> node0;
+    for (size_t c = 0; c < cpus.size(); c++)
+        if (cpus[c].node == cpus[0].node) node0.push_back(cpus[c]);
+
+    struct Setup { const char* name; bool pin, first_touch, tile_buffers; };
+    static const Setup setups[] = {
+        { "none", false, false, false },
+        { "pinned", true, false, false },
+        { "+first touch", true, true, false },
+        { "+tile buffers", true, true, true },
+    };
+    std::vector<float> reference;
+    printf("%-8s %8s %-14s %10s %8s %s\n", "sockets", "threads", "placement", "frame ms", "gain", "image");
+    for (int scope = 0; scope < 2; scope++)
+    {
+        if (scope == 1 && nodes < 2) break;
+        restrict_current_thread(scope == 0 ? node0 : cpus);
+        int threads = scope == 0 ? (int)node0.size() : (int)cpus.size();
+        tracer.set_thread_count(threads);
+        double base = 0.0;
+        for (size_t s = 0; s < sizeof(setups) / sizeof(setups[0]); s++)
+        {
+            tracer.set_thread_pinning(setups[s].pin);
+            tracer.set_first_touch(setups[s].first_touch);
+            tracer.set_tile_buffers(setups[s].tile_buffers);
+
+            double best = 1e30;
+            bool same = true;
+            for (int r = 0; r < repeats; r++)
+            {
+                Image image = Image();
+                double seconds = render_seconds(tracer, image);
+                if (seconds < best) best = seconds;
+                if (reference.empty())
+                    reference.assign(image.fdata, image.fdata + image.n);
+                else
+                    same = same && memcmp(&reference[0], image.fdata, reference.size() * sizeof(float)) == 0;
+                free_image(image);
+            }
+            if (s == 0) base = best;
+            printf("%-8s %8d %-14s %10.2f %7.1f%% %s\n", scope == 0 ? "one" : "all", threads, setups[s].name,
+                best * 1000.0, 100.0 * (base / best - 1.0), same ? "identical" : "DIFFERS");
+        }
+    }
+    restrict_current_thread(cpus);
+    if (nodes < 2)
+        printf("Single NUMA node: only the one-socket rows apply\n");
+}
+
+static bool read_file(const char* path, std::vector<char>& bytes)
+{
+    bytes.clear();
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) bytes.insert(bytes.end(), buffer, buffer + n);
+    fclose(file);
+    return true;
+}
+
+void run_pipeline_benchmark(int repeats)
+{
+    const char* serial_path = "bench_serial.ppm";
+    const char* pipelined_path = "bench_pipelined.ppm";
+    Ray_Tracer tracer;
+    tracer.set_progress(false);
+
+    // Warm-up frame: leaves the white point for run_to_file()
+    Image image = Image();
+    tracer.run_to_file(image, pipelined_path);
+    free_image(image);
+
+    double best[3] = { 1e30, 1e30, 1e30 };
+    for (int r = 0; r < repeats; r++)
+    {
+        for (int mode = 0; mode < 3; mode++)
+        {
+            image = Image();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            if (mode == 0)
+                tracer.run(image);
+            else if (mode == 1)
+            {
+                tracer.run(image);
+                Frame_Pipeline::write_file(image, serial_path);
+            }
+            else
+                tracer.run_to_file(image, pipelined_path);
+            double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (s < best[mode]) best[mode] = s;
+            free_image(image);
+        }
+    }
+
+    std::vector<char> serial, pipelined;
+    bool same = read_file(serial_path, serial) && read_file(pipelined_path, pipelined) && serial == pipelined;
+    remove(serial_path);
+    remove(pipelined_path);
+
+    const char* names[3] = { "run", "run + write", "run_to_file" };
+    printf("%-12s %10s %9s\n", "frame", "wall ms", "over run");
+    for (int mode = 0; mode < 3; mode++)
+        printf("%-12s %10.2f %8.1f%%\n", names[mode], best[mode] * 1000.0, 100.0 * (best[mode] / best[0] - 1.0));
+    printf("files %s\n", same ? "identical" : "DIFFER");
+}
+
+void run_progressive_benchmark(double max_budget_ms)
+{
+    Ray_Tracer tracer;
+    tracer.set_progress(false);
+    Image reference = Image();
+    tracer.run(reference);
+
+    printf("%9s %7s %10s  %s\n", "budget ms", "passes", "RMS error", "pass ms (step/samples, * = cut short)");
+    for (double budget = 5.0; budget <= max_budget_ms * 1.001; budget *= 2.0)
+    {
+        Image image = Image();
+        int passes = tracer.run_progressive(image, budget);
+        double error = 0.0;
+        for (int k = 0; k < image.n; k++)
+        {
+            double d = (double)image.data[k] - (double)reference.data[k];
+            error += d * d;
+        }
+        printf("%9.0f %7d %10.3f ", budget, passes, sqrt(error / image.n));
+        const std::vector<Progressive_Pass>& info = tracer.get_passes();
+        for (size_t p = 0; p < info.size(); p++)
+            printf(" %d/%d:%.1f%s", info[p].step, info[p].samples, info[p].ms, info[p].complete ? "" : "*");
+        printf("\n");
+        free_image(image);
+    }
+    free_image(reference);
+}
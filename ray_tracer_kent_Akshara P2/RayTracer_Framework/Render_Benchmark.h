@@ -0,0 +1,32 @@
+#pragma once
+
+// Renders the scene with 1, 2, 4, ... up to max_threads render threads (0 =
+// every hardware thread, which is always included) and prints the best of
+// 'repeats' frame times, the speedup over one thread and the scaling
+// efficiency (speedup / threads), with the scheduler's steal and split
+// counts. Also checks that every thread count produced the same image.
+// Then renders with max_threads in the per-pixel and the wavefront mode and
+// prints the throughput of each in Mrays/s (primary plus shadow rays).
+// Run with "RayTracer -bench_render".
+void run_render_benchmark(int max_threads = 0, int repeats = 3);
+
+// Thread and framebuffer placement on NUMA machines: renders with the
+// workers of one socket and then of every socket, each time with no
+// placement, pinned threads, pinned threads plus first-touch framebuffer,
+// and all of that plus padded tile buffers. Prints the best of 'repeats'
+// frame times, the gain over no placement and whether the image matches.
+// Run with "RayTracer -bench_numa".
+void run_numa_benchmark(int repeats = 5);
+
+// Frame wall time of run() alone, of run() followed by writing the PPM
+// file, and of run_to_file(), which tonemaps and writes while rendering
+// (after one warm-up frame, so it knows the white point). Prints the best
+// of 'repeats' and the overhead over run(), and checks the two files match.
+// Run with "RayTracer -bench_pipeline".
+void run_pipeline_benchmark(int repeats = 5);
+
+// Progressive rendering under budgets from 5 to 'max_budget_ms': prints per
+// budget the passes that completed, the timing of each pass and the RMS
+// error of the 8-bit image against run()'s (0 once the full resolution pass
+// is done and before any extra samples). Run with "RayTracer -bench_progressive".
+void run_progressive_benchmark(double max_budget_ms = 200.0);
@@ -0,0 +1,176 @@
+#include "Render_Checkpoint.h"
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+
+struct Checkpoint_Header
+{
+    uint32_t    magic;
+    int32_t     version;
+    int32_t     nx, ny;
+    uint64_t    scene_key;
+};
+
+bool Render_Checkpoint::start(Image& image, const char* path, unsigned long long scene_key, bool resume, double flush_seconds)
+{
+    finish(false);
+    _image = &image;
+    _path = path;
+    _done.assign((size_t)image.nx * image.ny, 0);
+    _resumed_pixels = 0;
+    _flush_ms = flush_seconds > 0.0 ? (long long)(flush_seconds * 1000.0) : 0;
+    _bytes = 0;
+    _ok = true;
+    _bands.clear();
+    _queued_pixels = 0;
+
+    std::vector<char> kept;
+    if (resume) load(path, scene_key, kept);
+
+    // A fresh file under a temporary name holding the records that were
+    // read back, so a torn record at the end of the old one is gone
+    Checkpoint_Header header = { k_magic, k_version, image.nx, image.ny, scene_key };
+    std::string tmp_path = _path + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    bool ok = fp != NULL && fwrite(&header, sizeof(header), 1, fp) == 1 && (kept.empty() || fwrite(&kept[0], 1, kept.size(), fp) == kept.size());
+    if (fp != NULL) ok = fclose(fp) == 0 && ok;
+    if (ok)
+    {
+        remove(path);
+        ok = rename(tmp_path.c_str(), path) == 0;
+    }
+    if (ok) _file = fopen(path, "ab");
+    if (_file != NULL) setvbuf(_file, NULL, _IOFBF, k_write_buffer);   // bands are a few KB; fewer, bigger writes
+    if (_file == NULL)
+    {
+        printf("Checkpoint: cannot write %s\n", path);
+        remove(tmp_path.c_str());
+        _image = NULL;
+        return false;
+    }
+
+    _running = true;
+    _writer = std::thread(&Render_Checkpoint::write_loop, this);
+    return true;
+}
+
+void Render_Checkpoint::load(const char* path, unsigned long long scene_key, std::vector<char>& kept)
+{
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) return;
+    Checkpoint_Header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != k_magic || header.version != k_version ||
+        header.nx != _image->nx || header.ny != _image->ny || header.scene_key != scene_key)
+    {
+        printf("Checkpoint: %s is for another frame, starting over\n", path);
+        fclose(fp);
+        return;
+    }
+
+    const int nx = _image->nx, ny = _image->ny;
+    std::vector<float> pixels;
+    int32_t box[4];
+    while (fread(box, sizeof(box), 1, fp) == 1)
+    {
+        if (box[0] < 0 || box[1] < 0 || box[2] > nx || box[3] > ny || box[0] >= box[2] || box[1] >= box[3]) break;
+        Tile band = { box[0], box[1], box[2], box[3] };
+        pixels.resize((size_t)band.pixel_count() * 3);
+        if (fread(&pixels[0], sizeof(float), pixels.size(), fp) != pixels.size()) break;
+
+        for (int j = band.y0; j < band.y1; ++j)
+        {
+            memcpy(_image->fdata + ((size_t)j * nx + band.x0) * 3, &pixels[(size_t)(j - band.y0) * band.width() * 3], band.width() * 3 * sizeof(float));
+            for (int i = band.x0; i < band.x1; ++i)
+            {
+                if (!_done[(size_t)j * nx + i]) _resumed_pixels++;
+                _done[(size_t)j * nx + i] = 1;
+            }
+        }
+        const char* record = (const char*)box;
+        kept.insert(kept.end(), record, record + sizeof(box));
+        record = (const char*)&pixels[0];
+        kept.insert(kept.end(), record, record + pixels.size() * sizeof(float));
+    }
+    fclose(fp);
+}
+
+bool Render_Checkpoint::is_done(const Tile& band) const
+{
+    if (_resumed_pixels == 0) return false;
+    for (int j = band.y0; j < band.y1; ++j)
+        for (int i = band.x0; i < band.x1; ++i)
+            if (!_done[(size_t)j * _image->nx + i]) return false;
+    return true;
+}
+
+void Render_Checkpoint::push(const Tile& band)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _bands.push_back(band);
+    _queued_pixels += band.pixel_count();
+    if (_queued_pixels >= k_batch_pixels) _band_ready.notify_one();
+}
+
+bool Render_Checkpoint::finish(bool remove_file)
+{
+    if (_image == NULL) return _ok;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _running = false;
+        _band_ready.notify_one();
+    }
+    if (_writer.joinable()) _writer.join();
+    if (fclose(_file) != 0) _ok = false;
+    _file = NULL;
+    if (remove_file && _ok) remove(_path.c_str());
+    _image = NULL;
+    return _ok;
+}
+
+bool Render_Checkpoint::write_band(const Tile& band)
+{
+    int32_t box[4] = { band.x0, band.y0, band.x1, band.y1 };
+    if (fwrite(box, sizeof(box), 1, _file) != 1) return false;
+    const size_t row = (size_t)band.width() * 3;
+    for (int j = band.y0; j < band.y1; ++j)
+        if (fwrite(_image->fdata + ((size_t)j * _image->nx + band.x0) * 3, sizeof(float), row, _file) != row) return false;
+    _bytes += sizeof(box) + row * band.height() * sizeof(float);
+    return true;
+}
+
+void Render_Checkpoint::write_loop()
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point flushed = Clock::now();
+    std::vector<Tile> bands;
+    std::unique_lock<std::mutex> lock(_lock);
+    for (;;)
+    {
+        // A batch of bands, or the next flush, whichever comes first
+        if (_flush_ms > 0)
+            _band_ready.wait_until(lock, flushed + std::chrono::milliseconds(_flush_ms), [&]() { return _queued_pixels >= k_batch_pixels || !_running; });
+        else
+            _band_ready.wait(lock, [&]() { return _queued_pixels >= k_batch_pixels || !_running; });
+        _queued_pixels = 0;
+        bool stopping = !_running;
+        bands.assign(_bands.begin(), _bands.end());
+        _bands.clear();
+        lock.unlock();
+
+        bool ok = true;
+        for (size_t b = 0; b < bands.size() && ok; ++b)
+            ok = write_band(bands[b]);
+
+        // Buffered in the FILE until here; after fflush the bands survive
+        // the process dying
+        if (ok && (stopping || Clock::now() - flushed >= std::chrono::milliseconds(_flush_ms)))
+        {
+            ok = fflush(_file) == 0;
+            flushed = Clock::now();
+        }
+
+        lock.lock();
+        if (!ok) _ok = false;
+        if (stopping || !_ok) return;
+    }
+}
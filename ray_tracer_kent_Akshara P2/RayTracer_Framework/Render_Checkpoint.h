@@ -0,0 +1,79 @@
+#pragma once
+#include "common/image_volume.h"
+#include "Tile_Scheduler.h"
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The finished bands of a frame's float buffer, kept in a file while the
+// frame renders so that a render that dies can resume with only the missing
+// pixels.
+//
+// The file is a header (magic, version, nx, ny, scene key) followed by one
+// record per band: x0, y0, x1, y1 as 32-bit ints, then the band's RGB floats
+// row by row. A writer thread appends the pushed bands in batches and
+// flushes the file to the OS every flush interval, so the render threads
+// never wait on the disk. A crash loses at most the bands of the last
+// interval; a record it cut off is dropped on resume. Without an interval
+// (flush_seconds <= 0) each batch is flushed as it is written.
+class Render_Checkpoint
+{
+public:
+    Render_Checkpoint() : _image(NULL), _file(NULL), _resumed_pixels(0), _flush_ms(0), _queued_pixels(0), _running(false), _ok(true), _bytes(0) {}
+    ~Render_Checkpoint() { finish(false); }
+
+    // Checkpoint an allocated image (nx, ny, fdata set). With 'resume', the
+    // records of an existing file for the same image size and scene key are
+    // copied into image.fdata first, and the file is rewritten with just
+    // those before new bands are appended. False if the file cannot be
+    // written; the frame then renders without a checkpoint.
+    bool start(Image& image, const char* path, unsigned long long scene_key, bool resume, double flush_seconds);
+
+    // Every pixel of the band was restored by start()
+    bool is_done(const Tile& band) const;
+
+    // Pixels [x0, x1) x [y0, y1) of image.fdata are final
+    void push(const Tile& band);
+
+    // Writes what is still queued and closes the file; with remove_file the
+    // frame is complete and the file is deleted. False if a write failed.
+    bool finish(bool remove_file);
+
+    inline int          resumed_pixels() const { return _resumed_pixels; }
+    inline long long    bytes_written() const { return _bytes; }    // by the last start() .. finish()
+
+    static const unsigned int   k_magic = 0x4b435452;   // "RTCK"
+    static const int            k_version = 1;
+    static const int            k_batch_pixels = 1 << 16;   // pushed pixels per writer wake-up, besides the flushes
+    static const int            k_write_buffer = 1 << 18;   // bytes
+
+private:
+    Render_Checkpoint(const Render_Checkpoint&);
+    Render_Checkpoint& operator=(const Render_Checkpoint&);
+
+    // Records of an existing file into image.fdata and _done; appends them
+    // to 'kept' as they were read
+    void load(const char* path, unsigned long long scene_key, std::vector<char>& kept);
+    bool write_band(const Tile& band);
+    void write_loop();
+
+private:
+    Image*                      _image;
+    FILE*                       _file;
+    std::string                 _path;
+    std::vector<unsigned char>  _done;          // per pixel, restored by start()
+    int                         _resumed_pixels;
+    long long                   _flush_ms;      // 0: no timed flushes
+    std::mutex                  _lock;
+    std::condition_variable     _band_ready;
+    std::deque<Tile>            _bands;         // pushed, not written yet
+    int                         _queued_pixels; // pushed since the writer was last woken
+    bool                        _running;       // cleared by finish(): no more bands
+    bool                        _ok;
+    long long                   _bytes;
+    std::thread                 _writer;
+};
@@ -0,0 +1,500 @@
+#include "Render_Cluster.h"
+#include "Ray_Tracer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET Socket;
+static const Socket k_no_socket = INVALID_SOCKET;
+#define poll WSAPoll
+#else
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+typedef int Socket;
+static const Socket k_no_socket = -1;
+#endif
+
+#if defined(MSG_NOSIGNAL)
+static const int k_send_flags = MSG_NOSIGNAL;   // a vanished peer is an error, not SIGPIPE
+#else
+static const int k_send_flags = 0;
+#endif
+
+static const int k_io_timeout_ms = 10000;       // for one message once it has started arriving
+static const int k_connect_retry_ms = 10000;    // how long a worker waits for the coordinator
+
+static long long now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void close_socket(Socket s)
+{
+#if defined(_WIN32)
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+static bool sockets_ready()
+{
+#if defined(_WIN32)
+    static bool started = false;
+    if (!started)
+    {
+        WSADATA data;
+        started = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+    }
+    return started;
+#else
+    return true;
+#endif
+}
+
+static void set_timeout(Socket s, int ms)
+{
+#if defined(_WIN32)
+    DWORD value = (DWORD)ms;
+#else
+    struct timeval value = { ms / 1000, (ms % 1000) * 1000 };
+#endif
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&value, sizeof(value));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&value, sizeof(value));
+}
+
+static bool send_all(Socket s, const void* data, size_t bytes)
+{
+    const char* p = (const char*)data;
+    while (bytes > 0)
+    {
+        int chunk = bytes > (1 << 20) ? (1 << 20) : (int)bytes;
+        int sent = (int)send(s, p, chunk, k_send_flags);
+        if (sent <= 0) return false;
+        p += sent;
+        bytes -= sent;
+    }
+    return true;
+}
+
+// False on error, timeout or when the peer closed the connection
+static bool recv_all(Socket s, void* data, size_t bytes)
+{
+    char* p = (char*)data;
+    while (bytes > 0)
+    {
+        int chunk = bytes > (1 << 20) ? (1 << 20) : (int)bytes;
+        int got = (int)recv(s, p, chunk, 0);
+        if (got <= 0) return false;
+        p += got;
+        bytes -= got;
+    }
+    return true;
+}
+
+// "unix:PATH", or "tcp:HOST:PORT" / "HOST:PORT" split into host and port
+struct Address
+{
+    bool        unix_socket;
+    std::string host, port, path;
+};
+
+static bool parse_address(const char* text, Address& address)
+{
+    std::string s = text;
+    address.unix_socket = s.compare(0, 5, "unix:") == 0;
+    if (address.unix_socket)
+    {
+        address.path = s.substr(5);
+        return !address.path.empty();
+    }
+    if (s.compare(0, 4, "tcp:") == 0) s = s.substr(4);
+    size_t colon = s.rfind(':');
+    if (colon == std::string::npos || colon + 1 == s.size()) return false;
+    address.host = s.substr(0, colon);
+    address.port = s.substr(colon + 1);
+    return true;
+}
+
+// A socket listening on, or connected to, the address
+static Socket open_socket(const Address& address, bool listening)
+{
+    if (!sockets_ready()) return k_no_socket;
+    if (address.unix_socket)
+    {
+#if defined(_WIN32)
+        fprintf(stderr, "UNIX sockets are not supported on this platform\n");
+        return k_no_socket;
+#else
+        struct sockaddr_un name;
+        memset(&name, 0, sizeof(name));
+        name.sun_family = AF_UNIX;
+        if (address.path.size() >= sizeof(name.sun_path)) return k_no_socket;
+        strcpy(name.sun_path, address.path.c_str());
+        Socket s = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s == k_no_socket) return s;
+        if (listening) unlink(name.sun_path);
+        int result = listening ? bind(s, (struct sockaddr*)&name, sizeof(name)) : connect(s, (struct sockaddr*)&name, sizeof(name));
+        if (result != 0 || (listening && ::listen(s, SOMAXCONN) != 0))
+        {
+            close_socket(s);
+            return k_no_socket;
+        }
+        return s;
+#endif
+    }
+
+    struct addrinfo hints, *found = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    const char* host = address.host.empty() || (listening && address.host == "*") ? NULL : address.host.c_str();
+    if (getaddrinfo(host, address.port.c_str(), &hints, &found) != 0) return k_no_socket;
+
+    Socket s = k_no_socket;
+    for (struct addrinfo* a = found; a != NULL && s == k_no_socket; a = a->ai_next)
+    {
+        s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (s == k_no_socket) continue;
+        int on = 1;
+        if (listening) setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+        int result = listening ? bind(s, a->ai_addr, (int)a->ai_addrlen) : connect(s, a->ai_addr, (int)a->ai_addrlen);
+        if (result != 0 || (listening && ::listen(s, SOMAXCONN) != 0))
+        {
+            close_socket(s);
+            s = k_no_socket;
+            continue;
+        }
+        // Tile requests are small and should not wait for more data
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+    }
+    freeaddrinfo(found);
+    return s;
+}
+
+Render_Coordinator::Render_Coordinator()
+    : _listener((long long)k_no_socket)
+    , _tile_timeout_ms(120000)
+    , _requeues(0)
+{
+}
+
+Render_Coordinator::~Render_Coordinator()
+{
+    int32_t quit[4] = { -1, -1, -1, -1 };
+    for (size_t w = 0; w < _workers.size(); ++w)
+    {
+        send_all((Socket)_workers[w].fd, quit, sizeof(quit));
+        close_socket((Socket)_workers[w].fd);
+    }
+    if (_listener != (long long)k_no_socket) close_socket((Socket)_listener);
+#if !defined(_WIN32)
+    if (!_unix_path.empty()) unlink(_unix_path.c_str());
+    for (size_t c = 0; c < _children.size(); ++c)
+        waitpid(_children[c], NULL, 0);
+#endif
+}
+
+bool Render_Coordinator::listen(const char* address)
+{
+    Address parsed;
+    if (!parse_address(address, parsed))
+    {
+        fprintf(stderr, "Bad address '%s', expected tcp:HOST:PORT or unix:PATH\n", address);
+        return false;
+    }
+    Socket s = open_socket(parsed, true);
+    if (s == k_no_socket)
+    {
+        fprintf(stderr, "Cannot listen on '%s'\n", address);
+        return false;
+    }
+    _listener = (long long)s;
+    _address = address;
+    if (parsed.unix_socket) _unix_path = parsed.path;
+#if !defined(_WIN32)
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    return true;
+}
+
+int Render_Coordinator::spawn_local_workers(int count, const char* accel_cache)
+{
+#if defined(_WIN32)
+    (void)count;
+    (void)accel_cache;
+    fprintf(stderr, "Local workers are started with \"RayTracer -worker ADDRESS\" on this platform\n");
+    return 0;
+#else
+    // Workers connect to the loopback address when the coordinator listens on all
+    Address parsed;
+    parse_address(_address.c_str(), parsed);
+    std::string address = _address;
+    if (!parsed.unix_socket && (parsed.host.empty() || parsed.host == "*" || parsed.host == "0.0.0.0"))
+        address = "tcp:127.0.0.1:" + parsed.port;
+
+    fflush(stdout);
+    int started = 0;
+    for (int c = 0; c < count; ++c)
+    {
+        pid_t pid = fork();
+        if (pid < 0) break;
+        if (pid == 0)
+        {
+            close_socket((Socket)_listener);
+            for (size_t w = 0; w < _workers.size(); ++w) close_socket((Socket)_workers[w].fd);
+            _exit(run_render_worker(address.c_str(), -1, accel_cache) < 0 ? 1 : 0);
+        }
+        _children.push_back((int)pid);
+        ++started;
+    }
+    return started;
+#endif
+}
+
+// The hello is read as it arrives, polled with the other sockets, so a
+// slow or silent connection does not hold up the frame
+void Render_Coordinator::accept_worker()
+{
+    Socket s = accept((Socket)_listener, NULL, NULL);
+    if (s == k_no_socket) return;
+    set_timeout(s, k_io_timeout_ms);
+    Worker worker = { (long long)s, { 0, 0, 0, 0, 0, 0 }, 0, now_ms(), std::deque<Tile>(), 0, 0 };
+    _workers.push_back(worker);
+}
+
+// A worker with another scene, view or image size renders another image;
+// one built with another BVH width would trace another build of the tree
+bool Render_Coordinator::hello_matches(const Worker& worker, const Image& image, unsigned long long image_key)
+{
+    const unsigned long long key = (unsigned long long)(uint32_t)worker.hello[4] | ((unsigned long long)(uint32_t)worker.hello[5] << 32);
+    return (uint32_t)worker.hello[0] == k_hello_magic && worker.hello[1] == image.nx && worker.hello[2] == image.ny
+        && worker.hello[3] == RT_BVH_WIDTH && key == image_key;
+}
+
+// Takes what has arrived of the hello of a readable worker; false if the
+// connection closed or the hello does not match
+bool Render_Coordinator::read_hello(Worker& worker, const Image& image, unsigned long long image_key)
+{
+    int got = (int)recv((Socket)worker.fd, (char*)worker.hello + worker.hello_bytes, (int)sizeof(worker.hello) - worker.hello_bytes, 0);
+    if (got <= 0) return false;
+    worker.hello_bytes += got;
+    if (worker.hello_bytes < (int)sizeof(worker.hello)) return true;
+
+    if (!hello_matches(worker, image, image_key))
+    {
+        fprintf(stderr, "Rejected a worker: bad hello\n");
+        return false;
+    }
+    return true;
+}
+
+void Render_Coordinator::drop_worker(size_t w, std::deque<Tile>& pending)
+{
+    std::deque<Tile>& tiles = _workers[w].tiles;
+    for (size_t t = tiles.size(); t-- > 0; )
+        pending.push_front(tiles[t]);
+    _requeues += (int)tiles.size();
+    close_socket((Socket)_workers[w].fd);
+    _workers.erase(_workers.begin() + w);
+}
+
+bool Render_Coordinator::render_frame(Image& image, unsigned long long image_key, int tile_size, int idle_timeout_ms)
+{
+    if (_listener == (long long)k_no_socket) return false;
+
+    // Workers connected for an earlier frame may hold another scene
+    std::deque<Tile> pending;
+    for (size_t w = _workers.size(); w-- > 0; )
+    {
+        const Worker& worker = _workers[w];
+        if (worker.hello_bytes == (int)sizeof(worker.hello) && !hello_matches(worker, image, image_key))
+        {
+            fprintf(stderr, "Dropped a worker: its scene does not match this frame\n");
+            drop_worker(w, pending);
+        }
+    }
+
+    for (int y = 0; y < image.ny; y += tile_size)
+        for (int x = 0; x < image.nx; x += tile_size)
+        {
+            Tile tile = { x, y, x + tile_size < image.nx ? x + tile_size : image.nx, y + tile_size < image.ny ? y + tile_size : image.ny };
+            pending.push_back(tile);
+        }
+    int pixels_left = image.nx * image.ny;
+    _requeues = 0;
+
+    std::vector<float> buffer;
+    std::vector<struct pollfd> fds;
+    long long idle_since = now_ms();
+    while (pixels_left > 0)
+    {
+        // Top up every worker's queue; the requests are small, so sending
+        // them never waits on a worker that is busy rendering
+        for (size_t w = 0; w < _workers.size(); )
+        {
+            Worker& worker = _workers[w];
+            bool sent = true;
+            while (worker.hello_bytes == (int)sizeof(worker.hello) && (int)worker.tiles.size() < k_tiles_per_worker && !pending.empty())
+            {
+                const Tile& tile = pending.front();
+                int32_t message[4] = { tile.x0, tile.y0, tile.x1, tile.y1 };
+                sent = send_all((Socket)worker.fd, message, sizeof(message));
+                if (!sent) break;
+                if (worker.tiles.empty()) worker.sent_ms = now_ms();
+                worker.tiles.push_back(tile);
+                pending.pop_front();
+            }
+            if (!sent)
+            {
+                drop_worker(w, pending);
+                continue;
+            }
+            ++w;
+        }
+
+        if (!_workers.empty()) idle_since = now_ms();
+        else if (now_ms() - idle_since > idle_timeout_ms)
+        {
+            fprintf(stderr, "No render workers for %d ms, giving up\n", idle_timeout_ms);
+            return false;
+        }
+
+        // Wait for a result, a new worker or a connection that went away
+        fds.resize(_workers.size() + 1);
+        fds[0].fd = (Socket)_listener;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        for (size_t w = 0; w < _workers.size(); ++w)
+        {
+            fds[w + 1].fd = (Socket)_workers[w].fd;
+            fds[w + 1].events = POLLIN;
+            fds[w + 1].revents = 0;
+        }
+        if (poll(&fds[0], (unsigned long)fds.size(), 100) < 0) continue;
+
+        // Backwards, so dropping a worker keeps the indices of the rest
+        const long long now = now_ms();
+        for (size_t w = _workers.size(); w-- > 0; )
+        {
+            Worker& worker = _workers[w];
+            const bool connecting = worker.hello_bytes < (int)sizeof(worker.hello);
+            if (fds[w + 1].revents == 0)
+            {
+                if (connecting && now - worker.accepted_ms > k_io_timeout_ms)
+                {
+                    fprintf(stderr, "Rejected a worker: no hello\n");
+                    drop_worker(w, pending);
+                }
+                else if (!worker.tiles.empty() && now - worker.sent_ms > _tile_timeout_ms)
+                {
+                    fprintf(stderr, "Worker timed out on tile (%d, %d), re-queued\n", worker.tiles.front().x0, worker.tiles.front().y0);
+                    drop_worker(w, pending);
+                }
+                continue;
+            }
+            if (connecting)
+            {
+                if (!read_hello(worker, image, image_key)) drop_worker(w, pending);
+                continue;
+            }
+            int32_t header[4];
+            if (worker.tiles.empty() || !recv_all((Socket)worker.fd, header, sizeof(header)) ||
+                header[0] != worker.tiles.front().x0 || header[1] != worker.tiles.front().y0 ||
+                header[2] != worker.tiles.front().x1 || header[3] != worker.tiles.front().y1)
+            {
+                drop_worker(w, pending);
+                continue;
+            }
+            const Tile tile = worker.tiles.front();
+            buffer.resize((size_t)tile.pixel_count() * 3);
+            if (!recv_all((Socket)worker.fd, &buffer[0], buffer.size() * sizeof(float)))
+            {
+                drop_worker(w, pending);
+                continue;
+            }
+            for (int j = tile.y0; j < tile.y1; ++j)
+                memcpy(image.fdata + ((size_t)j * image.nx + tile.x0) * 3, &buffer[(size_t)(j - tile.y0) * tile.width() * 3], tile.width() * 3 * sizeof(float));
+            pixels_left -= tile.pixel_count();
+            worker.tiles.pop_front();
+            worker.sent_ms = now_ms();
+            worker.tiles_done++;
+        }
+
+        if (fds[0].revents & POLLIN) accept_worker();
+    }
+    return true;
+}
+
+int run_render_worker(const char* address, int fail_after, const char* accel_cache)
+{
+    Address parsed;
+    if (!parse_address(address, parsed))
+    {
+        fprintf(stderr, "Bad address '%s', expected tcp:HOST:PORT or unix:PATH\n", address);
+        return -1;
+    }
+
+    // Scene first: the coordinator expects the hello right after connecting
+    Ray_Tracer tracer(accel_cache);
+    tracer.set_progress(false);
+
+    // The coordinator may still be starting
+    Socket s = k_no_socket;
+    const long long give_up = now_ms() + k_connect_retry_ms;
+    while ((s = open_socket(parsed, false)) == k_no_socket && now_ms() < give_up)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (s == k_no_socket)
+    {
+        fprintf(stderr, "Cannot connect to '%s'\n", address);
+        return -1;
+    }
+#if !defined(_WIN32)
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    const unsigned long long key = tracer.image_key();
+    int32_t hello[6] = { (int32_t)Render_Coordinator::k_hello_magic, tracer.get_width(), tracer.get_height(), RT_BVH_WIDTH,
+        (int32_t)(uint32_t)key, (int32_t)(uint32_t)(key >> 32) };
+    if (!send_all(s, hello, sizeof(hello)))
+    {
+        close_socket(s);
+        return 0;
+    }
+
+    // Waits for tiles without a timeout: the coordinator may be idle between frames
+    std::vector<float> buffer;
+    int rendered = 0;
+    int32_t message[4];
+    while (recv_all(s, message, sizeof(message)) && message[0] >= 0)
+    {
+        if (rendered == fail_after) break;
+        Tile tile = { message[0], message[1], message[2], message[3] };
+        if (tile.x1 <= tile.x0 || tile.y1 <= tile.y0 || tile.x0 < 0 || tile.y0 < 0 || tile.x1 > tracer.get_width() || tile.y1 > tracer.get_height())
+            break;
+        buffer.resize((size_t)tile.pixel_count() * 3);
+        tracer.render_region(tile, &buffer[0]);
+        if (!send_all(s, message, sizeof(message)) || !send_all(s, &buffer[0], buffer.size() * sizeof(float)))
+            break;
+        ++rendered;
+    }
+    close_socket(s);
+    return rendered;
+}
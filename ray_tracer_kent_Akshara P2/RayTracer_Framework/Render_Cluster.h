@@ -0,0 +1,94 @@
+#pragma once
+#include "common/image_volume.h"
+#include "Tile_Scheduler.h"
+#include <deque>
+#include <string>
+#include <vector>
+
+// Addresses are "tcp:HOST:PORT" (or just "HOST:PORT") and "unix:PATH".
+// UNIX sockets are for several workers on one Linux host; TCP reaches
+// workers on other machines.
+//
+// Protocol, in host byte order (every node has to be the same platform):
+//   worker -> coordinator   hello: k_hello_magic, nx, ny, RT_BVH_WIDTH and
+//                           the low and high half of Ray_Tracer::image_key()
+//   coordinator -> worker   tile: x0, y0, x1, y1; x0 < 0 asks it to quit
+//   worker -> coordinator   the tile, then its width * height RGB floats,
+//                           rows top down
+// All fields are 32-bit.
+
+// Hands the tiles of a frame to worker processes and gathers the rendered
+// floats into the image. Each worker has k_tiles_per_worker tiles queued,
+// so it starts on the next one as soon as it has sent a result. Workers may
+// connect and disconnect at any time; the tiles of a worker that drops its
+// connection, sends garbage or takes longer than the tile timeout go back
+// into the queue for the others. Connections stay open between frames.
+class Render_Coordinator
+{
+public:
+    Render_Coordinator();
+    ~Render_Coordinator();  // tells the workers to quit and reaps spawned ones
+
+    // Start listening; false (with a message on stderr) if the address is
+    // unusable
+    bool listen(const char* address);
+
+    // Fork 'count' worker processes on this host that connect to the
+    // listening address, loading the BVH from 'accel_cache' when given
+    // (Linux/POSIX only; returns how many were started)
+    int spawn_local_workers(int count, const char* accel_cache = NULL);
+
+    // Render every pixel of an allocated image (nx, ny, fdata set) in
+    // tile_size tiles on the workers whose hello matches the image and
+    // image_key (see Ray_Tracer::image_key); others are disconnected.
+    // Blocks until all tiles came back; false if no worker has been
+    // connected for 'idle_timeout_ms'.
+    bool render_frame(Image& image, unsigned long long image_key, int tile_size = 64, int idle_timeout_ms = 30000);
+
+    inline void set_tile_timeout(int ms) { _tile_timeout_ms = ms; }
+
+    // Of the last render_frame()
+    inline int  requeue_count() const { return _requeues; }
+    inline int  worker_count() const { return (int)_workers.size(); }
+
+    static const unsigned int k_hello_magic = 0x32575452;   // "RTW2"
+    static const int k_tiles_per_worker = 2;
+
+private:
+    Render_Coordinator(const Render_Coordinator&);
+    Render_Coordinator& operator=(const Render_Coordinator&);
+
+    struct Worker
+    {
+        long long   fd;
+        int         hello[6];
+        int         hello_bytes;    // received so far; tiles go out once the hello is complete
+        long long   accepted_ms;
+        std::deque<Tile> tiles;     // sent and not back yet, in the order the worker answers
+        long long   sent_ms;        // when the worker started on tiles.front()
+        int         tiles_done;
+    };
+
+    void accept_worker();
+    bool read_hello(Worker& worker, const Image& image, unsigned long long image_key);
+    static bool hello_matches(const Worker& worker, const Image& image, unsigned long long image_key);
+    void drop_worker(size_t w, std::deque<Tile>& pending);
+
+private:
+    long long               _listener;
+    std::string             _unix_path;     // removed again on destruction
+    std::string             _address;
+    std::vector<Worker>     _workers;
+    std::vector<int>        _children;      // pids from spawn_local_workers
+    int                     _tile_timeout_ms;
+    int                     _requeues;
+};
+
+// Worker process: connect to the coordinator (retrying for a few seconds
+// while it starts), render every tile it sends with all local threads and
+// send the floats back, until told to quit or the connection drops.
+// For testing, fail_after >= 0 makes the worker vanish without answering
+// when it receives its tile number fail_after (counting from 0).
+// accel_cache is handed to the worker's Ray_Tracer.
+// Returns the number of tiles rendered, -1 if it never got connected.
+int run_render_worker(const char* address, int fail_after = -1, const char* accel_cache = NULL);
@@ -0,0 +1,137 @@
+#include "Tile_Scheduler.h"
+
+void Tile_Scheduler::reset(int thread_count, int nx, int ny, int tile_size)
+{
+    if (thread_count < 1) thread_count = 1;
+    std::vector<Worker>(thread_count).swap(_workers);
+    for (int t = 0; t < thread_count; ++t)
+        _workers[t].rng = 2654435761u * (t + 1);
+
+    std::vector<Tile> tiles;
+    for (int y = 0; y < ny; y += tile_size)
+        for (int x = 0; x < nx; x += tile_size)
+        {
+            Tile tile = { x, y, x + tile_size < nx ? x + tile_size : nx, y + tile_size < ny ? y + tile_size : ny };
+            tiles.push_back(tile);
+        }
+
+    // Contiguous blocks, so without stealing this is a static split of the image
+    int count = (int)tiles.size();
+    for (int t = 0; t < thread_count; ++t)
+        for (int k = (int)((long long)count * t / thread_count); k < (int)((long long)count * (t + 1) / thread_count); ++k)
+            _workers[t].tiles.push_back(tiles[k]);
+    _queued_tiles = count;
+
+    _pending_pixels = nx * ny;
+    _done_pixels = 0;
+    _busy_ns = 0;
+    _steals = 0;
+    _splits = 0;
+}
+
+bool Tile_Scheduler::next(int thread, Tile & tile)
+{
+    for (;;)
+    {
+        if (pop(thread, tile) || steal(thread, tile)) return true;
+
+        // Everything left is in flight on other threads; one of them may
+        // still split. The counters change before _idle_lock is taken to
+        // notify, so checking them under it cannot miss a wake-up.
+        std::unique_lock<std::mutex> lock(_idle_lock);
+        _work_ready.wait(lock, [this]() { return _queued_tiles > 0 || _pending_pixels == 0; });
+        if (_queued_tiles == 0) return false;
+    }
+}
+
+bool Tile_Scheduler::should_split(const Tile & tile, int rows_done, long long ns) const
+{
+    if (_workers.size() < 2) return false;     // nobody to hand the rest to
+    if (tile.height() - rows_done < k_min_tile_size) return false;
+    if (tile.width() < 2 * k_min_tile_size && tile.height() - rows_done < 2 * k_min_tile_size) return false;
+
+    long long done = _done_pixels;
+    if (done == 0) return false;    // no cost estimate yet
+    double expected = (double)_busy_ns / done * tile.pixel_count();
+    double projected = (double)ns * tile.height() / rows_done;
+    return projected > k_split_factor * expected;
+}
+
+void Tile_Scheduler::split(int thread, const Tile & rest)
+{
+    Tile a = rest, b = rest;
+    if (rest.width() >= rest.height() && rest.width() >= 2 * k_min_tile_size)
+        a.x1 = b.x0 = rest.x0 + rest.width() / 2;
+    else if (rest.height() >= 2 * k_min_tile_size)
+        a.y1 = b.y0 = rest.y0 + rest.height() / 2;
+    else
+    {
+        push(thread, rest);
+        return;
+    }
+    // b is pushed last, so this thread continues with it and a is the one left to steal
+    push(thread, a);
+    push(thread, b);
+    ++_splits;
+
+    std::lock_guard<std::mutex> lock(_idle_lock);
+    _work_ready.notify_all();
+}
+
+void Tile_Scheduler::finish(int pixels, long long ns)
+{
+    _done_pixels += pixels;
+    _busy_ns += ns;
+    if ((_pending_pixels -= pixels) == 0)
+    {
+        std::lock_guard<std::mutex> lock(_idle_lock);
+        _work_ready.notify_all();
+    }
+}
+
+void Tile_Scheduler::push(int thread, const Tile & tile)
+{
+    Worker & w = _workers[thread];
+    std::lock_guard<std::mutex> guard(w.lock);
+    w.tiles.push_back(tile);
+    ++_queued_tiles;
+}
+
+bool Tile_Scheduler::pop(int thread, Tile & tile)
+{
+    Worker & w = _workers[thread];
+    std::lock_guard<std::mutex> guard(w.lock);
+    if (w.tiles.empty()) return false;
+    tile = w.tiles.back();
+    w.tiles.pop_back();
+    --_queued_tiles;
+    return true;
+}
+
+bool Tile_Scheduler::steal(int thread, Tile & tile)
+{
+    int count = (int)_workers.size();
+    if (count < 2) return false;
+
+    // xorshift; only the owning thread touches its rng
+    unsigned int & rng = _workers[thread].rng;
+    rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+
+    // Start at a random victim and try every other thread once
+    int first = (int)(rng % (unsigned int)(count - 1));
+    for (int k = 0; k < count - 1; ++k)
+    {
+        int victim = (first + k) % (count - 1);
+        if (victim >= thread) ++victim;
+
+        Worker & w = _workers[victim];
+        std::lock_guard<std::mutex> guard(w.lock);
+        if (w.tiles.empty()) continue;
+        tile = w.tiles.front();
+        w.tiles.pop_front();
+        --_queued_tiles;
+        ++_steals;
+        return true;
+    }
+    return false;
+}
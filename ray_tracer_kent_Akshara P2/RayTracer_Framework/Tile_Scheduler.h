@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Pixels [x0, x1) x [y0, y1)
+struct Tile
+{
+    int x0, y0, x1, y1;
+
+    inline int width() const { return x1 - x0; }
+    inline int height() const { return y1 - y0; }
+    inline int pixel_count() const { return width() * height(); }
+};
+
+// Work-stealing tile queue for the render threads. Each thread owns a deque
+// seeded with a contiguous block of the image. It works from the back of its
+// own deque and, once that is empty, steals from the front of a random other
+// thread's, where the biggest untouched tiles are. A tile that runs well over
+// the expected cost is split and the unfinished part pushed back as two
+// halves, so expensive regions end up in small tiles spread over threads.
+// A thread that finds every deque empty sleeps until a split queues new
+// tiles or the last tile finishes.
+class Tile_Scheduler
+{
+public:
+    Tile_Scheduler() : _queued_tiles(0), _pending_pixels(0), _done_pixels(0), _busy_ns(0), _steals(0), _splits(0) {}
+    ~Tile_Scheduler() {}
+
+    // New frame: nx x ny pixels cut into tile_size tiles over thread_count deques
+    void reset(int thread_count, int nx, int ny, int tile_size);
+
+    // Next tile for 'thread'. Blocks while other threads still hold work that
+    // could be split off; false once every pixel has been rendered.
+    bool next(int thread, Tile & tile);
+
+    // True when a tile that has spent 'ns' on its first 'rows_done' rows is
+    // on course to take k_split_factor times the expected cost and what is
+    // left is big enough to share
+    bool should_split(const Tile & tile, int rows_done, long long ns) const;
+
+    // Hand the unrendered part of a tile back, halved along its longer side
+    void split(int thread, const Tile & rest);
+
+    // 'pixels' of a tile were rendered in 'ns' nanoseconds
+    void finish(int pixels, long long ns);
+
+    inline int	pending_pixels() const { return _pending_pixels; }
+    inline int	steal_count() const { return _steals; }
+    inline int	split_count() const { return _splits; }
+
+    static const int	k_min_tile_size = 8;
+    static const int	k_split_factor = 2;
+
+private:
+    void push(int thread, const Tile & tile);
+    bool pop(int thread, Tile & tile);      // back of its own deque
+    bool steal(int thread, Tile & tile);    // front of a random other deque
+
+    struct Worker
+    {
+        std::mutex          lock;
+        std::deque<Tile>    tiles;
+        unsigned int        rng;
+    };
+
+    std::vector<Worker>     _workers;
+    std::atomic<int>        _queued_tiles;      // in any deque; changed under that deque's lock
+    std::mutex              _idle_lock;         // pairs with _work_ready
+    std::condition_variable _work_ready;        // a split queued tiles, or the frame is done
+    std::atomic<int>        _pending_pixels;    // not rendered yet; 0 ends the frame
+    std::atomic<long long>  _done_pixels;       // cost model: _busy_ns / _done_pixels per pixel
+    std::atomic<long long>  _busy_ns;
+    std::atomic<int>        _steals;
+    std::atomic<int>        _splits;
+};
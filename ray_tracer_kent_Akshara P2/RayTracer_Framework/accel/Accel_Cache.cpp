@@ -0,0 +1,214 @@
+#include "Accel_Cache.h"
+#include "../common/hash.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+static const char			k_magic[4] = { 'R', 'T', 'A', 'C' };
+static const unsigned int	k_version = 1;		// bump whenever the build or the node layout changes
+static const size_t			k_section_align = 64;
+
+// Fixed-size header at the start of a cache file; offsets are from the file start
+struct Accel_Cache_Header
+{
+	char				magic[4];
+	unsigned int		version;
+	unsigned int		bvh_width;			// RT_BVH_WIDTH of the writer
+	unsigned int		node_size;			// sizeof(BVH_Node)
+	unsigned int		wide_node_size;		// sizeof(Wide_BVH_Node), 0 without a wide tree
+	unsigned int		prim_count;
+	unsigned long long	hash;
+	unsigned int		node_count;
+	unsigned int		index_count;
+	unsigned int		wide_node_count;
+	unsigned int		wide_index_count;
+	unsigned long long	boxes_offset;
+	unsigned long long	nodes_offset;
+	unsigned long long	indices_offset;
+	unsigned long long	wide_nodes_offset;
+	unsigned long long	wide_indices_offset;
+};
+
+static size_t align_up(size_t offset)
+{
+	return (offset + k_section_align - 1) & ~(k_section_align - 1);
+}
+
+unsigned long long Accel_Cache::hash_boxes(const std::vector<Bounding_Box> & boxes)
+{
+	unsigned int count = (unsigned int)boxes.size();
+	unsigned long long h = fnv1a(&count, sizeof(count));
+	return boxes.empty() ? h : fnv1a(&boxes[0], boxes.size() * sizeof(Bounding_Box), h);
+}
+
+static bool write_section(FILE * fp, size_t & offset, const void * data, size_t bytes)
+{
+	static const char zeros[k_section_align] = { 0 };
+	size_t start = align_up(offset);
+	if (start > offset && fwrite(zeros, 1, start - offset, fp) != start - offset) return false;
+	if (bytes > 0 && fwrite(data, 1, bytes, fp) != bytes) return false;
+	offset = start + bytes;
+	return true;
+}
+
+bool Accel_Cache::save(const char * path, unsigned long long hash, const std::vector<Bounding_Box> & boxes,
+	const BVH & bvh, const Wide_BVH * wide)
+{
+	Accel_Cache_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, k_magic, sizeof(k_magic));
+	header.version = k_version;
+	header.bvh_width = RT_BVH_WIDTH;
+	header.node_size = sizeof(BVH_Node);
+	header.wide_node_size = wide ? sizeof(Wide_BVH_Node) : 0;
+	header.prim_count = (unsigned int)boxes.size();
+	header.hash = hash;
+	header.node_count = bvh.node_count();
+	header.index_count = bvh.index_count();
+	header.wide_node_count = wide ? wide->node_count() : 0;
+	header.wide_index_count = wide ? wide->index_count() : 0;
+
+	size_t offset = align_up(sizeof(header));
+	header.boxes_offset = offset;
+	offset = align_up(offset + boxes.size() * sizeof(Bounding_Box));
+	header.nodes_offset = offset;
+	offset = align_up(offset + header.node_count * sizeof(BVH_Node));
+	header.indices_offset = offset;
+	offset = align_up(offset + header.index_count * sizeof(int));
+	header.wide_nodes_offset = offset;
+	offset = align_up(offset + header.wide_node_count * sizeof(Wide_BVH_Node));
+	header.wide_indices_offset = offset;
+
+	// Write to a temporary name and rename, so a reader never maps half a file;
+	// the name is per process, so several renderers starting at once each
+	// write their own copy and the last rename wins
+	char suffix[32];
+	sprintf(suffix, ".%d.tmp", (int)getpid());
+	std::string tmp_path = std::string(path) + suffix;
+	FILE * fp = fopen(tmp_path.c_str(), "wb");
+	if (fp == NULL)
+	{
+		printf("Accel cache: cannot write %s\n", tmp_path.c_str());
+		return false;
+	}
+	offset = 0;
+	bool ok = write_section(fp, offset, &header, sizeof(header))
+		&& write_section(fp, offset, boxes.empty() ? NULL : &boxes[0], boxes.size() * sizeof(Bounding_Box))
+		&& write_section(fp, offset, bvh.node_data(), header.node_count * sizeof(BVH_Node))
+		&& write_section(fp, offset, bvh.index_data(), header.index_count * sizeof(int))
+		&& write_section(fp, offset, wide ? (const void *)wide->node_data() : NULL, header.wide_node_count * sizeof(Wide_BVH_Node))
+		&& write_section(fp, offset, wide ? (const void *)wide->index_data() : NULL, header.wide_index_count * sizeof(int));
+	ok = (fclose(fp) == 0) && ok;
+	if (ok)
+	{
+		remove(path);
+		ok = rename(tmp_path.c_str(), path) == 0;
+	}
+	if (!ok)
+	{
+		printf("Accel cache: failed to write %s\n", path);
+		remove(tmp_path.c_str());
+	}
+	return ok;
+}
+
+// An aligned section of 'count' elements that ends inside the file
+static bool section_fits(unsigned long long offset, unsigned long long count, size_t element_size, size_t file_size)
+{
+	return offset % k_section_align == 0 && offset <= file_size && count <= (file_size - offset) / element_size;
+}
+
+// Every child and index range of the mapped trees stays inside its section,
+// and an interior node only points further down the array, as build() lays
+// them out, so a damaged file cannot send the traversal out of bounds or
+// round in a cycle
+static bool valid_indices(const int * indices, unsigned int count, unsigned int prim_count)
+{
+	for (unsigned int i = 0; i < count; i++)
+		if (indices[i] < 0 || (unsigned int)indices[i] >= prim_count) return false;
+	return true;
+}
+
+static bool valid_nodes(const BVH_Node * nodes, unsigned int node_count, unsigned int index_count)
+{
+	for (unsigned int i = 0; i < node_count; i++)
+	{
+		long long first = nodes[i].left_first, count = nodes[i].count;
+		if (count > 0 ? first < 0 || first + count > index_count
+			: count < 0 || first <= i || first + 1 >= node_count) return false;
+	}
+	return true;
+}
+
+static bool valid_nodes(const Wide_BVH_Node * nodes, unsigned int node_count, unsigned int index_count)
+{
+	for (unsigned int i = 0; i < node_count; i++)
+		for (int k = 0; k < WIDE_BVH_WIDTH; k++)
+		{
+			long long child = nodes[i].child[k], count = nodes[i].count[k];
+			if (count == -1) continue;
+			if (count > 0 ? child < 0 || child + count > index_count
+				: count < 0 || child <= i || child >= node_count) return false;
+		}
+	return true;
+}
+
+bool Accel_Cache::load(const char * path, unsigned long long hash, const std::vector<Bounding_Box> & boxes,
+	BVH & bvh, Wide_BVH * wide)
+{
+	_file.close();
+	if (!_file.open(path)) return false;
+
+	const unsigned char * base = _file.data();
+	size_t size = _file.size();
+	Accel_Cache_Header header;
+	if (size < sizeof(header))
+	{
+		_file.close();
+		return false;
+	}
+	memcpy(&header, base, sizeof(header));
+
+	bool valid = memcmp(header.magic, k_magic, sizeof(k_magic)) == 0
+		&& header.version == k_version
+		&& header.bvh_width == RT_BVH_WIDTH
+		&& header.node_size == sizeof(BVH_Node)
+		&& header.wide_node_size == (wide ? sizeof(Wide_BVH_Node) : 0)
+		&& header.hash == hash
+		&& header.prim_count == boxes.size()
+		&& header.node_count > 0
+		&& (wide == NULL || header.wide_node_count > 0)
+		&& section_fits(header.boxes_offset, boxes.size(), sizeof(Bounding_Box), size)
+		&& section_fits(header.nodes_offset, header.node_count, sizeof(BVH_Node), size)
+		&& section_fits(header.indices_offset, header.index_count, sizeof(int), size)
+		&& section_fits(header.wide_nodes_offset, header.wide_node_count, sizeof(Wide_BVH_Node), size)
+		&& section_fits(header.wide_indices_offset, header.wide_index_count, sizeof(int), size);
+
+	// The hash only picks the file; the stored boxes must match exactly
+	if (valid && !boxes.empty())
+		valid = memcmp(base + header.boxes_offset, &boxes[0], boxes.size() * sizeof(Bounding_Box)) == 0;
+	valid = valid
+		&& valid_nodes((const BVH_Node *)(base + header.nodes_offset), header.node_count, header.index_count)
+		&& valid_indices((const int *)(base + header.indices_offset), header.index_count, header.prim_count)
+		&& (wide == NULL
+			|| (valid_nodes((const Wide_BVH_Node *)(base + header.wide_nodes_offset), header.wide_node_count, header.wide_index_count)
+				&& valid_indices((const int *)(base + header.wide_indices_offset), header.wide_index_count, header.prim_count)));
+	if (!valid)
+	{
+		_file.close();
+		return false;
+	}
+
+	bvh.map((const BVH_Node *)(base + header.nodes_offset), header.node_count,
+		(const int *)(base + header.indices_offset), header.index_count);
+	if (wide)
+		wide->map((const Wide_BVH_Node *)(base + header.wide_nodes_offset), header.wide_node_count,
+			(const int *)(base + header.wide_indices_offset), header.wide_index_count);
+	return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "BVH.h"
+#include "Wide_BVH.h"
+#include "../common/mapped_file.h"
+#include <vector>
+
+// Built acceleration structures saved to a file so a static scene does not
+// pay for the SAH build on every start. A cache file holds the primitive
+// boxes the trees were built over, the binary BVH and (for RT_BVH_WIDTH > 2)
+// the wide BVH, each section on a 64-byte boundary. Loading maps the file
+// and points the trees straight at it, no copy and no parsing.
+class Accel_Cache
+{
+public:
+	Accel_Cache() {}
+	~Accel_Cache() {}
+
+	// Key for a scene: the primitive boxes fully determine the built trees
+	static unsigned long long hash_boxes(const std::vector<Bounding_Box> & boxes);
+
+	// Write the trees built over 'boxes'; wide may be NULL
+	static bool save(const char * path, unsigned long long hash, const std::vector<Bounding_Box> & boxes,
+		const BVH & bvh, const Wide_BVH * wide);
+
+	// Map the file and hand its sections to the trees. Fails without touching
+	// them if the file is missing, from another version or build
+	// configuration, was built over different boxes or has a node or index
+	// pointing outside the file. The mapping stays
+	// open until close() or the next load(); the trees must stop using it first.
+	bool load(const char * path, unsigned long long hash, const std::vector<Bounding_Box> & boxes,
+		BVH & bvh, Wide_BVH * wide);
+	void close() { _file.close(); }
+
+private:
+	Mapped_File	_file;
+};
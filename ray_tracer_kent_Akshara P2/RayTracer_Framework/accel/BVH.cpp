@@ -0,0 +1,421 @@
+#include "BVH.h"
+#include <algorithm>
+
+static const int	k_sah_bins = 16;
+static const int	k_max_leaf_size = 4;
+static const int	k_max_depth = 60;		// keeps the 64 entry traversal stack safe
+static const float	k_traversal_cost = 1.0f;	// relative to one primitive test
+static const float	k_refit_growth = 2.0f;	// area growth that triggers a local rebuild
+
+static inline float centroid(const Bounding_Box & box, int axis)
+{
+	return 0.5f * (box.lo[axis] + box.hi[axis]);
+}
+
+void BVH::clear()
+{
+	_nodes.clear();
+	_indices.clear();
+	_parents.clear();
+	_built_area.clear();
+	_leaf_of.clear();
+	_mapped_nodes = NULL;
+	_mapped_indices = NULL;
+	_mapped_node_count = _mapped_index_count = 0;
+	_garbage_nodes = _garbage_indices = 0;
+	_changed.clear();
+	_relinked.clear();
+	_rebuilt = true;
+}
+
+void BVH::build(const std::vector<Bounding_Box> & boxes)
+{
+	clear();
+	int n = (int)boxes.size();
+	_leaf_of.assign(n, -1);
+	if (n == 0) return;
+
+	_indices.resize(n);
+	for (int i = 0; i < n; i++) _indices[i] = i;
+
+	_nodes.reserve(2 * n);
+	_parents.reserve(2 * n);
+	_built_area.reserve(2 * n);
+	_nodes.push_back(BVH_Node());
+	_parents.push_back(-1);
+	_built_area.push_back(0.0f);
+	build_node(0, boxes, 0, n, 0);
+}
+
+void BVH::map(const BVH_Node * nodes, int node_count, const int * indices, int index_count)
+{
+	clear();
+	_mapped_nodes = nodes;
+	_mapped_node_count = node_count;
+	_mapped_indices = indices;
+	_mapped_index_count = index_count;
+}
+
+// Copy a mapped tree into owned storage and recover the update bookkeeping.
+// A mapped tree comes straight from build(), so it has no garbage and every
+// primitive index appears once.
+void BVH::unmap()
+{
+	if (_mapped_nodes == NULL) return;
+
+	std::vector<BVH_Node> nodes(_mapped_nodes, _mapped_nodes + _mapped_node_count);
+	std::vector<int> indices(_mapped_indices, _mapped_indices + _mapped_index_count);
+	clear();
+	_nodes.swap(nodes);
+	_indices.swap(indices);
+
+	int n = (int)_nodes.size();
+	_parents.assign(n, -1);
+	_built_area.resize(n);
+	_leaf_of.assign(_indices.size(), -1);
+	for (int i = 0; i < n; i++)
+	{
+		const BVH_Node & node = _nodes[i];
+		_built_area[i] = node.box.half_area();
+		if (node.is_leaf())
+		{
+			for (int k = 0; k < node.count; k++) _leaf_of[_indices[node.left_first + k]] = i;
+		}
+		else
+		{
+			_parents[node.left_first] = i;
+			_parents[node.left_first + 1] = i;
+		}
+	}
+}
+
+void BVH::build_node(int node_id, const std::vector<Bounding_Box> & boxes, int first, int count, int depth)
+{
+	Bounding_Box bounds, centroid_bounds;
+	for (int i = first; i < first + count; i++)
+	{
+		const Bounding_Box & b = boxes[_indices[i]];
+		bounds.extend(b);
+		M3DVector3f c;
+		b.centroid(c);
+		centroid_bounds.extend(c);
+	}
+	bounds.pad();
+	_nodes[node_id].box = bounds;
+	_nodes[node_id].left_first = first;
+	_nodes[node_id].count = count;
+	_built_area[node_id] = bounds.half_area();
+	for (int i = first; i < first + count; i++) _leaf_of[_indices[i]] = node_id;
+
+	if (count <= 1 || depth >= k_max_depth) return;
+
+	// Binned SAH: for every axis drop the centroids into k_sah_bins buckets and
+	// sweep the bucket boundaries for the cheapest split plane.
+	float best_cost = FLT_MAX;
+	int best_axis = -1, best_bin = 0;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float lo = centroid_bounds.lo[axis], extent = centroid_bounds.hi[axis] - lo;
+		if (extent <= 1e-12f) continue;
+		float scale = k_sah_bins / extent;
+
+		Bounding_Box bin_box[k_sah_bins];
+		int bin_count[k_sah_bins] = { 0 };
+		for (int i = first; i < first + count; i++)
+		{
+			const Bounding_Box & b = boxes[_indices[i]];
+			int bin = std::min(k_sah_bins - 1, (int)((centroid(b, axis) - lo) * scale));
+			bin_count[bin]++;
+			bin_box[bin].extend(b);
+		}
+
+		float right_area[k_sah_bins];
+		int right_count[k_sah_bins];
+		Bounding_Box acc;
+		int n = 0;
+		for (int b = k_sah_bins - 1; b > 0; b--)
+		{
+			acc.extend(bin_box[b]);
+			n += bin_count[b];
+			right_area[b] = acc.half_area();
+			right_count[b] = n;
+		}
+
+		acc.reset();
+		n = 0;
+		for (int b = 0; b < k_sah_bins - 1; b++)
+		{
+			acc.extend(bin_box[b]);
+			n += bin_count[b];
+			if (n == 0 || right_count[b + 1] == 0) continue;
+			float cost = acc.half_area() * n + right_area[b + 1] * right_count[b + 1];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+
+	float parent_area = bounds.half_area();
+	float leaf_cost = (float)count;
+	int mid = first;
+	if (best_axis >= 0)
+	{
+		float split_cost = k_traversal_cost + (parent_area > 0.0f ? best_cost / parent_area : 0.0f);
+		if (split_cost >= leaf_cost && count <= k_max_leaf_size) return;
+
+		float lo = centroid_bounds.lo[best_axis];
+		float scale = k_sah_bins / (centroid_bounds.hi[best_axis] - lo);
+		int * part = std::partition(&_indices[0] + first, &_indices[0] + first + count, [&](int id) {
+			return std::min(k_sah_bins - 1, (int)((centroid(boxes[id], best_axis) - lo) * scale)) <= best_bin;
+		});
+		mid = (int)(part - &_indices[0]);
+	}
+	else
+	{
+		// All centroids coincide; split by count so leaves stay small
+		if (count <= k_max_leaf_size) return;
+		mid = first + count / 2;
+	}
+
+	int left = (int)_nodes.size();
+	_nodes.push_back(BVH_Node());
+	_nodes.push_back(BVH_Node());
+	_parents.push_back(node_id);
+	_parents.push_back(node_id);
+	_built_area.push_back(0.0f);
+	_built_area.push_back(0.0f);
+	_nodes[node_id].left_first = left;
+	_nodes[node_id].count = 0;
+
+	build_node(left, boxes, first, mid - first, depth + 1);
+	build_node(left + 1, boxes, mid, first + count - mid, depth + 1);
+}
+
+void BVH::gather(int node_id, std::vector<int> & prims) const
+{
+	const BVH_Node & node = _nodes[node_id];
+	if (node.is_leaf())
+	{
+		prims.insert(prims.end(), _indices.begin() + node.left_first, _indices.begin() + node.left_first + node.count);
+		return;
+	}
+	gather(node.left_first, prims);
+	gather(node.left_first + 1, prims);
+}
+
+int BVH::depth_of(int node_id) const
+{
+	int depth = 0;
+	for (int p = _parents[node_id]; p >= 0; p = _parents[p]) depth++;
+	return depth;
+}
+
+// Rebuild the tree under node_id from scratch. Its primitives get a fresh run
+// at the end of _indices and fresh child nodes; the old ones become garbage.
+void BVH::rebuild_subtree(const std::vector<Bounding_Box> & boxes, int node_id)
+{
+	std::vector<int> prims;
+	gather(node_id, prims);
+	if (!_nodes[node_id].is_leaf())
+	{
+		// Every node below node_id is orphaned
+		int stack[64], top = 0, orphaned = 0;
+		stack[top++] = node_id;
+		while (top > 0)
+		{
+			const BVH_Node & n = _nodes[stack[--top]];
+			if (n.is_leaf()) continue;
+			orphaned += 2;
+			stack[top++] = n.left_first;
+			stack[top++] = n.left_first + 1;
+		}
+		_garbage_nodes += orphaned;
+	}
+	_garbage_indices += (int)prims.size();
+
+	int first = (int)_indices.size();
+	_indices.insert(_indices.end(), prims.begin(), prims.end());
+	build_node(node_id, boxes, first, (int)prims.size(), depth_of(node_id));
+	_relinked.push_back(node_id);
+}
+
+void BVH::refit_leaf(const std::vector<Bounding_Box> & boxes, int node_id)
+{
+	BVH_Node & node = _nodes[node_id];
+	node.box.reset();
+	for (int i = 0; i < node.count; i++)
+		node.box.extend(boxes[_indices[node.left_first + i]]);
+	node.box.pad();
+	_changed.push_back(node_id);
+}
+
+// Recompute the boxes from node_id up to the root
+void BVH::refit_up(int node_id)
+{
+	for (int p = node_id; p >= 0; p = _parents[p])
+	{
+		BVH_Node & node = _nodes[p];
+		if (node.is_leaf()) continue;
+		Bounding_Box box = _nodes[node.left_first].box;
+		box.extend(_nodes[node.left_first + 1].box);
+		node.box = box;
+		_changed.push_back(p);
+	}
+}
+
+void BVH::refit(const std::vector<Bounding_Box> & boxes, int prim)
+{
+	unmap();
+	int leaf = _leaf_of[prim];
+	if (leaf < 0) return;
+
+	refit_leaf(boxes, leaf);
+	refit_up(_parents[leaf]);
+
+	// Moved far from its neighbours: take it out and insert it where it fits now
+	int parent = _parents[leaf];
+	if ((_nodes[leaf].box.half_area() > k_refit_growth * _built_area[leaf]) ||
+		(parent >= 0 && _nodes[parent].box.half_area() > k_refit_growth * _built_area[parent]))
+	{
+		remove(prim);
+		insert(boxes, prim);
+		leaf = _leaf_of[prim];
+	}
+
+	// Rebuild the largest subtree on the path whose box has grown too much
+	int worst = -1;
+	for (int p = leaf; p >= 0; p = _parents[p])
+		if (_nodes[p].box.half_area() > k_refit_growth * _built_area[p]) worst = p;
+	if (worst >= 0) rebuild_subtree(boxes, worst);
+}
+
+void BVH::insert(const std::vector<Bounding_Box> & boxes, int prim)
+{
+	unmap();
+	if ((int)_leaf_of.size() <= prim) _leaf_of.resize(prim + 1, -1);
+
+	const Bounding_Box & box = boxes[prim];
+	if (_nodes.empty())
+	{
+		_indices.push_back(prim);
+		_nodes.push_back(BVH_Node());
+		_parents.push_back(-1);
+		_built_area.push_back(0.0f);
+		build_node(0, boxes, (int)_indices.size() - 1, 1, 0);
+		_rebuilt = true;
+		return;
+	}
+
+	// Descend towards the child whose box grows the least
+	int node_id = 0;
+	while (!_nodes[node_id].is_leaf())
+	{
+		int l = _nodes[node_id].left_first, r = l + 1;
+		Bounding_Box bl = _nodes[l].box, br = _nodes[r].box;
+		float al = bl.half_area(), ar = br.half_area();
+		bl.extend(box);
+		br.extend(box);
+		float gl = bl.half_area() - al, gr = br.half_area() - ar;
+		node_id = (gl < gr || (gl == gr && al <= ar)) ? l : r;
+	}
+
+	// The leaf's run cannot grow in place: copy it plus the new primitive to
+	// the end of _indices, then split it if it got too big
+	BVH_Node & leaf = _nodes[node_id];
+	int first = (int)_indices.size();
+	for (int i = 0; i < leaf.count; i++) _indices.push_back(_indices[leaf.left_first + i]);
+	_indices.push_back(prim);
+	_garbage_indices += leaf.count;
+
+	int count = leaf.count + 1;
+	if (count <= k_max_leaf_size)
+	{
+		leaf.left_first = first;
+		leaf.count = count;
+		_leaf_of[prim] = node_id;
+		refit_leaf(boxes, node_id);
+	}
+	else
+	{
+		build_node(node_id, boxes, first, count, depth_of(node_id));
+		_relinked.push_back(node_id);
+	}
+	refit_up(_parents[node_id]);
+}
+
+void BVH::remove(int prim)
+{
+	unmap();
+	int leaf_id = _leaf_of[prim];
+	if (leaf_id < 0) return;
+	_leaf_of[prim] = -1;
+
+	BVH_Node & leaf = _nodes[leaf_id];
+	int * run = &_indices[leaf.left_first];
+	for (int i = 0; i < leaf.count; i++)
+	{
+		if (run[i] == prim)
+		{
+			run[i] = run[leaf.count - 1];
+			break;
+		}
+	}
+	leaf.count--;
+	_garbage_indices++;
+
+	if (leaf.count > 0)
+	{
+		// The old box still bounds what is left; the next refit shrinks it
+		_changed.push_back(leaf_id);
+		return;
+	}
+
+	// Empty leaf: its sibling takes the parent's place
+	int parent = _parents[leaf_id];
+	if (parent < 0)
+	{
+		clear();
+		return;
+	}
+	int sibling = (leaf_id == _nodes[parent].left_first) ? leaf_id + 1 : leaf_id - 1;
+	_nodes[parent] = _nodes[sibling];
+	_built_area[parent] = _built_area[sibling];
+	if (_nodes[parent].is_leaf())
+	{
+		for (int i = 0; i < _nodes[parent].count; i++) _leaf_of[_indices[_nodes[parent].left_first + i]] = parent;
+	}
+	else
+	{
+		_parents[_nodes[parent].left_first] = parent;
+		_parents[_nodes[parent].left_first + 1] = parent;
+	}
+	_garbage_nodes += 2;
+	_relinked.push_back(parent);
+	refit_up(_parents[parent]);
+}
+
+void BVH::rename(int old_prim, int new_prim)
+{
+	unmap();
+	int leaf_id = _leaf_of[old_prim];
+	if ((int)_leaf_of.size() <= new_prim) _leaf_of.resize(new_prim + 1, -1);
+	_leaf_of[new_prim] = leaf_id;
+	_leaf_of[old_prim] = -1;
+	if (leaf_id < 0) return;
+
+	BVH_Node & leaf = _nodes[leaf_id];
+	for (int i = 0; i < leaf.count; i++)
+		if (_indices[leaf.left_first + i] == old_prim) _indices[leaf.left_first + i] = new_prim;
+	_changed.push_back(leaf_id);
+}
+
+float BVH::garbage_ratio() const
+{
+	if (_nodes.empty()) return 0.0f;
+	float node_ratio = (float)_garbage_nodes / (float)_nodes.size();
+	float index_ratio = _indices.empty() ? 0.0f : (float)_garbage_indices / (float)_indices.size();
+	return std::max(node_ratio, index_ratio);
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include "../common/bounding_box.h"
+#include <vector>
+
+// Flattened binary BVH node. Interior nodes keep their two children next to
+// each other (left_first, left_first + 1); leaves index a run of _indices.
+struct BVH_Node
+{
+	Bounding_Box	box;
+	int				left_first;
+	int				count;		// 0 for interior nodes
+
+	inline bool is_leaf() const { return count > 0; }
+};
+
+// Bounding volume hierarchy built with the binned surface area heuristic.
+// It only knows about boxes; callers map the leaf indices back to their own
+// primitives through the Leaf_Test functor handed to the traversal.
+class BVH
+{
+public:
+	BVH() : _mapped_nodes(NULL), _mapped_indices(NULL), _mapped_node_count(0), _mapped_index_count(0),
+		_garbage_nodes(0), _garbage_indices(0), _rebuilt(false) {}
+	~BVH() {}
+
+	void build(const std::vector<Bounding_Box> & boxes);
+	void clear();
+
+	// Incremental updates for animation. 'boxes' is indexed by primitive as in
+	// build(). refit() walks one leaf-to-root path; a primitive that moved far
+	// from its leaf is re-inserted, and a subtree whose box grew well past its
+	// build-time size is rebuilt on its own. Each call is O(log n) plus the
+	// size of any subtree it has to rebuild.
+	void refit(const std::vector<Bounding_Box> & boxes, int prim);
+	void insert(const std::vector<Bounding_Box> & boxes, int prim);
+	void remove(int prim);
+	void rename(int old_prim, int new_prim);	// primitive index changed (swap-remove in the caller)
+
+	// Fraction of node/index storage orphaned by updates; rebuild when it gets large
+	float	garbage_ratio() const;
+
+	// Update bookkeeping for structures derived from this tree (Wide_BVH):
+	// nodes whose box or leaf range changed, nodes whose children were
+	// replaced, and whether the whole tree was rebuilt since clear_changes().
+	inline const std::vector<int> & get_changed_nodes() const { return _changed; }
+	inline const std::vector<int> & get_relinked_nodes() const { return _relinked; }
+	inline bool was_rebuilt() const { return _rebuilt; }
+	inline void clear_changes() { _changed.clear(); _relinked.clear(); _rebuilt = false; }
+
+	// Use nodes and indices that live elsewhere (a mapped cache file) instead
+	// of building; the memory must outlive the tree or the next clear()/build().
+	// The first update copies them into owned storage (unmap()).
+	void	map(const BVH_Node * nodes, int node_count, const int * indices, int index_count);
+	void	unmap();
+	inline bool is_mapped() const { return _mapped_nodes != NULL; }
+
+	inline bool empty() const { return node_count() == 0; }
+	inline const BVH_Node * node_data() const { return _mapped_nodes ? _mapped_nodes : (_nodes.empty() ? NULL : &_nodes[0]); }
+	inline int node_count() const { return _mapped_nodes ? _mapped_node_count : (int)_nodes.size(); }
+	inline const int * index_data() const { return _mapped_nodes ? _mapped_indices : (_indices.empty() ? NULL : &_indices[0]); }
+	inline int index_count() const { return _mapped_nodes ? _mapped_index_count : (int)_indices.size(); }
+
+	// Closest hit. test(prim_index, tmax) returns true and shrinks tmax when the
+	// primitive is hit closer than tmax.
+	template <class Leaf_Test>
+	bool closest_hit(const M3DVector3f start, const M3DVector3f dir, float & tmax, Leaf_Test & test) const
+	{
+		if (node_count() == 0) return false;
+		const BVH_Node * nodes = node_data();
+		const int * indices = index_data();
+
+		M3DVector3f inv_dir;
+		inverse_direction(inv_dir, dir);
+
+		float tnear;
+		if (!nodes[0].box.intersect(start, inv_dir, tmax, tnear)) return false;
+
+		bool hit = false;
+		int stack[64];
+		float stack_t[64];
+		int top = 0;
+		stack[top] = 0; stack_t[top++] = tnear;
+		while (top > 0)
+		{
+			--top;
+			if (stack_t[top] > tmax) continue;
+			const BVH_Node & node = nodes[stack[top]];
+			if (node.is_leaf())
+			{
+				for (int i = 0; i < node.count; i++)
+					if (test(indices[node.left_first + i], tmax)) hit = true;
+				continue;
+			}
+
+			// Push the nearer child last so it is visited first and shrinks tmax early
+			int near_id = node.left_first, far_id = node.left_first + 1;
+			float t_near, t_far;
+			bool hit_near = nodes[near_id].box.intersect(start, inv_dir, tmax, t_near);
+			bool hit_far = nodes[far_id].box.intersect(start, inv_dir, tmax, t_far);
+			if (hit_near && hit_far)
+			{
+				if (t_far < t_near)
+				{
+					int tmp = near_id; near_id = far_id; far_id = tmp;
+					float tt = t_near; t_near = t_far; t_far = tt;
+				}
+				stack[top] = far_id; stack_t[top++] = t_far;
+				stack[top] = near_id; stack_t[top++] = t_near;
+			}
+			else if (hit_near)
+			{
+				stack[top] = near_id; stack_t[top++] = t_near;
+			}
+			else if (hit_far)
+			{
+				stack[top] = far_id; stack_t[top++] = t_far;
+			}
+		}
+		return hit;
+	}
+
+	// Any hit: returns as soon as test(prim_index) reports a blocker. No
+	// front-to-back ordering, the first blocker found is as good as any.
+	template <class Leaf_Test>
+	bool any_hit(const M3DVector3f start, const M3DVector3f dir, float tmax, Leaf_Test & test) const
+	{
+		if (node_count() == 0) return false;
+		const BVH_Node * nodes = node_data();
+		const int * indices = index_data();
+
+		M3DVector3f inv_dir;
+		inverse_direction(inv_dir, dir);
+
+		float tnear;
+		int stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const BVH_Node & node = nodes[stack[--top]];
+			if (!node.box.intersect(start, inv_dir, tmax, tnear)) continue;
+			if (node.is_leaf())
+			{
+				for (int i = 0; i < node.count; i++)
+					if (test(indices[node.left_first + i])) return true;
+				continue;
+			}
+			stack[top++] = node.left_first + 1;
+			stack[top++] = node.left_first;
+		}
+		return false;
+	}
+
+private:
+	void	build_node(int node_id, const std::vector<Bounding_Box> & boxes, int first, int count, int depth);
+	void	rebuild_subtree(const std::vector<Bounding_Box> & boxes, int node_id);
+	void	refit_leaf(const std::vector<Bounding_Box> & boxes, int node_id);
+	void	refit_up(int node_id);
+	void	gather(int node_id, std::vector<int> & prims) const;
+	int		depth_of(int node_id) const;
+
+private:
+	std::vector<BVH_Node>	_nodes;
+	std::vector<int>		_indices;
+	const BVH_Node *		_mapped_nodes;
+	const int *				_mapped_indices;
+	int						_mapped_node_count;
+	int						_mapped_index_count;
+
+	// Update support
+	std::vector<int>		_parents;		// per node, -1 for the root
+	std::vector<float>		_built_area;	// per node, half area when it was (re)built
+	std::vector<int>		_leaf_of;		// per primitive, the leaf holding it (-1 if none)
+	int						_garbage_nodes;
+	int						_garbage_indices;
+	std::vector<int>		_changed;
+	std::vector<int>		_relinked;
+	bool					_rebuilt;
+};
@@ -0,0 +1,121 @@
+#include "Grid.h"
+#include <math.h>
+
+static const float	k_top_density = 1.0f;	// cells per primitive in the top grid
+static const float	k_sub_density = 2.0f;	// cells per primitive inside a sub grid
+static const int	k_top_max_res = 128;
+static const int	k_sub_max_res = 16;
+static const int	k_max_cell_prims = 16;	// more than this and a cell gets a sub grid
+
+// Cells [range[0..2], range[3..5]] overlapped by a box, clamped to the level
+static void cell_range(const Grid_Level & level, const Bounding_Box & box, int range[6])
+{
+	for (int i = 0; i < 3; i++)
+	{
+		int lo = (int)((box.lo[i] - level.bounds.lo[i]) * level.inv_cell_size[i]);
+		int hi = (int)((box.hi[i] - level.bounds.lo[i]) * level.inv_cell_size[i]);
+		range[i] = lo < 0 ? 0 : (lo >= level.res[i] ? level.res[i] - 1 : lo);
+		range[i + 3] = hi < 0 ? 0 : (hi >= level.res[i] ? level.res[i] - 1 : hi);
+	}
+}
+
+void Grid::clear()
+{
+	_top.cell_first.clear();
+	_top.sub.clear();
+	_subs.clear();
+	_items.clear();
+}
+
+void Grid::build(const std::vector<Bounding_Box> & boxes)
+{
+	clear();
+	if (boxes.empty()) return;
+
+	Bounding_Box bounds;
+	std::vector<int> prims(boxes.size());
+	for (size_t i = 0; i < boxes.size(); i++)
+	{
+		bounds.extend(boxes[i]);
+		prims[i] = (int)i;
+	}
+	bounds.pad();
+	build_level(_top, bounds, boxes, prims, k_top_density, k_top_max_res);
+
+	// Crowded cells get their own sub grid over the cell's box
+	int cells = _top.res[0] * _top.res[1] * _top.res[2];
+	_top.sub.assign(cells, -1);
+	for (int z = 0; z < _top.res[2]; z++)
+	for (int y = 0; y < _top.res[1]; y++)
+	for (int x = 0; x < _top.res[0]; x++)
+	{
+		int c = _top.cell_index(x, y, z);
+		int count = _top.cell_first[c + 1] - _top.cell_first[c];
+		if (count <= k_max_cell_prims) continue;
+
+		Bounding_Box cell_box;
+		int xyz[3] = { x, y, z };
+		for (int i = 0; i < 3; i++)
+		{
+			cell_box.lo[i] = _top.bounds.lo[i] + xyz[i] * _top.cell_size[i];
+			cell_box.hi[i] = cell_box.lo[i] + _top.cell_size[i];
+		}
+		cell_box.pad();
+
+		std::vector<int> cell_prims(_items.begin() + _top.cell_first[c], _items.begin() + _top.cell_first[c + 1]);
+		Grid_Level level;
+		build_level(level, cell_box, boxes, cell_prims, k_sub_density, k_sub_max_res);
+		_top.sub[c] = (int)_subs.size();
+		_subs.push_back(level);
+	}
+}
+
+// Pick the resolution so there are about 'density' cells per primitive, then
+// bin every primitive into each cell its box overlaps (count, prefix sum, fill)
+void Grid::build_level(Grid_Level & level, const Bounding_Box & bounds, const std::vector<Bounding_Box> & boxes,
+	const std::vector<int> & prims, float density, int max_res)
+{
+	level.bounds = bounds;
+	float extent[3], volume = 1.0f;
+	for (int i = 0; i < 3; i++)
+	{
+		extent[i] = bounds.hi[i] - bounds.lo[i];
+		volume *= extent[i];
+	}
+	float cells_per_unit = volume > 0.0f ? powf(density * prims.size() / volume, 1.0f / 3.0f) : 0.0f;
+	for (int i = 0; i < 3; i++)
+	{
+		int r = (int)(extent[i] * cells_per_unit);
+		level.res[i] = r < 1 ? 1 : (r > max_res ? max_res : r);
+		level.cell_size[i] = extent[i] / level.res[i];
+		level.inv_cell_size[i] = level.cell_size[i] > 0.0f ? 1.0f / level.cell_size[i] : 0.0f;
+	}
+
+	int cells = level.res[0] * level.res[1] * level.res[2];
+	level.cell_first.assign(cells + 1, 0);
+
+	int range[6];
+	for (size_t k = 0; k < prims.size(); k++)
+	{
+		cell_range(level, boxes[prims[k]], range);
+		for (int z = range[2]; z <= range[5]; z++)
+		for (int y = range[1]; y <= range[4]; y++)
+		for (int x = range[0]; x <= range[3]; x++)
+			level.cell_first[level.cell_index(x, y, z) + 1]++;
+	}
+
+	int base = (int)_items.size();
+	level.cell_first[0] = base;
+	for (int c = 0; c < cells; c++) level.cell_first[c + 1] += level.cell_first[c];
+	_items.resize(level.cell_first[cells]);
+
+	std::vector<int> fill(level.cell_first.begin(), level.cell_first.end() - 1);
+	for (size_t k = 0; k < prims.size(); k++)
+	{
+		cell_range(level, boxes[prims[k]], range);
+		for (int z = range[2]; z <= range[5]; z++)
+		for (int y = range[1]; y <= range[4]; y++)
+		for (int x = range[0]; x <= range[3]; x++)
+			_items[fill[level.cell_index(x, y, z)]++] = prims[k];
+	}
+}
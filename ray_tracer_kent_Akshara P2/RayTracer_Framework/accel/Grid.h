@@ -0,0 +1,197 @@
+#pragma once
+#include "../common/bounding_box.h"
+#include <vector>
+
+// One level of the grid: res[0] x res[1] x res[2] cells over 'bounds'. The
+// primitives overlapping cell c are _items[cell_first[c] .. cell_first[c + 1]).
+struct Grid_Level
+{
+	Bounding_Box		bounds;
+	int					res[3];
+	float				cell_size[3];
+	float				inv_cell_size[3];
+	std::vector<int>	cell_first;
+	std::vector<int>	sub;		// top level only: per cell, index of its sub grid or -1
+
+	inline int cell_index(int x, int y, int z) const { return (z * res[1] + y) * res[0] + x; }
+};
+
+// Small per-query mailbox: a primitive that spans several cells is tested
+// once per ray. Lives on the stack, so concurrent queries never share it.
+struct Grid_Mailbox
+{
+	enum { k_size = 32 };
+	int		ids[k_size];
+
+	Grid_Mailbox() { for (int i = 0; i < k_size; i++) ids[i] = -1; }
+
+	inline bool seen(int id)
+	{
+		int & slot = ids[id & (k_size - 1)];
+		if (slot == id) return true;
+		slot = id;
+		return false;
+	}
+};
+
+// Two-level uniform grid traversed with a 3D-DDA. The cell count follows the
+// primitive density; cells that still hold many primitives (clusters) get a
+// uniform sub grid of their own. Same Leaf_Test contract as BVH.
+class Grid
+{
+public:
+	Grid() {}
+	~Grid() {}
+
+	void build(const std::vector<Bounding_Box> & boxes);
+	void clear();
+
+	inline bool empty() const { return _top.cell_first.empty(); }
+
+	// Closest hit. test(prim_index, tmax) returns true and shrinks tmax when the
+	// primitive is hit closer than tmax.
+	template <class Leaf_Test>
+	bool closest_hit(const M3DVector3f start, const M3DVector3f dir, float & tmax, Leaf_Test & test) const
+	{
+		if (empty()) return false;
+
+		M3DVector3f inv_dir;
+		inverse_direction(inv_dir, dir);
+		Grid_Mailbox mailbox;
+		Closest_Visit<Leaf_Test> visit(*this, start, dir, inv_dir, tmax, test, mailbox);
+		walk(_top, start, dir, inv_dir, 0.0f, tmax, visit);
+		return visit.hit;
+	}
+
+	// Any hit: returns as soon as test(prim_index) reports a blocker
+	template <class Leaf_Test>
+	bool any_hit(const M3DVector3f start, const M3DVector3f dir, float tmax, Leaf_Test & test) const
+	{
+		if (empty()) return false;
+
+		M3DVector3f inv_dir;
+		inverse_direction(inv_dir, dir);
+		Grid_Mailbox mailbox;
+		Any_Visit<Leaf_Test> visit(*this, start, dir, inv_dir, test, mailbox);
+		return walk(_top, start, dir, inv_dir, 0.0f, tmax, visit);
+	}
+
+private:
+	void	build_level(Grid_Level & level, const Bounding_Box & bounds, const std::vector<Bounding_Box> & boxes,
+				const std::vector<int> & prims, float density, int max_res);
+
+	// 3D-DDA over the cells of one level between t_begin and t_end. Calls
+	// visit(level, cell, t_enter, t_exit) front to back and returns true as
+	// soon as the visitor does.
+	template <class Visit>
+	bool walk(const Grid_Level & level, const M3DVector3f start, const M3DVector3f dir, const M3DVector3f inv_dir,
+		float t_begin, float t_end, Visit & visit) const
+	{
+		float t0 = t_begin, t1 = t_end;
+		if (!level.bounds.clip(start, inv_dir, t0, t1)) return false;
+
+		int cell[3], step[3], out[3];
+		float t_next[3], t_delta[3];
+		for (int i = 0; i < 3; i++)
+		{
+			float p = start[i] + dir[i] * t0;
+			int c = (int)((p - level.bounds.lo[i]) * level.inv_cell_size[i]);
+			cell[i] = c < 0 ? 0 : (c >= level.res[i] ? level.res[i] - 1 : c);
+			if (dir[i] >= 0.0f)
+			{
+				step[i] = 1;
+				out[i] = level.res[i];
+				t_next[i] = (level.bounds.lo[i] + (cell[i] + 1) * level.cell_size[i] - start[i]) * inv_dir[i];
+			}
+			else
+			{
+				step[i] = -1;
+				out[i] = -1;
+				t_next[i] = (level.bounds.lo[i] + cell[i] * level.cell_size[i] - start[i]) * inv_dir[i];
+			}
+			t_delta[i] = level.cell_size[i] * fabs(inv_dir[i]);
+		}
+
+		float t_enter = t0;
+		for (;;)
+		{
+			int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+			float t_exit = t_next[axis] < t1 ? t_next[axis] : t1;
+			if (visit(level, level.cell_index(cell[0], cell[1], cell[2]), t_enter, t_exit)) return true;
+			if (t_next[axis] >= t1) return false;
+
+			cell[axis] += step[axis];
+			if (cell[axis] == out[axis]) return false;
+			t_enter = t_next[axis];
+			t_next[axis] += t_delta[axis];
+		}
+	}
+
+	// Closest hit visitor: stops once the nearest hit lies inside the cell
+	// just tested, since later cells are all farther away
+	template <class Leaf_Test>
+	struct Closest_Visit
+	{
+		const Grid &	grid;
+		const float *	start;
+		const float *	dir;
+		const float *	inv_dir;
+		float &			tmax;
+		Leaf_Test &		test;
+		Grid_Mailbox &	mailbox;
+		bool			hit;
+
+		Closest_Visit(const Grid & g, const M3DVector3f s, const M3DVector3f d, const M3DVector3f inv,
+			float & t, Leaf_Test & lt, Grid_Mailbox & mb)
+			: grid(g), start(s), dir(d), inv_dir(inv), tmax(t), test(lt), mailbox(mb), hit(false) {}
+
+		inline bool operator()(const Grid_Level & level, int cell, float t_enter, float t_exit)
+		{
+			if (!level.sub.empty() && level.sub[cell] >= 0)
+			{
+				grid.walk(grid._subs[level.sub[cell]], start, dir, inv_dir, t_enter, tmax < t_exit ? tmax : t_exit, *this);
+				return tmax <= t_exit;
+			}
+			for (int k = level.cell_first[cell]; k < level.cell_first[cell + 1]; k++)
+			{
+				int id = grid._items[k];
+				if (mailbox.seen(id)) continue;
+				if (test(id, tmax)) hit = true;
+			}
+			return tmax <= t_exit;
+		}
+	};
+
+	template <class Leaf_Test>
+	struct Any_Visit
+	{
+		const Grid &	grid;
+		const float *	start;
+		const float *	dir;
+		const float *	inv_dir;
+		Leaf_Test &		test;
+		Grid_Mailbox &	mailbox;
+
+		Any_Visit(const Grid & g, const M3DVector3f s, const M3DVector3f d, const M3DVector3f inv,
+			Leaf_Test & lt, Grid_Mailbox & mb)
+			: grid(g), start(s), dir(d), inv_dir(inv), test(lt), mailbox(mb) {}
+
+		inline bool operator()(const Grid_Level & level, int cell, float t_enter, float t_exit)
+		{
+			if (!level.sub.empty() && level.sub[cell] >= 0)
+				return grid.walk(grid._subs[level.sub[cell]], start, dir, inv_dir, t_enter, t_exit, *this);
+			for (int k = level.cell_first[cell]; k < level.cell_first[cell + 1]; k++)
+			{
+				int id = grid._items[k];
+				if (mailbox.seen(id)) continue;
+				if (test(id)) return true;
+			}
+			return false;
+		}
+	};
+
+private:
+	Grid_Level					_top;
+	std::vector<Grid_Level>		_subs;
+	std::vector<int>			_items;
+};
@@ -0,0 +1,53 @@
+#pragma once
+#include "accel_config.h"
+#include <stddef.h>
+#include <string.h>
+
+// Per-thread counters of the wide BVH traversals, compiled in only with
+// RT_TRAVERSAL_STATS. A packet traversal counts one node fetch for the whole
+// packet, which is what coherent rays save. Cache misses are estimated with
+// a direct-mapped model of a 32 KB L1 (64-byte lines), so the numbers only
+// depend on the order rays are traced in, not on the machine.
+struct Traversal_Stats
+{
+	enum { k_line_count = 512 };
+
+	long long	node_fetches;
+	long long	line_misses;
+	long long	prim_tests;
+	size_t		lines[k_line_count];
+
+	Traversal_Stats() { clear(); }
+
+	inline void clear()
+	{
+		node_fetches = line_misses = prim_tests = 0;
+		memset(lines, 0xff, sizeof(lines));
+	}
+
+	inline void fetch(const void * data, size_t bytes)
+	{
+		node_fetches++;
+		size_t first = (size_t)data >> 6, last = ((size_t)data + bytes - 1) >> 6;
+		for (size_t line = first; line <= last; line++)
+		{
+			size_t & slot = lines[line & (k_line_count - 1)];
+			if (slot != line) { slot = line; line_misses++; }
+		}
+	}
+};
+
+// Counters of the calling thread
+inline Traversal_Stats & traversal_stats()
+{
+	static thread_local Traversal_Stats stats;
+	return stats;
+}
+
+#if RT_TRAVERSAL_STATS
+#define RT_COUNT_NODE(node)		traversal_stats().fetch(&(node), sizeof(node))
+#define RT_COUNT_PRIMS(n)		(traversal_stats().prim_tests += (n))
+#else
+#define RT_COUNT_NODE(node)
+#define RT_COUNT_PRIMS(n)
+#endif
@@ -0,0 +1,237 @@
+#include "Wide_BVH.h"
+
+void Wide_BVH::clear()
+{
+	_nodes.clear();
+	_indices.clear();
+	_source.clear();
+	_live.clear();
+	_slot_node.clear();
+	_slot_of.clear();
+	_opened_in.clear();
+	_garbage = 0;
+	_mapped_nodes = NULL;
+	_mapped_indices = NULL;
+	_mapped_node_count = _mapped_index_count = 0;
+}
+
+void Wide_BVH::map(const Wide_BVH_Node * nodes, int node_count, const int * indices, int index_count)
+{
+	clear();
+	_mapped_nodes = nodes;
+	_mapped_node_count = node_count;
+	_mapped_indices = indices;
+	_mapped_index_count = index_count;
+}
+
+void Wide_BVH::build(const BVH & bvh)
+{
+	clear();
+	if (bvh.empty()) return;
+
+	_indices.resize(bvh.index_count());
+	_slot_of.assign(bvh.node_count(), -1);
+	_opened_in.assign(bvh.node_count(), -1);
+	_nodes.reserve(bvh.node_count() / 2 + 1);
+	collapse(bvh, 0);
+}
+
+void Wide_BVH::update(const BVH & bvh)
+{
+	const BVH_Node * src = bvh.node_data();
+	const int * indices = bvh.index_data();
+	if (_nodes.empty() || _mapped_nodes)
+	{
+		build(bvh);
+		return;
+	}
+	if ((int)_indices.size() < bvh.index_count()) _indices.resize(bvh.index_count());
+	if ((int)_slot_of.size() < bvh.node_count())
+	{
+		_slot_of.resize(bvh.node_count(), -1);
+		_opened_in.resize(bvh.node_count(), -1);
+	}
+
+	// Relinked binary nodes: a node that fills a slot gets that slot (and the
+	// wide node under it) redone; a node opened inside a wide node has that
+	// wide node's slots chosen again. Entries that point at orphaned wide
+	// nodes belong to binary nodes no longer in the tree.
+	const std::vector<int> & relinked = bvh.get_relinked_nodes();
+	for (size_t k = 0; k < relinked.size(); k++)
+	{
+		int id = relinked[k];
+		int ref = _slot_of[id];
+		if (ref >= 0 && _slot_node[ref] == id && _live[ref / WIDE_BVH_WIDTH])
+		{
+			int w = ref / WIDE_BVH_WIDTH;
+			int i = ref % WIDE_BVH_WIDTH;
+			const BVH_Node & c = src[id];
+			set_slot_box(_nodes[w], i, c.box);
+			if (c.is_leaf())
+			{
+				if (_nodes[w].count[i] == 0) orphan(_nodes[w].child[i]);
+				_nodes[w].child[i] = c.left_first;
+				_nodes[w].count[i] = c.count;
+				for (int j = 0; j < c.count; j++) _indices[c.left_first + j] = indices[c.left_first + j];
+			}
+			else if (_nodes[w].count[i] == 0)
+			{
+				collapse_into(bvh, _nodes[w].child[i], id, true);
+			}
+			else
+			{
+				int child = collapse(bvh, id);
+				_nodes[w].child[i] = child;
+				_nodes[w].count[i] = 0;
+			}
+			continue;
+		}
+
+		int w = _opened_in[id];
+		if (w >= 0 && _live[w])
+			collapse_into(bvh, w, _source[w], true);
+	}
+
+	// Refitted boxes and leaf ranges of nodes that kept their place
+	const std::vector<int> & changed = bvh.get_changed_nodes();
+	for (size_t k = 0; k < changed.size(); k++)
+	{
+		int id = changed[k];
+		int ref = _slot_of[id];
+		if (ref < 0 || _slot_node[ref] != id || !_live[ref / WIDE_BVH_WIDTH]) continue;
+
+		int w = ref / WIDE_BVH_WIDTH;
+		int i = ref % WIDE_BVH_WIDTH;
+
+		const BVH_Node & c = src[id];
+		set_slot_box(_nodes[w], i, c.box);
+		if (c.is_leaf())
+		{
+			_nodes[w].child[i] = c.left_first;
+			_nodes[w].count[i] = c.count;
+			for (int j = 0; j < c.count; j++) _indices[c.left_first + j] = indices[c.left_first + j];
+		}
+	}
+}
+
+// Turn a binary node and the levels under it into one new wide node
+int Wide_BVH::collapse(const BVH & bvh, int bvh_node)
+{
+	int node_id = (int)_nodes.size();
+	_nodes.push_back(Wide_BVH_Node());
+	_source.push_back(bvh_node);
+	_live.push_back(1);
+	_slot_node.resize(_nodes.size() * WIDE_BVH_WIDTH, -1);
+	collapse_into(bvh, node_id, bvh_node, false);
+	return node_id;
+}
+
+// Fill a wide node from a binary node: keep opening the interior child with
+// the largest surface area until all slots are used. With reuse, interior
+// slots whose binary node already had a wide child keep that subtree.
+void Wide_BVH::collapse_into(const BVH & bvh, int node_id, int bvh_node, bool reuse)
+{
+	const BVH_Node * src = bvh.node_data();
+	const int * indices = bvh.index_data();
+
+	int old_child[WIDE_BVH_WIDTH];
+	for (int i = 0; i < WIDE_BVH_WIDTH; i++)
+		old_child[i] = reuse && _nodes[node_id].count[i] == 0 ? _nodes[node_id].child[i] : -1;
+
+	int slots[WIDE_BVH_WIDTH];
+	int n = 0;
+	if (src[bvh_node].is_leaf())
+	{
+		slots[n++] = bvh_node;
+	}
+	else
+	{
+		_opened_in[bvh_node] = node_id;
+		slots[n++] = src[bvh_node].left_first;
+		slots[n++] = src[bvh_node].left_first + 1;
+	}
+
+	while (n < WIDE_BVH_WIDTH)
+	{
+		int open = -1;
+		float open_area = -1.0f;
+		for (int i = 0; i < n; i++)
+		{
+			const BVH_Node & c = src[slots[i]];
+			if (!c.is_leaf() && c.box.half_area() > open_area)
+			{
+				open = i;
+				open_area = c.box.half_area();
+			}
+		}
+		if (open < 0) break;
+		int left = src[slots[open]].left_first;
+		_opened_in[slots[open]] = node_id;
+		slots[open] = left;
+		slots[n++] = left + 1;
+	}
+
+	_source[node_id] = bvh_node;
+	for (int i = 0; i < WIDE_BVH_WIDTH; i++)
+	{
+		Wide_BVH_Node & node = _nodes[node_id];
+		if (i >= n)
+		{
+			// Empty slot: a degenerate box at FLT_MAX that no ray can enter
+			node.lo_x[i] = node.lo_y[i] = node.lo_z[i] = FLT_MAX;
+			node.hi_x[i] = node.hi_y[i] = node.hi_z[i] = FLT_MAX;
+			node.child[i] = -1;
+			node.count[i] = -1;
+			_slot_node[node_id * WIDE_BVH_WIDTH + i] = -1;
+			continue;
+		}
+
+		const BVH_Node & c = src[slots[i]];
+		_slot_of[slots[i]] = node_id * WIDE_BVH_WIDTH + i;
+		_slot_node[node_id * WIDE_BVH_WIDTH + i] = slots[i];
+		_opened_in[slots[i]] = -1;
+		set_slot_box(node, i, c.box);
+		if (c.is_leaf())
+		{
+			node.child[i] = c.left_first;
+			node.count[i] = c.count;
+			for (int j = 0; j < c.count; j++) _indices[c.left_first + j] = indices[c.left_first + j];
+			continue;
+		}
+
+		int child = -1;
+		for (int k = 0; k < WIDE_BVH_WIDTH && reuse; k++)
+		{
+			if (old_child[k] >= 0 && _source[old_child[k]] == slots[i])
+			{
+				child = old_child[k];
+				old_child[k] = -1;
+				_opened_in[slots[i]] = child;
+				break;
+			}
+		}
+		if (child < 0) child = collapse(bvh, slots[i]);
+		_nodes[node_id].child[i] = child;
+		_nodes[node_id].count[i] = 0;
+	}
+
+	for (int k = 0; k < WIDE_BVH_WIDTH; k++)
+		if (old_child[k] >= 0) orphan(old_child[k]);
+}
+
+// Mark a wide subtree that is no longer referenced
+void Wide_BVH::orphan(int node_id)
+{
+	if (!_live[node_id]) return;
+	_live[node_id] = 0;
+	_garbage++;
+	const Wide_BVH_Node & node = _nodes[node_id];
+	for (int i = 0; i < WIDE_BVH_WIDTH; i++)
+		if (node.count[i] == 0) orphan(node.child[i]);
+}
+
+void Wide_BVH::set_slot_box(Wide_BVH_Node & node, int i, const Bounding_Box & box)
+{
+	node.lo_x[i] = box.lo[0]; node.lo_y[i] = box.lo[1]; node.lo_z[i] = box.lo[2];
+	node.hi_x[i] = box.hi[0]; node.hi_y[i] = box.hi[1]; node.hi_z[i] = box.hi[2];
+}
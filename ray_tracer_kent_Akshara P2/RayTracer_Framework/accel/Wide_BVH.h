@@ -0,0 +1,424 @@
+#pragma once
+#include "accel_config.h"
+#include "BVH.h"
+#include "Traversal_Stats.h"
+#include "../common/aligned_allocator.h"
+#include "../common/ray_packet.h"
+#if RT_HAVE_SSE
+#include <xmmintrin.h>
+#endif
+#if RT_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+#if RT_BVH_WIDTH == 8
+#define WIDE_BVH_WIDTH 8
+#else
+#define WIDE_BVH_WIDTH 4
+#endif
+
+// Node of the wide BVH. The child boxes are stored as structure-of-arrays so
+// one SIMD slab test covers every child; 4-wide nodes fill two cache lines,
+// 8-wide nodes four.
+struct RT_ALIGN(64) Wide_BVH_Node
+{
+	float	lo_x[WIDE_BVH_WIDTH];
+	float	lo_y[WIDE_BVH_WIDTH];
+	float	lo_z[WIDE_BVH_WIDTH];
+	float	hi_x[WIDE_BVH_WIDTH];
+	float	hi_y[WIDE_BVH_WIDTH];
+	float	hi_z[WIDE_BVH_WIDTH];
+	int		child[WIDE_BVH_WIDTH];	// interior: node index, leaf: first entry in the index list
+	int		count[WIDE_BVH_WIDTH];	// interior: 0, leaf: primitive count, empty slot: -1
+};
+
+// Ray broadcast into SIMD registers once per traversal
+struct Wide_Ray
+{
+#if RT_HAVE_AVX2 && WIDE_BVH_WIDTH == 8
+	__m256	org[3];
+	__m256	inv[3];
+#elif RT_HAVE_SSE && WIDE_BVH_WIDTH == 4
+	__m128	org[3];
+	__m128	inv[3];
+#else
+	float	org[3];
+	float	inv[3];
+#endif
+
+	Wide_Ray(const M3DVector3f start, const M3DVector3f inv_dir)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+#if RT_HAVE_AVX2 && WIDE_BVH_WIDTH == 8
+			org[i] = _mm256_set1_ps(start[i]);
+			inv[i] = _mm256_set1_ps(inv_dir[i]);
+#elif RT_HAVE_SSE && WIDE_BVH_WIDTH == 4
+			org[i] = _mm_set1_ps(start[i]);
+			inv[i] = _mm_set1_ps(inv_dir[i]);
+#else
+			org[i] = start[i];
+			inv[i] = inv_dir[i];
+#endif
+		}
+	}
+};
+
+// Slab test of one ray against all children of a node. Returns a bit mask of
+// the children hit within [0, tmax] and their entry distances in tnear.
+inline int intersect_children(const Wide_BVH_Node & node, const Wide_Ray & ray, float tmax, float * tnear)
+{
+#if RT_HAVE_AVX2 && WIDE_BVH_WIDTH == 8
+	__m256 ax = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.lo_x), ray.org[0]), ray.inv[0]);
+	__m256 bx = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.hi_x), ray.org[0]), ray.inv[0]);
+	__m256 ay = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.lo_y), ray.org[1]), ray.inv[1]);
+	__m256 by = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.hi_y), ray.org[1]), ray.inv[1]);
+	__m256 az = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.lo_z), ray.org[2]), ray.inv[2]);
+	__m256 bz = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.hi_z), ray.org[2]), ray.inv[2]);
+	__m256 t0 = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(ax, bx), _mm256_min_ps(ay, by)),
+							  _mm256_max_ps(_mm256_min_ps(az, bz), _mm256_setzero_ps()));
+	__m256 t1 = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(ax, bx), _mm256_max_ps(ay, by)),
+							  _mm256_min_ps(_mm256_max_ps(az, bz), _mm256_set1_ps(tmax)));
+	_mm256_storeu_ps(tnear, t0);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#elif RT_HAVE_SSE && WIDE_BVH_WIDTH == 4
+	__m128 ax = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.lo_x), ray.org[0]), ray.inv[0]);
+	__m128 bx = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.hi_x), ray.org[0]), ray.inv[0]);
+	__m128 ay = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.lo_y), ray.org[1]), ray.inv[1]);
+	__m128 by = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.hi_y), ray.org[1]), ray.inv[1]);
+	__m128 az = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.lo_z), ray.org[2]), ray.inv[2]);
+	__m128 bz = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.hi_z), ray.org[2]), ray.inv[2]);
+	__m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(ax, bx), _mm_min_ps(ay, by)),
+						   _mm_max_ps(_mm_min_ps(az, bz), _mm_setzero_ps()));
+	__m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(ax, bx), _mm_max_ps(ay, by)),
+						   _mm_min_ps(_mm_max_ps(az, bz), _mm_set1_ps(tmax)));
+	_mm_storeu_ps(tnear, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+	int mask = 0;
+	const float * lo[3] = { node.lo_x, node.lo_y, node.lo_z };
+	const float * hi[3] = { node.hi_x, node.hi_y, node.hi_z };
+	for (int c = 0; c < WIDE_BVH_WIDTH; c++)
+	{
+		float t0 = 0.0f, t1 = tmax;
+		for (int i = 0; i < 3; i++)
+		{
+			float a = (lo[i][c] - ray.org[i]) * ray.inv[i];
+			float b = (hi[i][c] - ray.org[i]) * ray.inv[i];
+			if (a > b) { float tmp = a; a = b; b = tmp; }
+			if (a > t0) t0 = a;
+			if (b < t1) t1 = b;
+		}
+		tnear[c] = t0;
+		if (t0 <= t1) mask |= 1 << c;
+	}
+	return mask;
+#endif
+}
+
+// Slab test of every ray of a packet against child c of a node. Returns the
+// lanes that hit it within [0, tmax[lane]] and the nearest of their entry
+// distances in tnear.
+inline int intersect_child_packet(const Wide_BVH_Node & node, int c, const Packet_Float org[3], const Packet_Float inv[3],
+	const Packet_Float & tmax, float & tnear)
+{
+	Packet_Float ax = (Packet_Float(node.lo_x[c]) - org[0]) * inv[0];
+	Packet_Float bx = (Packet_Float(node.hi_x[c]) - org[0]) * inv[0];
+	Packet_Float ay = (Packet_Float(node.lo_y[c]) - org[1]) * inv[1];
+	Packet_Float by = (Packet_Float(node.hi_y[c]) - org[1]) * inv[1];
+	Packet_Float az = (Packet_Float(node.lo_z[c]) - org[2]) * inv[2];
+	Packet_Float bz = (Packet_Float(node.hi_z[c]) - org[2]) * inv[2];
+	Packet_Float t0 = packet_max(packet_max(packet_min(ax, bx), packet_min(ay, by)), packet_max(packet_min(az, bz), Packet_Float(0.0f)));
+	Packet_Float t1 = packet_min(packet_min(packet_max(ax, bx), packet_max(ay, by)), packet_min(packet_max(az, bz), tmax));
+	int mask = packet_mask(t0 <= t1);
+	if (mask)
+	{
+		float t[RT_PACKET_SIZE];
+		t0.store(t);
+		tnear = FLT_MAX;
+		for (int k = 0; k < RT_PACKET_SIZE; k++)
+			if ((mask & (1 << k)) && t[k] < tnear) tnear = t[k];
+	}
+	return mask;
+}
+
+// BVH with WIDE_BVH_WIDTH children per node, collapsed from a binary SAH BVH.
+// Traversal has the same Leaf_Test contract as BVH::closest_hit.
+class Wide_BVH
+{
+public:
+	Wide_BVH() : _garbage(0), _mapped_nodes(NULL), _mapped_indices(NULL), _mapped_node_count(0), _mapped_index_count(0) {}
+	~Wide_BVH() {}
+
+	void build(const BVH & bvh);
+	void clear();
+
+	// Follow the changes recorded by the binary tree since its last
+	// clear_changes(): wide nodes holding relinked binary nodes are collapsed
+	// again in place (untouched child subtrees are kept), then refitted boxes
+	// and leaf ranges are copied into their slots. Not valid after
+	// bvh.was_rebuilt() or on a mapped tree; call build() then.
+	void update(const BVH & bvh);
+
+	// Traverse nodes and indices that live elsewhere (a mapped cache file);
+	// nodes must be 64-byte aligned and outlive the tree or the next clear()/build()
+	void map(const Wide_BVH_Node * nodes, int node_count, const int * indices, int index_count);
+	inline bool is_mapped() const { return _mapped_nodes != NULL; }
+
+	// Fraction of wide nodes orphaned by update()
+	inline float garbage_ratio() const { return _nodes.empty() ? 0.0f : (float)_garbage / (float)_nodes.size(); }
+
+	inline bool empty() const { return node_count() == 0; }
+	inline const Wide_BVH_Node * node_data() const { return _mapped_nodes ? _mapped_nodes : (_nodes.empty() ? NULL : &_nodes[0]); }
+	inline int node_count() const { return _mapped_nodes ? _mapped_node_count : (int)_nodes.size(); }
+	inline const int * index_data() const { return _mapped_nodes ? _mapped_indices : (_indices.empty() ? NULL : &_indices[0]); }
+	inline int index_count() const { return _mapped_nodes ? _mapped_index_count : (int)_indices.size(); }
+
+	template <class Leaf_Test>
+	bool closest_hit(const M3DVector3f start, const M3DVector3f dir, float & tmax, Leaf_Test & test) const
+	{
+		if (node_count() == 0) return false;
+		const Wide_BVH_Node * nodes = node_data();
+		const int * indices = index_data();
+
+		M3DVector3f inv_dir;
+		inverse_direction(inv_dir, dir);
+		Wide_Ray ray(start, inv_dir);
+
+		// Stack entries are node indices, or ~(node * width + slot) for leaf slots
+		int stack[256];
+		float stack_t[256];
+		int top = 0;
+		stack[top] = 0; stack_t[top++] = 0.0f;
+
+		bool hit = false;
+		float tnear[WIDE_BVH_WIDTH];
+		while (top > 0)
+		{
+			--top;
+			if (stack_t[top] > tmax) continue;
+			int ref = stack[top];
+			if (ref < 0)
+			{
+				const Wide_BVH_Node & leaf = nodes[(~ref) / WIDE_BVH_WIDTH];
+				int slot = (~ref) % WIDE_BVH_WIDTH;
+				const int * ids = &indices[leaf.child[slot]];
+				RT_COUNT_PRIMS(leaf.count[slot]);
+				for (int i = 0; i < leaf.count[slot]; i++)
+					if (test(ids[i], tmax)) hit = true;
+				continue;
+			}
+
+			const Wide_BVH_Node & node = nodes[ref];
+			RT_COUNT_NODE(node);
+			int mask = intersect_children(node, ray, tmax, tnear);
+			if (mask == 0) continue;
+
+			// Sort the hit children far to near, then push so the nearest pops first
+			int order[WIDE_BVH_WIDTH];
+			int n = 0;
+			for (int c = 0; c < WIDE_BVH_WIDTH; c++)
+			{
+				if (!(mask & (1 << c))) continue;
+				int k = n++;
+				while (k > 0 && tnear[order[k - 1]] < tnear[c]) { order[k] = order[k - 1]; k--; }
+				order[k] = c;
+			}
+			for (int k = 0; k < n; k++)
+			{
+				int c = order[k];
+				stack[top] = node.count[c] > 0 ? ~(ref * WIDE_BVH_WIDTH + c) : node.child[c];
+				stack_t[top++] = tnear[c];
+			}
+		}
+		return hit;
+	}
+
+	// Any hit: stops at the first blocker test(prim_index) reports
+	template <class Leaf_Test>
+	bool any_hit(const M3DVector3f start, const M3DVector3f dir, float tmax, Leaf_Test & test) const
+	{
+		if (node_count() == 0) return false;
+		const Wide_BVH_Node * nodes = node_data();
+		const int * indices = index_data();
+
+		M3DVector3f inv_dir;
+		inverse_direction(inv_dir, dir);
+		Wide_Ray ray(start, inv_dir);
+
+		int stack[256];
+		int top = 0;
+		stack[top++] = 0;
+
+		float tnear[WIDE_BVH_WIDTH];
+		while (top > 0)
+		{
+			const Wide_BVH_Node & node = nodes[stack[--top]];
+			RT_COUNT_NODE(node);
+			int mask = intersect_children(node, ray, tmax, tnear);
+			for (int c = 0; mask != 0; c++, mask >>= 1)
+			{
+				if (!(mask & 1)) continue;
+				if (node.count[c] > 0)
+				{
+					const int * ids = &indices[node.child[c]];
+					for (int i = 0; i < node.count[c]; i++)
+					{
+						RT_COUNT_PRIMS(1);
+						if (test(ids[i])) return true;
+					}
+				}
+				else
+				{
+					stack[top++] = node.child[c];
+				}
+			}
+		}
+		return false;
+	}
+
+	// Packet traversal for coherent rays: each child box is tested against
+	// all rays of the packet at once and a subtree is entered with the lanes
+	// that hit its box. test(prim_index, lanes) tests a primitive on those
+	// lanes and shrinks their tmax entries on a closer hit.
+	template <class Leaf_Test>
+	void closest_hit_packet(const Ray_Packet & packet, float * tmax, Leaf_Test & test) const
+	{
+		if (node_count() == 0 || packet.active == 0) return;
+		const Wide_BVH_Node * nodes = node_data();
+		const int * indices = index_data();
+
+		Packet_Float org[3], inv[3];
+		for (int i = 0; i < 3; i++)
+		{
+			org[i] = Packet_Float::load(packet.org[i]);
+			inv[i] = Packet_Float::load(packet.inv[i]);
+		}
+
+		// Same entries as closest_hit, plus the lanes that entered each one
+		int stack[256];
+		int stack_lanes[256];
+		float stack_t[256];
+		int top = 0;
+		stack[top] = 0; stack_lanes[top] = packet.active; stack_t[top++] = 0.0f;
+
+		while (top > 0)
+		{
+			--top;
+			Packet_Float t_max = Packet_Float::load(tmax);
+			int lanes = stack_lanes[top] & packet_mask(Packet_Float(stack_t[top]) <= t_max);
+			if (lanes == 0) continue;
+			int ref = stack[top];
+			if (ref < 0)
+			{
+				const Wide_BVH_Node & leaf = nodes[(~ref) / WIDE_BVH_WIDTH];
+				int slot = (~ref) % WIDE_BVH_WIDTH;
+				const int * ids = &indices[leaf.child[slot]];
+				RT_COUNT_PRIMS(leaf.count[slot]);
+				for (int i = 0; i < leaf.count[slot]; i++)
+					test(ids[i], lanes);
+				continue;
+			}
+
+			const Wide_BVH_Node & node = nodes[ref];
+			RT_COUNT_NODE(node);
+			int order[WIDE_BVH_WIDTH], child_lanes[WIDE_BVH_WIDTH];
+			float tnear[WIDE_BVH_WIDTH];
+			int n = 0;
+			for (int c = 0; c < WIDE_BVH_WIDTH; c++)
+			{
+				if (node.count[c] < 0) continue;
+				child_lanes[c] = lanes & intersect_child_packet(node, c, org, inv, t_max, tnear[c]);
+				if (child_lanes[c] == 0) continue;
+				int k = n++;
+				while (k > 0 && tnear[order[k - 1]] < tnear[c]) { order[k] = order[k - 1]; k--; }
+				order[k] = c;
+			}
+			for (int k = 0; k < n; k++)
+			{
+				int c = order[k];
+				stack[top] = node.count[c] > 0 ? ~(ref * WIDE_BVH_WIDTH + c) : node.child[c];
+				stack_lanes[top] = child_lanes[c];
+				stack_t[top++] = tnear[c];
+			}
+		}
+	}
+
+	// Any hit for a packet: test(prim_index, lanes) returns the lanes the
+	// primitive blocks; returns every blocked lane of packet.active
+	template <class Leaf_Test>
+	int any_hit_packet(const Ray_Packet & packet, const float * tmax, Leaf_Test & test) const
+	{
+		if (node_count() == 0 || packet.active == 0) return 0;
+		const Wide_BVH_Node * nodes = node_data();
+		const int * indices = index_data();
+
+		Packet_Float org[3], inv[3];
+		for (int i = 0; i < 3; i++)
+		{
+			org[i] = Packet_Float::load(packet.org[i]);
+			inv[i] = Packet_Float::load(packet.inv[i]);
+		}
+		Packet_Float t_max = Packet_Float::load(tmax);
+
+		int stack[256];
+		int stack_lanes[256];
+		int top = 0;
+		stack[top] = 0; stack_lanes[top++] = packet.active;
+
+		int open = packet.active;
+		while (top > 0 && open != 0)
+		{
+			--top;
+			int lanes = stack_lanes[top] & open;
+			if (lanes == 0) continue;
+			const Wide_BVH_Node & node = nodes[stack[top]];
+			RT_COUNT_NODE(node);
+			for (int c = 0; c < WIDE_BVH_WIDTH && lanes != 0; c++)
+			{
+				if (node.count[c] < 0) continue;
+				float tnear;
+				int hit = lanes & intersect_child_packet(node, c, org, inv, t_max, tnear);
+				if (hit == 0) continue;
+				if (node.count[c] > 0)
+				{
+					const int * ids = &indices[node.child[c]];
+					for (int i = 0; i < node.count[c] && hit != 0; i++)
+					{
+						RT_COUNT_PRIMS(1);
+						int blocked = test(ids[i], hit);
+						hit &= ~blocked;
+						open &= ~blocked;
+					}
+					lanes &= open;
+				}
+				else
+				{
+					stack[top] = node.child[c];
+					stack_lanes[top++] = hit;
+				}
+			}
+		}
+		return packet.active & ~open;
+	}
+
+private:
+	int		collapse(const BVH & bvh, int bvh_node);
+	void	collapse_into(const BVH & bvh, int node_id, int bvh_node, bool reuse);
+	void	orphan(int node_id);
+	void	set_slot_box(Wide_BVH_Node & node, int i, const Bounding_Box & box);
+
+private:
+	std::vector<Wide_BVH_Node, Aligned_Allocator<Wide_BVH_Node, 64> >	_nodes;
+	std::vector<int>	_indices;
+	std::vector<int>	_source;	// per wide node: the binary node it was collapsed from
+	std::vector<char>	_live;		// per wide node: still reachable from the root
+	std::vector<int>	_slot_node;	// per wide slot: binary node it mirrors, or -1
+	std::vector<int>	_slot_of;	// per binary node: wide node * width + slot, or -1
+	std::vector<int>	_opened_in;	// per binary node: wide node whose slots replaced its children, or -1
+	int					_garbage;
+	const Wide_BVH_Node *	_mapped_nodes;
+	const int *			_mapped_indices;
+	int					_mapped_node_count;
+	int					_mapped_index_count;
+};
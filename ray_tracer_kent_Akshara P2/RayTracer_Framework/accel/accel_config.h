@@ -0,0 +1,42 @@
+#pragma once
+
+// Branching factor of the BVH that Scene traverses:
+//   2 - binary BVH (accel/BVH.h)
+//   4 - 4-wide nodes, one SSE slab test per node
+//   8 - 8-wide nodes, one AVX2 slab test per node
+// Override from the project settings, e.g. /D RT_BVH_WIDTH=8 together with /arch:AVX2.
+#ifndef RT_BVH_WIDTH
+#define RT_BVH_WIDTH 4
+#endif
+
+#if RT_BVH_WIDTH != 2 && RT_BVH_WIDTH != 4 && RT_BVH_WIDTH != 8
+#error RT_BVH_WIDTH must be 2, 4 or 8
+#endif
+
+// Accelerator Scene starts with; Scene::set_accel() switches at run time:
+//   0 - BVH of the width above
+//   1 - two-level uniform grid (accel/Grid.h), for evenly spread similar-sized primitives
+#ifndef RT_DEFAULT_ACCEL
+#define RT_DEFAULT_ACCEL 0
+#endif
+
+// 1 - count node fetches and primitive tests of the wide BVH traversals per
+// thread (accel/Traversal_Stats.h), for the ray sorting benchmark. Off by
+// default, the counting itself costs time.
+#ifndef RT_TRAVERSAL_STATS
+#define RT_TRAVERSAL_STATS 0
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define RT_HAVE_SSE 1
+#endif
+
+#if defined(__AVX2__)
+#define RT_HAVE_AVX2 1
+#endif
+
+#if defined(_MSC_VER)
+#define RT_ALIGN(n) __declspec(align(n))
+#else
+#define RT_ALIGN(n) __attribute__((aligned(n)))
+#endif
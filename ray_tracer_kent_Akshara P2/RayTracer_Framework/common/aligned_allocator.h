@@ -0,0 +1,59 @@
+#pragma once
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+// Allocate/free memory on an 'align' byte boundary (align must be a power of two)
+inline void * aligned_malloc(size_t size, size_t align)
+{
+#if defined(_MSC_VER)
+	return _aligned_malloc(size, align);
+#else
+	void * p = NULL;
+	if (posix_memalign(&p, align < sizeof(void *) ? sizeof(void *) : align, size) != 0) return NULL;
+	return p;
+#endif
+}
+
+inline void aligned_free(void * p)
+{
+#if defined(_MSC_VER)
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+// std::vector allocator that places the storage on an Align byte boundary,
+// e.g. std::vector<Node, Aligned_Allocator<Node, 64> > for cache-line nodes.
+template <class T, size_t Align>
+class Aligned_Allocator
+{
+public:
+	typedef T			value_type;
+	typedef T *			pointer;
+	typedef const T *	const_pointer;
+	typedef T &			reference;
+	typedef const T &	const_reference;
+	typedef size_t		size_type;
+	typedef ptrdiff_t	difference_type;
+
+	template <class U> struct rebind { typedef Aligned_Allocator<U, Align> other; };
+
+	Aligned_Allocator() {}
+	template <class U> Aligned_Allocator(const Aligned_Allocator<U, Align> &) {}
+
+	T * allocate(size_t n)
+	{
+		void * p = aligned_malloc(n * sizeof(T), Align);
+		if (p == NULL) throw std::bad_alloc();
+		return (T *)p;
+	}
+	void deallocate(T * p, size_t) { aligned_free(p); }
+
+	bool operator==(const Aligned_Allocator &) const { return true; }
+	bool operator!=(const Aligned_Allocator &) const { return false; }
+};
@@ -0,0 +1,56 @@
+#include "arena.h"
+#include "aligned_allocator.h"
+#include <algorithm>
+#include <functional>
+
+Arena::Arena()
+	: _used(0)
+	, _next_block(k_first_block)
+	, _reserved(0)
+{
+}
+
+void * Arena::allocate(size_t size, size_t align)
+{
+	size_t offset = (_used + align - 1) & ~(align - 1);
+	if (_blocks.empty() || offset + size > _blocks.back().size)
+	{
+		// A new block; what is left of the old one stays unused
+		Block block;
+		block.size = size > _next_block ? size : _next_block;
+		block.data = (char *)aligned_malloc(block.size, k_block_align);
+		if (block.data == NULL) throw std::bad_alloc();
+		_blocks.push_back(block);
+		std::vector<Block>::iterator at = std::upper_bound(_by_address.begin(), _by_address.end(), block,
+			[](const Block & a, const Block & b) { return std::less<const char *>()(a.data, b.data); });
+		_by_address.insert(at, block);
+		_reserved += block.size;
+		if (_next_block < k_max_block) _next_block *= 2;
+		offset = 0;
+	}
+	_used = offset + size;
+	return _blocks.back().data + offset;
+}
+
+bool Arena::owns(const void * p) const
+{
+	// The last block starting at or before p is the only one that can hold it
+	const char * c = (const char *)p;
+	std::less<const char *> before;
+	std::vector<Block>::const_iterator b = std::upper_bound(_by_address.begin(), _by_address.end(), c,
+		[&](const char * q, const Block & block) { return before(q, block.data); });
+	if (b == _by_address.begin()) return false;
+	--b;
+	return before(c, b->data + b->size);
+}
+
+void Arena::release()
+{
+	for (size_t b = 0; b < _blocks.size(); ++b)
+		aligned_free(_blocks[b].data);
+	_blocks.clear();
+	_by_address.clear();
+	_used = 0;
+	_next_block = k_first_block;
+	_reserved = 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Monotonic allocator: hands out memory from a few large blocks in order and
+// gives it all back at once in release(). Objects made with create() one
+// after the other sit next to each other in memory, in creation order.
+//
+// The arena never runs destructors; whoever creates an object that owns
+// memory of its own calls its destructor before release(). Not thread safe.
+class Arena
+{
+public:
+	Arena();
+	~Arena() { release(); }
+
+	// size bytes on an 'align' byte boundary (a power of two, at most 64)
+	void *	allocate(size_t size, size_t align);
+
+	template <class T, class... Args> inline T * create(Args &&... args)
+	{
+		return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+
+	// True if p was handed out by this arena since the last release();
+	// a binary search over the blocks
+	bool	owns(const void * p) const;
+
+	// Frees every block in one step
+	void	release();
+
+	inline size_t reserved_bytes() const { return _reserved; }
+
+private:
+	Arena(const Arena &);
+	Arena & operator=(const Arena &);
+
+private:
+	static const size_t k_first_block = 16 << 10;
+	static const size_t k_max_block = 1 << 20;		// blocks double up to this
+	static const size_t k_block_align = 64;
+
+	struct Block
+	{
+		char *	data;
+		size_t	size;
+	};
+
+	std::vector<Block>	_blocks;
+	std::vector<Block>	_by_address;	// _blocks sorted by data, for owns()
+	size_t				_used;			// bytes taken from the last block
+	size_t				_next_block;
+	size_t				_reserved;
+};
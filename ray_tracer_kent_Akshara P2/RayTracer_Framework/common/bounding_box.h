@@ -0,0 +1,102 @@
+#pragma once
+#include "math3d.h"
+#include <float.h>
+
+// Axis-aligned bounding box used by the acceleration structures.
+struct Bounding_Box
+{
+	M3DVector3f	lo;
+	M3DVector3f	hi;
+
+	Bounding_Box() { reset(); }
+
+	inline void reset()
+	{
+		lo[0] = lo[1] = lo[2] = FLT_MAX;
+		hi[0] = hi[1] = hi[2] = -FLT_MAX;
+	}
+
+	inline bool is_empty() const { return lo[0] > hi[0]; }
+
+	inline void extend(const M3DVector3f p)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			if (p[i] < lo[i]) lo[i] = p[i];
+			if (p[i] > hi[i]) hi[i] = p[i];
+		}
+	}
+
+	inline void extend(const Bounding_Box & box)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			if (box.lo[i] < lo[i]) lo[i] = box.lo[i];
+			if (box.hi[i] > hi[i]) hi[i] = box.hi[i];
+		}
+	}
+
+	inline void centroid(M3DVector3f c) const
+	{
+		for (int i = 0; i < 3; i++) c[i] = 0.5f * (lo[i] + hi[i]);
+	}
+
+	// Half surface area, which is all the SAH needs
+	inline float half_area() const
+	{
+		if (is_empty()) return 0.0f;
+		float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+		return dx * dy + dy * dz + dz * dx;
+	}
+
+	// Grow by a small relative margin so rays grazing a face (a sphere's pole,
+	// a wall lying in the box plane) are not lost to rounding in the slab test
+	inline void pad()
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			float eps = 1e-5f * (fabs(lo[i]) + fabs(hi[i])) + 1e-6f;
+			lo[i] -= eps;
+			hi[i] += eps;
+		}
+	}
+
+	// Slab test; inv_dir is the component-wise reciprocal of the ray direction
+	inline bool intersect(const M3DVector3f start, const M3DVector3f inv_dir, float tmax, float & tnear) const
+	{
+		float t0 = 0.0f, t1 = tmax;
+		for (int i = 0; i < 3; i++)
+		{
+			float a = (lo[i] - start[i]) * inv_dir[i];
+			float b = (hi[i] - start[i]) * inv_dir[i];
+			if (a > b) { float tmp = a; a = b; b = tmp; }
+			if (a > t0) t0 = a;
+			if (b < t1) t1 = b;
+			if (t0 > t1) return false;
+		}
+		tnear = t0;
+		return true;
+	}
+
+	// Clip the ray interval [t0, t1] to the box; false if nothing is left
+	inline bool clip(const M3DVector3f start, const M3DVector3f inv_dir, float & t0, float & t1) const
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			float a = (lo[i] - start[i]) * inv_dir[i];
+			float b = (hi[i] - start[i]) * inv_dir[i];
+			if (a > b) { float tmp = a; a = b; b = tmp; }
+			if (a > t0) t0 = a;
+			if (b < t1) t1 = b;
+			if (t0 > t1) return false;
+		}
+		return true;
+	}
+};
+
+// Reciprocal direction for slab tests, keeping zero components finite
+inline void inverse_direction(M3DVector3f inv_dir, const M3DVector3f dir)
+{
+	for (int i = 0; i < 3; i++)
+		inv_dir[i] = 1.0f / (fabs(dir[i]) > 1e-20f ? dir[i] : (dir[i] < 0.0f ? -1e-20f : 1e-20f));
+}
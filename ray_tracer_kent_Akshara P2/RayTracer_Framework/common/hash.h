@@ -0,0 +1,13 @@
+#pragma once
+#include <stddef.h>
+
+static const unsigned long long k_fnv_offset = 14695981039346656037ULL;
+
+// 64-bit FNV-1a of 'bytes' bytes; pass the previous result as h to hash
+// several pieces as one
+inline unsigned long long fnv1a(const void * data, size_t bytes, unsigned long long h = k_fnv_offset)
+{
+	const unsigned char * p = (const unsigned char *)data;
+	for (size_t i = 0; i < bytes; i++) h = (h ^ p[i]) * 1099511628211ULL;
+	return h;
+}
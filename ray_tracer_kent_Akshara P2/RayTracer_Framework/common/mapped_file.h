@@ -0,0 +1,31 @@
+#pragma once
+#include <stddef.h>
+
+// Read-only memory mapping of a whole file (mmap / MapViewOfFile). The view
+// starts on a page boundary, so data laid out with 64-byte aligned offsets
+// can be used in place.
+class Mapped_File
+{
+public:
+	Mapped_File();
+	~Mapped_File() { close(); }
+
+	bool	open(const char * path);
+	void	close();
+
+	inline bool is_open() const { return _data != NULL; }
+	inline const unsigned char * data() const { return _data; }
+	inline size_t size() const { return _size; }
+
+private:
+	Mapped_File(const Mapped_File &);
+	Mapped_File & operator=(const Mapped_File &);
+
+private:
+	const unsigned char *	_data;
+	size_t					_size;
+#if defined(_WIN32)
+	void *					_file;
+	void *					_mapping;
+#endif
+};
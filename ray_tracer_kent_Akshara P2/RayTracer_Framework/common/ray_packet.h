@@ -0,0 +1,191 @@
+#pragma once
+#include "math3d.h"
+#include "bounding_box.h"
+#include "../accel/accel_config.h"
+#if RT_HAVE_SSE
+#include <xmmintrin.h>
+#endif
+#if RT_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+// Rays per packet: one AVX register with AVX2, otherwise one SSE register
+// (or four scalar lanes without SSE)
+#if RT_HAVE_AVX2
+#define RT_PACKET_SIZE 8
+#else
+#define RT_PACKET_SIZE 4
+#endif
+
+// One float per ray of a packet. Comparisons return a lane mask in the same
+// type; packet_mask() turns it into bits. The operations are plain IEEE
+// single precision, so a packet kernel written in the same order as its
+// scalar twin gives the same bits.
+struct Packet_Float
+{
+#if RT_HAVE_AVX2
+	__m256	v;
+	Packet_Float() {}
+	Packet_Float(__m256 x) : v(x) {}
+	explicit Packet_Float(float x) : v(_mm256_set1_ps(x)) {}
+	static inline Packet_Float load(const float * p) { return Packet_Float(_mm256_loadu_ps(p)); }
+	inline void store(float * p) const { _mm256_storeu_ps(p, v); }
+#elif RT_HAVE_SSE
+	__m128	v;
+	Packet_Float() {}
+	Packet_Float(__m128 x) : v(x) {}
+	explicit Packet_Float(float x) : v(_mm_set1_ps(x)) {}
+	static inline Packet_Float load(const float * p) { return Packet_Float(_mm_loadu_ps(p)); }
+	inline void store(float * p) const { _mm_storeu_ps(p, v); }
+#else
+	float	v[RT_PACKET_SIZE];
+	Packet_Float() {}
+	explicit Packet_Float(float x) { for (int k = 0; k < RT_PACKET_SIZE; k++) v[k] = x; }
+	static inline Packet_Float load(const float * p) { Packet_Float r; for (int k = 0; k < RT_PACKET_SIZE; k++) r.v[k] = p[k]; return r; }
+	inline void store(float * p) const { for (int k = 0; k < RT_PACKET_SIZE; k++) p[k] = v[k]; }
+#endif
+};
+
+#if RT_HAVE_AVX2
+inline Packet_Float operator+(const Packet_Float & a, const Packet_Float & b) { return _mm256_add_ps(a.v, b.v); }
+inline Packet_Float operator-(const Packet_Float & a, const Packet_Float & b) { return _mm256_sub_ps(a.v, b.v); }
+inline Packet_Float operator*(const Packet_Float & a, const Packet_Float & b) { return _mm256_mul_ps(a.v, b.v); }
+inline Packet_Float operator/(const Packet_Float & a, const Packet_Float & b) { return _mm256_div_ps(a.v, b.v); }
+inline Packet_Float operator<(const Packet_Float & a, const Packet_Float & b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline Packet_Float operator<=(const Packet_Float & a, const Packet_Float & b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline Packet_Float operator>(const Packet_Float & a, const Packet_Float & b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline Packet_Float operator>=(const Packet_Float & a, const Packet_Float & b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline Packet_Float operator&(const Packet_Float & a, const Packet_Float & b) { return _mm256_and_ps(a.v, b.v); }
+inline Packet_Float operator|(const Packet_Float & a, const Packet_Float & b) { return _mm256_or_ps(a.v, b.v); }
+inline Packet_Float packet_min(const Packet_Float & a, const Packet_Float & b) { return _mm256_min_ps(a.v, b.v); }
+inline Packet_Float packet_max(const Packet_Float & a, const Packet_Float & b) { return _mm256_max_ps(a.v, b.v); }
+inline Packet_Float packet_sqrt(const Packet_Float & a) { return _mm256_sqrt_ps(a.v); }
+inline Packet_Float packet_abs(const Packet_Float & a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline Packet_Float packet_select(const Packet_Float & mask, const Packet_Float & a, const Packet_Float & b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+inline int packet_mask(const Packet_Float & m) { return _mm256_movemask_ps(m.v); }
+#elif RT_HAVE_SSE
+inline Packet_Float operator+(const Packet_Float & a, const Packet_Float & b) { return _mm_add_ps(a.v, b.v); }
+inline Packet_Float operator-(const Packet_Float & a, const Packet_Float & b) { return _mm_sub_ps(a.v, b.v); }
+inline Packet_Float operator*(const Packet_Float & a, const Packet_Float & b) { return _mm_mul_ps(a.v, b.v); }
+inline Packet_Float operator/(const Packet_Float & a, const Packet_Float & b) { return _mm_div_ps(a.v, b.v); }
+inline Packet_Float operator<(const Packet_Float & a, const Packet_Float & b) { return _mm_cmplt_ps(a.v, b.v); }
+inline Packet_Float operator<=(const Packet_Float & a, const Packet_Float & b) { return _mm_cmple_ps(a.v, b.v); }
+inline Packet_Float operator>(const Packet_Float & a, const Packet_Float & b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline Packet_Float operator>=(const Packet_Float & a, const Packet_Float & b) { return _mm_cmpge_ps(a.v, b.v); }
+inline Packet_Float operator&(const Packet_Float & a, const Packet_Float & b) { return _mm_and_ps(a.v, b.v); }
+inline Packet_Float operator|(const Packet_Float & a, const Packet_Float & b) { return _mm_or_ps(a.v, b.v); }
+inline Packet_Float packet_min(const Packet_Float & a, const Packet_Float & b) { return _mm_min_ps(a.v, b.v); }
+inline Packet_Float packet_max(const Packet_Float & a, const Packet_Float & b) { return _mm_max_ps(a.v, b.v); }
+inline Packet_Float packet_sqrt(const Packet_Float & a) { return _mm_sqrt_ps(a.v); }
+inline Packet_Float packet_abs(const Packet_Float & a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline Packet_Float packet_select(const Packet_Float & mask, const Packet_Float & a, const Packet_Float & b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+inline int packet_mask(const Packet_Float & m) { return _mm_movemask_ps(m.v); }
+#else
+// Masks are 1.0f / 0.0f per lane in the scalar fallback
+#define RT_PACKET_LANEWISE(expr) Packet_Float r; for (int k = 0; k < RT_PACKET_SIZE; k++) r.v[k] = (expr); return r;
+inline Packet_Float operator+(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] + b.v[k]) }
+inline Packet_Float operator-(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] - b.v[k]) }
+inline Packet_Float operator*(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] * b.v[k]) }
+inline Packet_Float operator/(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] / b.v[k]) }
+inline Packet_Float operator<(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] < b.v[k] ? 1.0f : 0.0f) }
+inline Packet_Float operator<=(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] <= b.v[k] ? 1.0f : 0.0f) }
+inline Packet_Float operator>(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] > b.v[k] ? 1.0f : 0.0f) }
+inline Packet_Float operator>=(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] >= b.v[k] ? 1.0f : 0.0f) }
+inline Packet_Float operator&(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] != 0.0f && b.v[k] != 0.0f ? 1.0f : 0.0f) }
+inline Packet_Float operator|(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] != 0.0f || b.v[k] != 0.0f ? 1.0f : 0.0f) }
+inline Packet_Float packet_min(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] < b.v[k] ? a.v[k] : b.v[k]) }
+inline Packet_Float packet_max(const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(a.v[k] > b.v[k] ? a.v[k] : b.v[k]) }
+inline Packet_Float packet_sqrt(const Packet_Float & a) { RT_PACKET_LANEWISE(sqrtf(a.v[k])) }
+inline Packet_Float packet_abs(const Packet_Float & a) { RT_PACKET_LANEWISE(fabsf(a.v[k])) }
+inline Packet_Float packet_select(const Packet_Float & mask, const Packet_Float & a, const Packet_Float & b) { RT_PACKET_LANEWISE(mask.v[k] != 0.0f ? a.v[k] : b.v[k]) }
+inline int packet_mask(const Packet_Float & m) { int r = 0; for (int k = 0; k < RT_PACKET_SIZE; k++) if (m.v[k] != 0.0f) r |= 1 << k; return r; }
+#undef RT_PACKET_LANEWISE
+#endif
+
+inline Packet_Float packet_dot(const Packet_Float a[3], const Packet_Float b[3])
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// Same component order as m3dCrossProduct
+inline void packet_cross(Packet_Float r[3], const Packet_Float u[3], const Packet_Float v[3])
+{
+	r[0] = u[1] * v[2] - v[1] * u[2];
+	r[1] = v[0] * u[2] - u[0] * v[2];
+	r[2] = u[0] * v[1] - v[0] * u[1];
+}
+
+// Bundle of RT_PACKET_SIZE rays in structure-of-arrays form. Only the lanes
+// set in 'active' carry rays; finish() fills the others with a copy of an
+// active ray so kernels can run on every lane and mask the result.
+struct RT_ALIGN(32) Ray_Packet
+{
+	enum { k_all = (1 << RT_PACKET_SIZE) - 1 };
+
+	float	org[3][RT_PACKET_SIZE];
+	float	dir[3][RT_PACKET_SIZE];
+	float	inv[3][RT_PACKET_SIZE];		// component-wise reciprocal of dir, for slab tests
+	int		active;
+
+	Ray_Packet() : active(0) {}
+
+	inline void set(int lane, const M3DVector3f start, const M3DVector3f direction)
+	{
+		for (int i = 0; i < 3; i++) { org[i][lane] = start[i]; dir[i][lane] = direction[i]; }
+		active |= 1 << lane;
+	}
+
+	inline void get(int lane, M3DVector3f start, M3DVector3f direction) const
+	{
+		for (int i = 0; i < 3; i++) { start[i] = org[i][lane]; direction[i] = dir[i][lane]; }
+	}
+
+	inline void load_origin(Packet_Float o[3]) const { for (int i = 0; i < 3; i++) o[i] = Packet_Float::load(org[i]); }
+	inline void load_direction(Packet_Float d[3]) const { for (int i = 0; i < 3; i++) d[i] = Packet_Float::load(dir[i]); }
+
+	// Normalize every direction like m3dNormalizeVector
+	inline void normalize()
+	{
+		Packet_Float d[3];
+		load_direction(d);
+		Packet_Float scale = Packet_Float(1.0f) / packet_sqrt(packet_dot(d, d));
+		for (int i = 0; i < 3; i++) (d[i] * scale).store(dir[i]);
+	}
+
+	// Fill the inactive lanes and compute the reciprocal directions
+	inline void finish()
+	{
+		int first = 0;
+		while (first < RT_PACKET_SIZE && !(active & (1 << first))) first++;
+		for (int k = 0; k < RT_PACKET_SIZE; k++)
+		{
+			if (first < RT_PACKET_SIZE && !(active & (1 << k)))
+				for (int i = 0; i < 3; i++) { org[i][k] = org[i][first]; dir[i][k] = dir[i][first]; }
+			M3DVector3f d = { dir[0][k], dir[1][k], dir[2][k] }, r;
+			inverse_direction(r, d);
+			for (int i = 0; i < 3; i++) inv[i][k] = r[i];
+		}
+	}
+
+	// True when every active ray points into the same octant, so a box the
+	// packet enters is entered front to back by all of them alike
+	inline bool coherent() const
+	{
+		int signs = -1;
+		for (int k = 0; k < RT_PACKET_SIZE; k++)
+		{
+			if (!(active & (1 << k))) continue;
+			int s = (dir[0][k] < 0.0f ? 1 : 0) | (dir[1][k] < 0.0f ? 2 : 0) | (dir[2][k] < 0.0f ? 4 : 0);
+			if (signs >= 0 && s != signs) return false;
+			signs = s;
+		}
+		return true;
+	}
+};
+
+inline int lane_count(int mask)
+{
+	int n = 0;
+	for (; mask != 0; mask &= mask - 1) n++;
+	return n;
+}
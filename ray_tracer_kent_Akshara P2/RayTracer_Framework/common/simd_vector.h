@@ -0,0 +1,190 @@
+#pragma once
+#include "math3d.h"
+#include "../accel/accel_config.h"
+#if RT_HAVE_SSE
+#include <xmmintrin.h>
+#endif
+
+// 1 - vec_normalize() scales by the SSE reciprocal square root estimate
+// refined with one Newton-Raphson step instead of a square root and a
+// divide. A couple of ulps off m3dNormalizeVector, so the image changes in
+// the last bits; off by default.
+#ifndef RT_FAST_NORMALIZE
+#define RT_FAST_NORMALIZE 0
+#endif
+
+// A 3 or 4 float vector held in one SSE register (four scalar lanes without
+// SSE). Vec3 leaves the fourth lane out of every result that matters; it
+// starts at 0, so filling x, y, z through a pointer never leaves a stray
+// denormal or NaN there. Both convert to float *, so they go wherever an
+// M3DVector3f / M3DVector4f does (any m3d function, v[i]); Vec3(p) loads one.
+//
+// The operators and vec_* functions compute in the same order as their m3d
+// twins, so code moved onto them keeps its results bit for bit; only
+// vec_normalize_fast (and vec_normalize with RT_FAST_NORMALIZE) does not.
+template <int N>
+struct RT_ALIGN(16) Simd_Vector
+{
+#if RT_HAVE_SSE
+	union
+	{
+		__m128	v;
+		float	f[4];
+	};
+	Simd_Vector() : v(_mm_setzero_ps()) {}
+	Simd_Vector(__m128 x) : v(x) {}
+	Simd_Vector(float x, float y, float z, float w = 0.0f) : v(_mm_setr_ps(x, y, z, N == 4 ? w : 0.0f)) {}
+	explicit Simd_Vector(const float * p) : v(N == 4 ? _mm_loadu_ps(p) : _mm_setr_ps(p[0], p[1], p[2], 0.0f)) {}
+	static inline Simd_Vector splat(float x) { return Simd_Vector(_mm_set1_ps(x)); }
+	inline void store(float * p) const
+	{
+		if (N == 4) { _mm_storeu_ps(p, v); return; }
+		_mm_storel_pi((__m64 *)p, v);
+		_mm_store_ss(p + 2, _mm_movehl_ps(v, v));
+	}
+#else
+	float	f[4];
+	Simd_Vector() { for (int i = 0; i < 4; i++) f[i] = 0.0f; }
+	Simd_Vector(float x, float y, float z, float w = 0.0f) { f[0] = x; f[1] = y; f[2] = z; f[3] = N == 4 ? w : 0.0f; }
+	explicit Simd_Vector(const float * p) { for (int i = 0; i < 4; i++) f[i] = i < N ? p[i] : 0.0f; }
+	static inline Simd_Vector splat(float x) { return Simd_Vector(x, x, x, x); }
+	inline void store(float * p) const { for (int i = 0; i < N; i++) p[i] = f[i]; }
+#endif
+	inline operator float * () { return f; }
+	inline operator const float * () const { return f; }
+};
+
+typedef Simd_Vector<3> Vec3;
+typedef Simd_Vector<4> Vec4;
+
+#if RT_HAVE_SSE
+template <int N> inline Simd_Vector<N> operator+(const Simd_Vector<N> & a, const Simd_Vector<N> & b) { return _mm_add_ps(a.v, b.v); }
+template <int N> inline Simd_Vector<N> operator-(const Simd_Vector<N> & a, const Simd_Vector<N> & b) { return _mm_sub_ps(a.v, b.v); }
+template <int N> inline Simd_Vector<N> operator*(const Simd_Vector<N> & a, const Simd_Vector<N> & b) { return _mm_mul_ps(a.v, b.v); }
+template <int N> inline Simd_Vector<N> operator*(const Simd_Vector<N> & a, float s) { return _mm_mul_ps(a.v, _mm_set1_ps(s)); }
+template <int N> inline Simd_Vector<N> operator*(float s, const Simd_Vector<N> & a) { return _mm_mul_ps(_mm_set1_ps(s), a.v); }
+template <int N> inline Simd_Vector<N> operator-(const Simd_Vector<N> & a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+template <int N> inline Simd_Vector<N> vec_min(const Simd_Vector<N> & a, const Simd_Vector<N> & b) { return _mm_min_ps(a.v, b.v); }
+template <int N> inline Simd_Vector<N> vec_max(const Simd_Vector<N> & a, const Simd_Vector<N> & b) { return _mm_max_ps(a.v, b.v); }
+
+// Lane i in every lane
+template <int N> inline Simd_Vector<N> vec_lane(const Simd_Vector<N> & a, int i)
+{
+	switch (i)
+	{
+	case 0: return _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(0, 0, 0, 0));
+	case 1: return _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(1, 1, 1, 1));
+	case 2: return _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 2, 2, 2));
+	default: return _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+}
+
+// (x*x' + y*y') + z*z' [+ w*w'], without leaving the register
+template <int N> inline float vec_dot(const Simd_Vector<N> & a, const Simd_Vector<N> & b)
+{
+	__m128 m = _mm_mul_ps(a.v, b.v);
+	__m128 s = _mm_add_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+	s = _mm_add_ss(s, _mm_movehl_ps(m, m));
+	if (N == 4) s = _mm_add_ss(s, _mm_shuffle_ps(m, m, _MM_SHUFFLE(3, 3, 3, 3)));
+	return _mm_cvtss_f32(s);
+}
+
+// Same component order as m3dCrossProduct
+inline Vec3 vec_cross(const Vec3 & u, const Vec3 & v)
+{
+	__m128 u_yzx = _mm_shuffle_ps(u.v, u.v, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 u_zxy = _mm_shuffle_ps(u.v, u.v, _MM_SHUFFLE(3, 1, 0, 2));
+	__m128 v_yzx = _mm_shuffle_ps(v.v, v.v, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 v_zxy = _mm_shuffle_ps(v.v, v.v, _MM_SHUFFLE(3, 1, 0, 2));
+	return _mm_sub_ps(_mm_mul_ps(u_yzx, v_zxy), _mm_mul_ps(u_zxy, v_yzx));
+}
+
+template <int N> inline Simd_Vector<N> vec_normalize_fast(const Simd_Vector<N> & a)
+{
+	__m128 len2 = _mm_set_ss(vec_dot(a, a));
+	__m128 r = _mm_rsqrt_ss(len2);
+	__m128 half_len2 = _mm_mul_ss(_mm_set_ss(0.5f), len2);
+	r = _mm_mul_ss(r, _mm_sub_ss(_mm_set_ss(1.5f), _mm_mul_ss(half_len2, _mm_mul_ss(r, r))));
+	return _mm_mul_ps(a.v, _mm_shuffle_ps(r, r, _MM_SHUFFLE(0, 0, 0, 0)));
+}
+#else
+#define RT_VEC_LANEWISE(expr) Simd_Vector<N> r; for (int k = 0; k < 4; k++) r.f[k] = (expr); return r;
+template <int N> inline Simd_Vector<N> operator+(const Simd_Vector<N> & a, const Simd_Vector<N> & b) { RT_VEC_LANEWISE(a.f[k] + b.f[k]) }
+template <int N> inline Simd_Vector<N> operator-(const Simd_Vector<N> & a, const Simd_Vector<N> & b) { RT_VEC_LANEWISE(a.f[k] - b.f[k]) }
+template <int N> inline Simd_Vector<N> operator*(const Simd_Vector<N> & a, const Simd_Vector<N> & b) { RT_VEC_LANEWISE(a.f[k] * b.f[k]) }
+template <int N> inline Simd_Vector<N> operator*(const Simd_Vector<N> & a, float s) { RT_VEC_LANEWISE(a.f[k] * s) }
+template <int N> inline Simd_Vector<N> operator*(float s, const Simd_Vector<N> & a) { RT_VEC_LANEWISE(s * a.f[k]) }
+template <int N> inline Simd_Vector<N> operator-(const Simd_Vector<N> & a) { RT_VEC_LANEWISE(-a.f[k]) }
+template <int N> inline Simd_Vector<N> vec_min(const Simd_Vector<N> & a, const Simd_Vector<N> & b) { RT_VEC_LANEWISE(a.f[k] < b.f[k] ? a.f[k] : b.f[k]) }
+template <int N> inline Simd_Vector<N> vec_max(const Simd_Vector<N> & a, const Simd_Vector<N> & b) { RT_VEC_LANEWISE(a.f[k] > b.f[k] ? a.f[k] : b.f[k]) }
+template <int N> inline Simd_Vector<N> vec_lane(const Simd_Vector<N> & a, int i) { RT_VEC_LANEWISE(a.f[i]) }
+#undef RT_VEC_LANEWISE
+
+template <int N> inline float vec_dot(const Simd_Vector<N> & a, const Simd_Vector<N> & b)
+{
+	float s = a.f[0] * b.f[0] + a.f[1] * b.f[1] + a.f[2] * b.f[2];
+	return N == 4 ? s + a.f[3] * b.f[3] : s;
+}
+
+inline Vec3 vec_cross(const Vec3 & u, const Vec3 & v)
+{
+	Vec3 r;
+	m3dCrossProduct(r, u, v);
+	r.f[3] = 0.0f;
+	return r;
+}
+
+template <int N> inline Simd_Vector<N> vec_normalize_fast(const Simd_Vector<N> & a)
+{
+	return a * (1.0f / sqrtf(vec_dot(a, a)));
+}
+#endif
+
+template <int N> inline Simd_Vector<N> & operator+=(Simd_Vector<N> & a, const Simd_Vector<N> & b) { return a = a + b; }
+template <int N> inline Simd_Vector<N> & operator-=(Simd_Vector<N> & a, const Simd_Vector<N> & b) { return a = a - b; }
+template <int N> inline Simd_Vector<N> & operator*=(Simd_Vector<N> & a, float s) { return a = a * s; }
+
+template <int N> inline float vec_length(const Simd_Vector<N> & a) { return sqrtf(vec_dot(a, a)); }
+
+// Each lane clamped to [0, 1], as the shaders clamp their colors
+template <int N> inline Simd_Vector<N> vec_saturate(const Simd_Vector<N> & a)
+{
+	return vec_min(vec_max(a, Simd_Vector<N>::splat(0.0f)), Simd_Vector<N>::splat(1.0f));
+}
+
+// Scale to unit length: 1 / sqrt then a multiply, like m3dNormalizeVector
+template <int N> inline Simd_Vector<N> vec_normalize(const Simd_Vector<N> & a)
+{
+#if RT_FAST_NORMALIZE
+	return vec_normalize_fast(a);
+#else
+	return a * (1.0f / vec_length(a));
+#endif
+}
+
+// m * (p, 1) and m * (d, 0) for a column major M3DMatrix44f: the columns
+// scaled and summed in m3dTransformVector3's order
+inline Vec3 vec_transform_direction(const M3DMatrix44f m, const Vec3 & d)
+{
+	Vec3 c0(m), c1(m + 4), c2(m + 8);
+	return c0 * vec_lane(d, 0) + c1 * vec_lane(d, 1) + c2 * vec_lane(d, 2);
+}
+
+inline Vec3 vec_transform_point(const M3DMatrix44f m, const Vec3 & p)
+{
+	return vec_transform_direction(m, p) + Vec3(m + 12);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// m3d overloads for Vec3 arguments. Without them a Vec3 still works through
+// its float * conversion, these keep the arithmetic in registers.
+inline void m3dCopyVector3(Vec3 & dst, const Vec3 & src) { dst = src; }
+inline void m3dAddVectors3(Vec3 & r, const Vec3 & a, const Vec3 & b) { r = a + b; }
+inline void m3dSubtractVectors3(Vec3 & r, const Vec3 & a, const Vec3 & b) { r = a - b; }
+inline void m3dScaleVector3(Vec3 & v, float scale) { v = v * scale; }
+inline void m3dCrossProduct(Vec3 & result, const Vec3 & u, const Vec3 & v) { result = vec_cross(u, v); }
+inline float m3dDotProduct(const Vec3 & u, const Vec3 & v) { return vec_dot(u, v); }
+inline float m3dGetVectorLengthSquared(const Vec3 & u) { return vec_dot(u, u); }
+inline float m3dGetVectorLength(const Vec3 & u) { return vec_length(u); }
+inline void m3dNormalizeVector(Vec3 & u) { u = vec_normalize(u); }
+inline void m3dTransformVector3(Vec3 & out, const Vec3 & v, const M3DMatrix44f m) { out = vec_transform_point(m, v); }
@@ -0,0 +1,146 @@
+#include "thread_affinity.h"
+#include <algorithm>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#else
+#include <thread>
+#endif
+
+#if defined(__linux__)
+// The cpuN directory in sysfs holds a "nodeK" link for its NUMA node
+static int linux_cpu_node(int cpu)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR * dir = opendir(path);
+	if (dir == NULL) return 0;
+	int node = 0;
+	while (struct dirent * entry = readdir(dir))
+	{
+		if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+		{
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+#endif
+
+void list_cpus(std::vector<Cpu_Info> & cpus)
+{
+	cpus.clear();
+#if defined(_WIN32)
+	// Only the processor group the process runs in; one group holds up to 64 CPUs
+	DWORD_PTR process_mask, system_mask;
+	if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+	{
+		// There is no getter for the thread mask; setting one returns the old
+		DWORD_PTR mask = SetThreadAffinityMask(GetCurrentThread(), process_mask);
+		if (mask != 0) SetThreadAffinityMask(GetCurrentThread(), mask);
+		else mask = process_mask;
+		for (int c = 0; c < (int)(8 * sizeof(DWORD_PTR)); c++)
+		{
+			if (!(mask & ((DWORD_PTR)1 << c))) continue;
+			UCHAR node = 0;
+			Cpu_Info info = { c, GetNumaProcessorNode((UCHAR)c, &node) ? (int)node : 0 };
+			cpus.push_back(info);
+		}
+	}
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	{
+		for (int c = 0; c < CPU_SETSIZE; c++)
+		{
+			if (!CPU_ISSET(c, &set)) continue;
+			Cpu_Info info = { c, linux_cpu_node(c) };
+			cpus.push_back(info);
+		}
+	}
+#else
+	int count = (int)std::thread::hardware_concurrency();
+	for (int c = 0; c < count; c++)
+	{
+		Cpu_Info info = { c, 0 };
+		cpus.push_back(info);
+	}
+#endif
+	if (cpus.empty())
+	{
+		Cpu_Info info = { 0, 0 };
+		cpus.push_back(info);
+	}
+
+	// Rank of each CPU within its node, then interleave the nodes by rank
+	std::vector<int> rank(cpus.size());
+	for (size_t i = 0; i < cpus.size(); i++)
+	{
+		rank[i] = 0;
+		for (size_t k = 0; k < i; k++)
+			if (cpus[k].node == cpus[i].node) rank[i]++;
+	}
+	std::vector<int> order(cpus.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = (int)i;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		return rank[a] != rank[b] ? rank[a] < rank[b] : cpus[a].node < cpus[b].node;
+	});
+	std::vector<Cpu_Info> sorted(cpus.size());
+	for (size_t i = 0; i < order.size(); i++) sorted[i] = cpus[order[i]];
+	cpus.swap(sorted);
+}
+
+int numa_node_count(const std::vector<Cpu_Info> & cpus)
+{
+	std::vector<int> nodes;
+	for (size_t i = 0; i < cpus.size(); i++)
+		if (std::find(nodes.begin(), nodes.end(), cpus[i].node) == nodes.end()) nodes.push_back(cpus[i].node);
+	return (int)nodes.size();
+}
+
+bool pin_current_thread(int cpu)
+{
+#if defined(_WIN32)
+	if (cpu < 0 || cpu >= (int)(8 * sizeof(DWORD_PTR))) return false;
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#elif defined(__linux__)
+	if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpu;
+	return false;
+#endif
+}
+
+bool restrict_current_thread(const std::vector<Cpu_Info> & cpus)
+{
+#if defined(_WIN32)
+	DWORD_PTR mask = 0;
+	for (size_t i = 0; i < cpus.size(); i++)
+		if (cpus[i].cpu >= 0 && cpus[i].cpu < (int)(8 * sizeof(DWORD_PTR))) mask |= (DWORD_PTR)1 << cpus[i].cpu;
+	return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (size_t i = 0; i < cpus.size(); i++)
+		if (cpus[i].cpu >= 0 && cpus[i].cpu < CPU_SETSIZE) CPU_SET(cpus[i].cpu, &set);
+	return CPU_COUNT(&set) > 0 && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpus;
+	return false;
+#endif
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <vector>
+
+// A logical CPU the process may run on and the NUMA node it belongs to
+struct Cpu_Info
+{
+	int		cpu;
+	int		node;
+};
+
+// CPUs the calling thread may run on, ordered so that consecutive entries
+// alternate between NUMA nodes (first CPU of node 0, first of node 1, ...,
+// second of node 0, ...). A pool pinned in this order spreads over every
+// socket even with fewer threads than CPUs. Machines or platforms without
+// NUMA information report every CPU on node 0.
+void	list_cpus(std::vector<Cpu_Info> & cpus);
+
+// Number of distinct nodes in a list_cpus() result
+int		numa_node_count(const std::vector<Cpu_Info> & cpus);
+
+// Restrict the calling thread to one CPU; false where the platform does not
+// support it (the thread then keeps running wherever the OS puts it)
+bool	pin_current_thread(int cpu);
+
+// Restrict the calling thread to a set of CPUs. On Linux threads it starts
+// afterwards inherit the set, and list_cpus() reports it.
+bool	restrict_current_thread(const std::vector<Cpu_Info> & cpus);
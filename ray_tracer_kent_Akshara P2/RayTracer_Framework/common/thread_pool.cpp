@@ -0,0 +1,57 @@
+#include "thread_pool.h"
+
+Thread_Pool::~Thread_Pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_start.notify_all();
+	for (size_t i = 0; i < _threads.size(); i++)
+		_threads[i].join();
+}
+
+void Thread_Pool::run(int count, const std::function<void(int)> & job)
+{
+	if (count <= 1)
+	{
+		if (count == 1) job(0);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	while ((int)_threads.size() < count - 1)
+		_threads.push_back(std::thread(&Thread_Pool::work, this, (int)_threads.size() + 1));
+	_job = &job;
+	_job_threads = count;
+	_running = count - 1;
+	_generation++;
+	lock.unlock();
+	_start.notify_all();
+
+	job(0);
+
+	lock.lock();
+	_done.wait(lock, [&]() { return _running == 0; });
+	_job = NULL;
+}
+
+void Thread_Pool::work(int index)
+{
+	// A thread started for a job takes that job: _generation is past 0 by then
+	unsigned long long seen = 0;
+	std::unique_lock<std::mutex> lock(_mutex);
+	for (;;)
+	{
+		_start.wait(lock, [&]() { return _stop || _generation != seen; });
+		if (_stop) return;
+		seen = _generation;
+		if (index >= _job_threads) continue;	// a smaller job than the pool
+
+		const std::function<void(int)> * job = _job;
+		lock.unlock();
+		(*job)(index);
+		lock.lock();
+		if (--_running == 0) _done.notify_one();
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads kept alive between jobs, for work that comes in many short rounds
+// (progressive passes, tiles from the render coordinator) where starting
+// and joining a thread set per round would cost more than the round.
+// run() is called from one thread at a time.
+class Thread_Pool
+{
+public:
+	Thread_Pool() : _job(NULL), _job_threads(0), _running(0), _generation(0), _stop(false) {}
+	~Thread_Pool();
+
+	// Call job(t) for t = 0 .. count - 1, each on its own thread, and return
+	// once all of them have returned. The caller runs t = 0; threads are
+	// started on first use and reused by every later call.
+	void	run(int count, const std::function<void(int)> & job);
+
+private:
+	Thread_Pool(const Thread_Pool &);
+	Thread_Pool & operator=(const Thread_Pool &);
+
+	void	work(int index);
+
+private:
+	std::vector<std::thread>			_threads;		// thread i runs index i + 1
+	std::mutex							_mutex;
+	std::condition_variable				_start;
+	std::condition_variable				_done;
+	const std::function<void(int)> *	_job;
+	int									_job_threads;
+	int									_running;		// pool threads still in the current job
+	unsigned long long					_generation;	// bumped for every job
+	bool								_stop;
+};
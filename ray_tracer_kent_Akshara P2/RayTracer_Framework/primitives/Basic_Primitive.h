@@ -1,6 +1,11 @@
 #pragma once
 #include "../common/common.h"
+#include "../common/bounding_box.h"
+#include "../common/hash.h"
+#include "../common/ray_packet.h"
+#include "../common/simd_vector.h"
 #include "../scene/Light.h"
+#include "../scene/Material.h"
 
 typedef enum
 {
@@ -9,6 +14,24 @@ typedef enum
 	_k_inside
 } Intersect_Cond;
 
+class Basic_Primitive;
+
+// Everything shading needs about the closest hit. Traversal only finds t
+// (and the face of a mesh); Scene::intersection_check fills in the rest
+// once, for the closest hit, through Basic_Primitive::fill_hit.
+struct Hit_Record
+{
+	M3DVector3f			point;
+	M3DVector3f			normal;		// unit, world space, not flipped toward the ray
+	float				t;			// along the (unit) ray direction
+	float				u, v;		// triangle: barycentric weights of v1 and v2; wall: position across it
+	Basic_Primitive *	prim;		// NULL on a miss
+	int					prim_id;	// index in the scene, -1 on a miss
+	int					face;		// triangle of a mesh, -1 for single-face primitives
+	Intersect_Cond		cond;
+	Material_Id			material;
+};
+
 class Basic_Primitive
 {
 public:
@@ -17,22 +40,74 @@ public:
 		_k_unknown = 0,
 		_k_triangle,
 		_k_sphere,
-		_k_wall
+		_k_wall,
+		_k_mesh,
+		_k_instance
 	};
 public:
-	Basic_Primitive(Object_Type type = _k_triangle, float delta = 1.0)
-		:_type(type), _delta(delta)
+	Basic_Primitive(Object_Type type = _k_triangle, Material_Id material = 0)
+		:_type(type), _id(-1), _material(material)
 	{ 	}
 	virtual	~Basic_Primitive() {};
-	virtual	Intersect_Cond	intersection_check(const M3DVector3f start, const M3DVector3f dir, float & distance, M3DVector3f intersection_p) = 0;
-	virtual	void	shade(M3DVector3f view,M3DVector3f intersect_p,const Light & sp_light, M3DVector3f am_light, M3DVector3f color, bool shadow) = 0;
-	virtual	void	get_reflect_direct(const M3DVector3f direct,const M3DVector3f intersect_p,M3DVector3f reflect_direct) = 0;
+	// Closest-hit test: only the distance, and for meshes the face hit (-1 otherwise)
+	virtual	Intersect_Cond	intersection_check(const M3DVector3f start, const M3DVector3f dir, float & distance, int & face) = 0;
+	// Point, normal and u, v of a hit found by intersection_check; hit.t and
+	// hit.face are already set
+	virtual	void	fill_hit(const M3DVector3f start, const M3DVector3f dir, Hit_Record & hit) const = 0;
+	// Any-hit test for shadow rays: true as soon as the primitive is hit within [tmin, tmax]
+	virtual	bool	occluded(const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax) = 0;
+	// Packet versions over the lanes in 'mask'. intersection_check_packet returns the lanes hit
+	// and writes their distances to t; occluded_packet returns the lanes blocked within
+	// [tmin, tmax[lane]]. Each lane must agree with the single-ray test; the defaults run it
+	// lane by lane, primitives with a SIMD kernel override them.
+	virtual	int		intersection_check_packet(const Ray_Packet & packet, int mask, float * t)
+	{
+		int hit = 0;
+		for (int k = 0; k < RT_PACKET_SIZE; k++)
+		{
+			if (!(mask & (1 << k))) continue;
+			M3DVector3f start, dir;
+			int face;
+			packet.get(k, start, dir);
+			if (intersection_check(start, dir, t[k], face) != _k_miss) hit |= 1 << k;
+		}
+		return hit;
+	}
+	virtual	int		occluded_packet(const Ray_Packet & packet, int mask, float tmin, const float * tmax)
+	{
+		int blocked = 0;
+		for (int k = 0; k < RT_PACKET_SIZE; k++)
+		{
+			if (!(mask & (1 << k))) continue;
+			M3DVector3f start, dir;
+			packet.get(k, start, dir);
+			if (occluded(start, dir, tmin, tmax[k])) blocked |= 1 << k;
+		}
+		return blocked;
+	}
+	// material: the scene's entry for get_material()
+	virtual	void	shade(M3DVector3f view,const Hit_Record & hit,const Light & sp_light, M3DVector3f am_light, const Material & material, M3DVector3f color, bool shadow) = 0;
+	// Mirror direction about hit.normal
+	virtual	void	get_reflect_direct(const M3DVector3f direct,const Hit_Record & hit,M3DVector3f reflect_direct)
+	{
+		Vec3 d(direct), N(hit.normal);
+		float k = 2.0f * vec_dot(d, N);
+		vec_normalize(d - N * k).store(reflect_direct);
+	}
 	virtual	bool	get_refract_direct(const M3DVector3f direct,const M3DVector3f intersect_p,M3DVector3f refract_direct, float delta,bool is_in) { m3dLoadVector3(refract_direct, 0, 0, 0); return true;}
-	virtual	void	get_properties(float & ks,float & kt, float & ws, float & wt) const = 0;
-	virtual	float	get_delta() const  {	return _delta; };
+	virtual	void	get_bounds(Bounding_Box & box) const = 0;
+	virtual	void	translate(const M3DVector3f offset) = 0;	// for animation, see Scene::move_primitive
+	// fnv1a() of the data the primitive's hits are computed from, continuing
+	// from h; part of Scene::content_hash
+	virtual	unsigned long long	hash(unsigned long long h) const = 0;
 	Object_Type	get_type()	{	return	_type; }
+	int		get_id() const	{	return _id; }
+	void	set_id(int id)	{	_id = id; }
+	Material_Id	get_material() const	{	return _material; }
+	void	set_material(Material_Id material)	{	_material = material; }
 	
 protected:
-	float	_delta;	//Refraction factor for material
 	Object_Type	_type;
+	int		_id;	//Index in the owning scene's primitive list
+	Material_Id	_material;	//Index in the owning scene's material table
 };
@@ -0,0 +1,112 @@
+#include "Instance.h"
+#include "../common/math3d.h"
+#include <math.h>
+#include <stdio.h>
+
+Instance::Instance(Basic_Primitive * geometry, const M3DMatrix44f xform)
+    : Basic_Primitive(_k_instance, geometry->get_material())
+    , _geometry(geometry)
+{
+    m3dCopyMatrix44(_xform, xform);
+    if (!m3dInvertMatrix44(_inv, _xform))
+    {
+        printf("Instance transform is singular, using identity.\n");
+        m3dLoadIdentity44(_xform);
+        m3dLoadIdentity44(_inv);
+    }
+}
+
+float Instance::to_object(const M3DVector3f start, const M3DVector3f dir,
+    M3DVector3f obj_start, M3DVector3f obj_dir) const
+{
+    vec_transform_point(_inv, Vec3(start)).store(obj_start);
+    Vec3 d = vec_transform_direction(_inv, Vec3(dir));
+
+    // The primitives expect unit directions, so renormalize and remember the
+    // scale: a distance t along obj_dir is t / len along the world ray
+    float len = vec_length(d);
+    (d * (1.0f / len)).store(obj_dir);
+    return len;
+}
+
+Intersect_Cond Instance::intersection_check(const M3DVector3f start, const M3DVector3f dir,
+    float & distance, int & face)
+{
+    M3DVector3f o, d;
+    float len = to_object(start, dir, o, d);
+
+    float t = 0.0f;
+    Intersect_Cond ret = _geometry->intersection_check(o, d, t, face);
+    if (ret == _k_miss) return _k_miss;
+
+    distance = t / len;
+    return ret;
+}
+
+// The geometry fills the record in object space; point and normal are then
+// moved back, u, v and the face carry over
+void Instance::fill_hit(const M3DVector3f start, const M3DVector3f dir, Hit_Record & hit) const
+{
+    M3DVector3f o, d;
+    float len = to_object(start, dir, o, d);
+
+    Hit_Record obj = hit;
+    obj.t = hit.t * len;
+    _geometry->fill_hit(o, d, obj);
+
+    M3DVector3f step; m3dCopyVector3(step, dir); m3dScaleVector3(step, hit.t);
+    m3dAddVectors3(hit.point, start, step);
+    vec_normalize(transform_normal(Vec3(obj.normal))).store(hit.normal);
+    hit.u = obj.u;
+    hit.v = obj.v;
+}
+
+bool Instance::occluded(const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax)
+{
+    M3DVector3f o, d;
+    float len = to_object(start, dir, o, d);
+    return _geometry->occluded(o, d, tmin * len, tmax * len);
+}
+
+// The record is already in world space, so the geometry shades it with the
+// scene's light as it is
+void Instance::shade(M3DVector3f view,
+    const Hit_Record & hit,
+    const Light & sp_light,
+    M3DVector3f am_light,
+    const Material & material,
+    M3DVector3f color,
+    bool shadow)
+{
+    _geometry->shade(view, hit, sp_light, am_light, material, color, shadow);
+}
+
+void Instance::translate(const M3DVector3f offset)
+{
+    _xform[12] += offset[0];
+    _xform[13] += offset[1];
+    _xform[14] += offset[2];
+    m3dInvertMatrix44(_inv, _xform);
+}
+
+unsigned long long Instance::hash(unsigned long long h) const
+{
+    return _geometry->hash(fnv1a(_xform, sizeof(_xform), h));
+}
+
+// World box: the eight transformed corners of the object space box
+void Instance::get_bounds(Bounding_Box & box) const
+{
+    Bounding_Box obj;
+    _geometry->get_bounds(obj);
+    box.reset();
+    for (int c = 0; c < 8; ++c)
+    {
+        M3DVector3f corner, world;
+        corner[0] = (c & 1) ? obj.hi[0] : obj.lo[0];
+        corner[1] = (c & 2) ? obj.hi[1] : obj.lo[1];
+        corner[2] = (c & 4) ? obj.hi[2] : obj.lo[2];
+        m3dTransformVector3(world, corner, _xform);
+        box.extend(world);
+    }
+}
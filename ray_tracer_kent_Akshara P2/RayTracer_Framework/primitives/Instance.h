@@ -0,0 +1,52 @@
+#pragma once
+#include "Basic_Primitive.h"
+#include "../common/simd_vector.h"
+
+// A placed copy of shared geometry. The instance only stores the object to
+// world transform and its inverse; rays are moved into object space, traced
+// against the shared primitive (a mesh brings its own BLAS) and the results
+// moved back. The geometry is not owned, the scene keeps it alive.
+class Instance : public Basic_Primitive
+{
+public:
+	// xform: object to world, column major (OpenGL style, see math3d.h). The
+	// instance starts with the geometry's material; set_material() gives
+	// this copy its own.
+	Instance(Basic_Primitive * geometry, const M3DMatrix44f xform);
+	~Instance() {}
+
+public:
+	Intersect_Cond	intersection_check(const M3DVector3f start, const M3DVector3f dir, float & distance, int & face);
+	void	fill_hit(const M3DVector3f start, const M3DVector3f dir, Hit_Record & hit) const;
+	bool	occluded(const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax);
+	void	shade(M3DVector3f view, const Hit_Record & hit, const Light & sp_light, M3DVector3f am_light, const Material & material, M3DVector3f color, bool shadow);
+	void	get_bounds(Bounding_Box & box) const;
+	void	translate(const M3DVector3f offset);
+	// The transform and the shared geometry's own hash
+	unsigned long long	hash(unsigned long long h) const;
+
+	inline Basic_Primitive *	get_geometry() const { return _geometry; }
+	inline void	get_transform(M3DMatrix44f xform) const { m3dCopyMatrix44(xform, _xform); }
+
+private:
+	// Upper 3x3 only, for directions
+	static inline void transform_direction(M3DVector3f out, const M3DVector3f v, const M3DMatrix44f m)
+	{
+		vec_transform_direction(m, Vec3(v)).store(out);
+	}
+
+	// Object space normal to world space: the transpose of _inv, so normals
+	// stay perpendicular under non-uniform scales too
+	inline Vec3	transform_normal(const Vec3 & n) const
+	{
+		return Vec3(vec_dot(Vec3(&_inv[0]), n), vec_dot(Vec3(&_inv[4]), n), vec_dot(Vec3(&_inv[8]), n));
+	}
+
+	// Object space ray; returns the factor from object space to world space distances
+	float	to_object(const M3DVector3f start, const M3DVector3f dir, M3DVector3f obj_start, M3DVector3f obj_dir) const;
+
+private:
+	Basic_Primitive *	_geometry;
+	M3DMatrix44f		_xform;
+	M3DMatrix44f		_inv;
+};
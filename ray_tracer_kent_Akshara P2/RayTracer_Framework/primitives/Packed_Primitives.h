@@ -0,0 +1,243 @@
+#pragma once
+#include "../common/math3d.h"
+#include "../common/ray_packet.h"
+#include "../common/simd_vector.h"
+#include "Triangle_Soa.h"
+
+// Plain-data copies of the primitives, with the ray tests as inline free
+// functions. Prim_Arrays keeps the scene's primitives in one array of these
+// per type, and the Sphere, Wall and Triangle classes run the same functions,
+// so both give bit-identical results. Every test writes t only on a hit.
+
+// 16 bytes: four spheres to a cache line
+struct Packed_Sphere
+{
+	float	center[3];
+	float	rad2;
+};
+
+// Möller–Trumbore form, as in Triangle_Soa
+struct Packed_Triangle
+{
+	float	v0[3];
+	float	e1[3];		// v1 - v0
+	float	e2[3];		// v2 - v0
+};
+
+// A wall quad with the intersection path Wall::setup_quad picked:
+// axis-aligned rectangle, then parallelogram in any orientation, then the
+// two triangles
+struct Packed_Wall
+{
+	int		axis;				// normal axis of an axis-aligned wall, or -1
+	int		parallelogram;		// 1: (u, v) range test, 0: the two halves
+	float	plane;				// wall coordinate along axis, or dot(normal, p) for any p on it
+	float	normal[3];
+	float	lo[3], hi[3];		// axis-aligned wall's extent
+	float	origin[3];			// left-down corner
+	float	u_axis[3], v_axis[3];	// dual of the edges from origin: u = dot(p - origin, u_axis)
+	Packed_Triangle	half[2];
+};
+
+// start + t * dir, the way the primitives always computed their hit points
+inline void hit_point(const M3DVector3f start, const M3DVector3f dir, float t, M3DVector3f p)
+{
+	(Vec3(start) + Vec3(dir) * t).store(p);
+}
+
+// Packet hits of 'hit' whose t lies in [tmin, tmax[lane]]
+inline int packet_in_range(int hit, const float * t, float tmin, const float * tmax)
+{
+	if (!hit) return 0;
+	Packet_Float d = Packet_Float::load(t);
+	return hit & packet_mask((d >= Packet_Float(tmin)) & (d <= Packet_Float::load(tmax)));
+}
+
+// Squared distance from the sphere center to the ray, as |L - tca * dir|^2:
+// |L|^2 - tca^2 cancels badly once the origin is far from a small sphere,
+// which put hit points hundreds of units away off by ~1e-3, the size of
+// the shadow ray offset
+inline float sphere_ray_distance2(const Vec3 & L, const Vec3 & dir, float tca)
+{
+	Vec3 perp = L - dir * tca;
+	return vec_dot(perp, perp);
+}
+
+inline Packet_Float sphere_ray_distance2(const Packet_Float L[3], const Packet_Float dir[3], const Packet_Float & tca)
+{
+	Packet_Float perp[3];
+	for (int i = 0; i < 3; ++i) perp[i] = L[i] - dir[i] * tca;
+	return packet_dot(perp, perp);
+}
+
+// Ray-sphere, geometric: only spheres ahead of the origin count
+inline bool hit_sphere(const Packed_Sphere & s, const M3DVector3f start, const M3DVector3f dir, float & t)
+{
+	Vec3 L = Vec3(s.center) - Vec3(start);
+	float tca = vec_dot(L, Vec3(dir));
+	if (tca < 0.0f) return false;
+
+	float d2 = sphere_ray_distance2(L, Vec3(dir), tca);
+	if (d2 > s.rad2) return false;
+
+	float thc = sqrtf(s.rad2 - d2);
+	t = tca - thc;
+	return true;
+}
+
+// Shadow rays: either root inside [tmin, tmax] blocks the ray
+inline bool sphere_occluded(const Packed_Sphere & s, const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax)
+{
+	Vec3 L = Vec3(s.center) - Vec3(start);
+	float tca = vec_dot(L, Vec3(dir));
+	float d2 = sphere_ray_distance2(L, Vec3(dir), tca);
+	if (d2 > s.rad2) return false;
+
+	float thc = sqrtf(s.rad2 - d2);
+	float t0 = tca - thc, t1 = tca + thc;
+	return (t0 >= tmin && t0 <= tmax) || (t1 >= tmin && t1 <= tmax);
+}
+
+inline int hit_sphere_packet(const Packed_Sphere & s, const Ray_Packet & packet, int mask, float * t)
+{
+	Packet_Float org[3], dir[3], L[3];
+	packet.load_origin(org);
+	packet.load_direction(dir);
+	for (int i = 0; i < 3; ++i) L[i] = Packet_Float(s.center[i]) - org[i];
+
+	Packet_Float rad2(s.rad2);
+	Packet_Float tca = packet_dot(L, dir);
+	Packet_Float d2 = sphere_ray_distance2(L, dir, tca);
+	int hit = mask & packet_mask((tca >= Packet_Float(0.0f)) & (d2 <= rad2));
+	if (hit) (tca - packet_sqrt(rad2 - d2)).store(t);
+	return hit;
+}
+
+inline int sphere_occluded_packet(const Packed_Sphere & s, const Ray_Packet & packet, int mask, float tmin, const float * tmax)
+{
+	Packet_Float org[3], dir[3], L[3];
+	packet.load_origin(org);
+	packet.load_direction(dir);
+	for (int i = 0; i < 3; ++i) L[i] = Packet_Float(s.center[i]) - org[i];
+
+	Packet_Float rad2(s.rad2);
+	Packet_Float tca = packet_dot(L, dir);
+	Packet_Float d2 = sphere_ray_distance2(L, dir, tca);
+	int hit = mask & packet_mask(d2 <= rad2);
+	if (!hit) return 0;
+
+	Packet_Float thc = packet_sqrt(rad2 - d2);
+	Packet_Float t0 = tca - thc, t1 = tca + thc;
+	Packet_Float lo(tmin), hi = Packet_Float::load(tmax);
+	return hit & packet_mask(((t0 >= lo) & (t0 <= hi)) | ((t1 >= lo) & (t1 <= hi)));
+}
+
+inline bool hit_triangle(const Packed_Triangle & tri, const M3DVector3f start, const M3DVector3f dir, float & t)
+{
+	return ray_triangle(tri.v0, tri.e1, tri.e2, start, dir, t);
+}
+
+inline int hit_triangle_packet(const Packed_Triangle & tri, const Ray_Packet & packet, int mask, float * t)
+{
+	return ray_triangle_packet(tri.v0, tri.e1, tri.e2, packet, mask, t);
+}
+
+// Axis-aligned: one divide for the plane distance and two range checks.
+// Parallelogram: the same divide against the wall plane and two dot
+// products for (u, v). Otherwise the closer half, ties to the first.
+inline bool hit_wall(const Packed_Wall & w, const M3DVector3f start, const M3DVector3f dir, float & t)
+{
+	const float EPS = 1e-6f;
+	if (w.axis >= 0)
+	{
+		if (fabs(dir[w.axis]) < EPS) return false;
+		float d = (w.plane - start[w.axis]) / dir[w.axis];
+		if (d < EPS) return false;
+
+		int a = w.axis == 0 ? 1 : 0, b = w.axis == 2 ? 1 : 2;
+		float pa = start[a] + d * dir[a], pb = start[b] + d * dir[b];
+		if (pa < w.lo[a] || pa > w.hi[a] || pb < w.lo[b] || pb > w.hi[b]) return false;
+		t = d;
+		return true;
+	}
+
+	if (w.parallelogram)
+	{
+		Vec3 n(w.normal), o(start), r(dir);
+		float denom = vec_dot(n, r);
+		if (fabs(denom) < EPS) return false;
+		float d = (w.plane - vec_dot(n, o)) / denom;
+		if (d < EPS) return false;
+
+		Vec3 q = o + r * d - Vec3(w.origin);
+		float u = vec_dot(q, Vec3(w.u_axis)), v = vec_dot(q, Vec3(w.v_axis));
+		if (u < 0.0f || u > 1.0f || v < 0.0f || v > 1.0f) return false;
+		t = d;
+		return true;
+	}
+
+	float t0, t1;
+	bool h0 = hit_triangle(w.half[0], start, dir, t0);
+	bool h1 = hit_triangle(w.half[1], start, dir, t1);
+	if (h1 && (!h0 || t1 < t0)) t = t1;
+	else if (h0) t = t0;
+	return h0 || h1;
+}
+
+// The hit point of hit_wall; exactly on the plane for an axis-aligned wall
+inline void wall_hit_point(const Packed_Wall & w, const M3DVector3f start, const M3DVector3f dir, float t, M3DVector3f p)
+{
+	hit_point(start, dir, t, p);
+	if (w.axis >= 0) p[w.axis] = w.plane;
+}
+
+inline int hit_wall_packet(const Packed_Wall & w, const Ray_Packet & packet, int mask, float * t)
+{
+	const Packet_Float EPS(1e-6f), zero(0.0f), one(1.0f);
+	Packet_Float org[3], dir[3];
+	packet.load_origin(org);
+	packet.load_direction(dir);
+
+	if (w.axis >= 0)
+	{
+		Packet_Float d = (Packet_Float(w.plane) - org[w.axis]) / dir[w.axis];
+		int a = w.axis == 0 ? 1 : 0, b = w.axis == 2 ? 1 : 2;
+		Packet_Float pa = org[a] + d * dir[a], pb = org[b] + d * dir[b];
+		int hit = mask & packet_mask((packet_abs(dir[w.axis]) >= EPS) & (d >= EPS)
+			& (pa >= Packet_Float(w.lo[a])) & (pa <= Packet_Float(w.hi[a]))
+			& (pb >= Packet_Float(w.lo[b])) & (pb <= Packet_Float(w.hi[b])));
+		if (hit) d.store(t);
+		return hit;
+	}
+
+	if (w.parallelogram)
+	{
+		Packet_Float pn[3] = { Packet_Float(w.normal[0]), Packet_Float(w.normal[1]), Packet_Float(w.normal[2]) };
+		Packet_Float denom = packet_dot(pn, dir);
+		Packet_Float d = (Packet_Float(w.plane) - packet_dot(pn, org)) / denom;
+
+		Packet_Float q[3], pu[3], pv[3];
+		for (int i = 0; i < 3; ++i)
+		{
+			q[i] = org[i] + d * dir[i] - Packet_Float(w.origin[i]);
+			pu[i] = Packet_Float(w.u_axis[i]);
+			pv[i] = Packet_Float(w.v_axis[i]);
+		}
+		Packet_Float u = packet_dot(q, pu), v = packet_dot(q, pv);
+		int hit = mask & packet_mask((packet_abs(denom) >= EPS) & (d >= EPS)
+			& (u >= zero) & (u <= one) & (v >= zero) & (v <= one));
+		if (hit) d.store(t);
+		return hit;
+	}
+
+	float t0[RT_PACKET_SIZE], t1[RT_PACKET_SIZE];
+	int h0 = hit_triangle_packet(w.half[0], packet, mask, t0);
+	int h1 = hit_triangle_packet(w.half[1], packet, mask, t1);
+	for (int k = 0; k < RT_PACKET_SIZE; ++k)
+	{
+		int bit = 1 << k;
+		if (h1 & bit && (!(h0 & bit) || t1[k] < t0[k])) t[k] = t1[k];
+		else if (h0 & bit) t[k] = t0[k];
+	}
+	return h0 | h1;
+}
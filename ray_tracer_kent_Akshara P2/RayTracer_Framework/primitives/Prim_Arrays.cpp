@@ -0,0 +1,91 @@
+#include "Prim_Arrays.h"
+#include "Sphere.h"
+#include "Wall.h"
+#include "Triangle.h"
+
+void Prim_Arrays::add(Basic_Primitive * prim)
+{
+	Prim_Ref ref;
+	if (const Sphere * sphere = dynamic_cast<const Sphere *>(prim))
+	{
+		Packed_Sphere s;
+		sphere->pack(s);
+		ref.kind = _k_packed_sphere;
+		ref.index = (int)_spheres.size();
+		_spheres.push_back(s);
+	}
+	else if (const Wall * wall = dynamic_cast<const Wall *>(prim))
+	{
+		ref.kind = _k_packed_wall;
+		ref.index = (int)_walls.size();
+		_walls.push_back(wall->get_packed());
+	}
+	else if (const Triangle * triangle = dynamic_cast<const Triangle *>(prim))
+	{
+		Packed_Triangle tri;
+		triangle->pack(tri);
+		ref.kind = _k_packed_triangle;
+		ref.index = (int)_triangles.size();
+		_triangles.push_back(tri);
+	}
+	else
+	{
+		ref.kind = _k_packed_other;
+		ref.index = (int)_others.size();
+		_others.push_back(prim);
+	}
+	_owners[ref.kind].push_back((int)_refs.size());
+	_refs.push_back(ref);
+}
+
+void Prim_Arrays::update(int id, const Basic_Primitive * prim)
+{
+	const Prim_Ref ref = _refs[id];
+	if (ref.kind == _k_packed_sphere)
+		static_cast<const Sphere *>(prim)->pack(_spheres[ref.index]);
+	else if (ref.kind == _k_packed_wall)
+		_walls[ref.index] = static_cast<const Wall *>(prim)->get_packed();
+	else if (ref.kind == _k_packed_triangle)
+		static_cast<const Triangle *>(prim)->pack(_triangles[ref.index]);
+}
+
+// Swap-remove inside one kind's array, pointing the moved entry's id at its new index
+template <class T> void Prim_Arrays::remove_from(std::vector<T> & items, int kind, int index)
+{
+	int last = (int)items.size() - 1;
+	if (index != last)
+	{
+		items[index] = items[last];
+		_owners[kind][index] = _owners[kind][last];
+		_refs[_owners[kind][index]].index = index;
+	}
+	items.pop_back();
+	_owners[kind].pop_back();
+}
+
+void Prim_Arrays::remove(int id)
+{
+	const Prim_Ref ref = _refs[id];
+	if (ref.kind == _k_packed_sphere) remove_from(_spheres, ref.kind, ref.index);
+	else if (ref.kind == _k_packed_wall) remove_from(_walls, ref.kind, ref.index);
+	else if (ref.kind == _k_packed_triangle) remove_from(_triangles, ref.kind, ref.index);
+	else remove_from(_others, ref.kind, ref.index);
+
+	int last = (int)_refs.size() - 1;
+	if (id != last)
+	{
+		_refs[id] = _refs[last];
+		_owners[_refs[id].kind][_refs[id].index] = id;
+	}
+	_refs.pop_back();
+}
+
+void Prim_Arrays::clear()
+{
+	_refs.clear();
+	_spheres.clear();
+	_walls.clear();
+	_triangles.clear();
+	_others.clear();
+	for (int k = 0; k < _k_packed_kinds; k++) _owners[k].clear();
+}
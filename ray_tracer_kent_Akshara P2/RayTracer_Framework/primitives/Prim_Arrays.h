@@ -0,0 +1,103 @@
+#pragma once
+#include "Basic_Primitive.h"
+#include "Packed_Primitives.h"
+#include <vector>
+
+// The scene's primitives for the traversal loops: spheres, walls and
+// triangles each packed into one contiguous array, so a leaf test is a
+// direct call on a few cache lines instead of a virtual call through a
+// separately allocated object. Everything else (instances, meshes) keeps
+// its virtual tests; each of those brings its own BLAS, so the one
+// indirect call per leaf is spread over a whole traversal.
+//
+// Ids are the scene's primitive indices. The Basic_Primitive objects stay
+// what scenes are built from and what shading gets back; after add() the
+// arrays only change through update() and remove().
+class Prim_Arrays
+{
+public:
+	Prim_Arrays() {}
+	~Prim_Arrays() {}
+
+	// prim becomes id size(); the scene keeps owning it
+	void	add(Basic_Primitive * prim);
+
+	// prim (id) has moved, copy it again
+	void	update(int id, const Basic_Primitive * prim);
+
+	// Same swap-remove as Scene::remove_primitive: the last id takes id's place
+	void	remove(int id);
+	void	clear();
+
+	inline int	size() const { return (int)_refs.size(); }
+
+	// Basic_Primitive::intersection_check, occluded and their packet versions for primitive id
+	inline Intersect_Cond	intersection_check(int id, const M3DVector3f start, const M3DVector3f dir, float & distance, int & face) const
+	{
+		const Prim_Ref ref = _refs[id];
+		bool hit;
+		if (ref.kind == _k_packed_sphere) hit = hit_sphere(_spheres[ref.index], start, dir, distance);
+		else if (ref.kind == _k_packed_wall) hit = hit_wall(_walls[ref.index], start, dir, distance);
+		else if (ref.kind == _k_packed_triangle) hit = hit_triangle(_triangles[ref.index], start, dir, distance);
+		else return _others[ref.index]->intersection_check(start, dir, distance, face);
+		face = -1;
+		return hit ? _k_hit : _k_miss;
+	}
+
+	inline bool	occluded(int id, const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax) const
+	{
+		const Prim_Ref ref = _refs[id];
+		if (ref.kind == _k_packed_sphere) return sphere_occluded(_spheres[ref.index], start, dir, tmin, tmax);
+		float t;
+		if (ref.kind == _k_packed_wall) return hit_wall(_walls[ref.index], start, dir, t) && t >= tmin && t <= tmax;
+		if (ref.kind == _k_packed_triangle) return hit_triangle(_triangles[ref.index], start, dir, t) && t >= tmin && t <= tmax;
+		return _others[ref.index]->occluded(start, dir, tmin, tmax);
+	}
+
+	inline int	intersection_check_packet(int id, const Ray_Packet & packet, int mask, float * t) const
+	{
+		const Prim_Ref ref = _refs[id];
+		if (ref.kind == _k_packed_wall) return hit_wall_packet(_walls[ref.index], packet, mask, t);
+		if (ref.kind == _k_packed_sphere) return hit_sphere_packet(_spheres[ref.index], packet, mask, t);
+		if (ref.kind == _k_packed_triangle) return hit_triangle_packet(_triangles[ref.index], packet, mask, t);
+		return _others[ref.index]->intersection_check_packet(packet, mask, t);
+	}
+
+	inline int	occluded_packet(int id, const Ray_Packet & packet, int mask, float tmin, const float * tmax) const
+	{
+		const Prim_Ref ref = _refs[id];
+		if (ref.kind == _k_packed_sphere) return sphere_occluded_packet(_spheres[ref.index], packet, mask, tmin, tmax);
+		float t[RT_PACKET_SIZE];
+		if (ref.kind == _k_packed_wall) return packet_in_range(hit_wall_packet(_walls[ref.index], packet, mask, t), t, tmin, tmax);
+		if (ref.kind == _k_packed_triangle) return packet_in_range(hit_triangle_packet(_triangles[ref.index], packet, mask, t), t, tmin, tmax);
+		return _others[ref.index]->occluded_packet(packet, mask, tmin, tmax);
+	}
+
+private:
+	// Tested with compares rather than a switch, which may become a jump table
+	enum Prim_Kind
+	{
+		_k_packed_sphere = 0,
+		_k_packed_wall,
+		_k_packed_triangle,
+		_k_packed_other,
+		_k_packed_kinds
+	};
+
+	// Where primitive id lives: _spheres[index] for a sphere, and so on
+	struct Prim_Ref
+	{
+		int		kind;
+		int		index;
+	};
+
+	template <class T> void	remove_from(std::vector<T> & items, int kind, int index);
+
+private:
+	std::vector<Prim_Ref>			_refs;						// by id
+	std::vector<Packed_Sphere>		_spheres;
+	std::vector<Packed_Wall>		_walls;
+	std::vector<Packed_Triangle>	_triangles;
+	std::vector<Basic_Primitive *>	_others;
+	std::vector<int>				_owners[_k_packed_kinds];	// per kind and index, the id
+};
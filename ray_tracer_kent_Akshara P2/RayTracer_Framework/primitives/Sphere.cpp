@@ -1,92 +1,94 @@
 ﻿#include "Sphere.h"
 #include "../common/math3d.h"
+#include "../common/simd_vector.h"
 #include <math.h>
 #include <algorithm>
 
-// Ray–Sphere intersection (geometric)
+// The tests are the Packed_Primitives ones, on this sphere's packed copy
 Intersect_Cond Sphere::intersection_check(const M3DVector3f start,
     const M3DVector3f dir,
     float& distance,
-    M3DVector3f intersection_p)
+    int& face)
 {
-    // L = center - origin
-    M3DVector3f L; m3dSubtractVectors3(L, _pos, start);
-    float tca = m3dDotProduct(L, dir);
-    if (tca < 0.0f) return _k_miss;
+    Packed_Sphere s; pack(s);
+    face = -1;
+    return hit_sphere(s, start, dir, distance) ? _k_hit : _k_miss;
+}
+
+void Sphere::fill_hit(const M3DVector3f start, const M3DVector3f dir, Hit_Record& hit) const
+{
+    hit_point(start, dir, hit.t, hit.point);
+    vec_normalize(Vec3(hit.point) - Vec3(_pos)).store(hit.normal);
+    hit.u = hit.v = 0.0f;
+}
 
-    float d2 = m3dDotProduct(L, L) - tca * tca;
-    if (d2 > _rad2) return _k_miss;
+bool Sphere::occluded(const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax)
+{
+    Packed_Sphere s; pack(s);
+    return sphere_occluded(s, start, dir, tmin, tmax);
+}
 
-    float thc = sqrtf(_rad2 - d2);
-    distance = tca - thc;
+int Sphere::intersection_check_packet(const Ray_Packet& packet, int mask, float* t)
+{
+    Packed_Sphere s; pack(s);
+    return hit_sphere_packet(s, packet, mask, t);
+}
 
-    // hit point
-    M3DVector3f step; m3dCopyVector3(step, dir); m3dScaleVector3(step, distance);
-    m3dAddVectors3(intersection_p, start, step);
-    return _k_hit;
+int Sphere::occluded_packet(const Ray_Packet& packet, int mask, float tmin, const float* tmax)
+{
+    Packed_Sphere s; pack(s);
+    return sphere_occluded_packet(s, packet, mask, tmin, tmax);
 }
 
 // Phong local shading
 void Sphere::shade(M3DVector3f view,
-    M3DVector3f intersect_p,
+    const Hit_Record& hit,
     const Light& sp_light,
     M3DVector3f am_light,
+    const Material& material,
     M3DVector3f color,
     bool shadow)
 {
-    const float ka = _ka;
-    const float kd = _kd;
-    const float ks = _ks;
-    const float shininess = 20.0f;
+    const float ka = material.ka;
+    const float kd = material.kd;
+    const float ks = material.ks;
+    const float shininess = material.shininess;
 
     // Base color
-    M3DVector3f base; m3dCopyVector3(base, _color);
+    Vec3 base(material.color);
 
     // Light data
-    M3DVector3f light_pos, light_col; sp_light.get_light(light_pos, light_col);
+    Vec3 light_pos, light_col; sp_light.get_light(light_pos, light_col);
 
     // Ambient
-    for (int i = 0; i < 3; ++i) color[i] = ka * am_light[i] * base[i];
+    Vec3 c = ka * Vec3(am_light) * base;
 
-    if (shadow) return;
+    if (shadow) { c.store(color); return; }
 
-    // Normal
-    M3DVector3f N; m3dSubtractVectors3(N, intersect_p, _pos); m3dNormalizeVector(N);
+    // Normal, from the hit record
+    Vec3 P(hit.point);
+    Vec3 N(hit.normal);
 
     // Light dir
-    M3DVector3f L; m3dSubtractVectors3(L, light_pos, intersect_p); m3dNormalizeVector(L);
-    float ndotl = std::max(0.0f, m3dDotProduct(N, L));
+    Vec3 L = vec_normalize(light_pos - P);
+    float ndotl = std::max(0.0f, vec_dot(N, L));
 
     // Diffuse
-    for (int i = 0; i < 3; ++i) color[i] += kd * ndotl * light_col[i] * base[i];
+    c += kd * ndotl * light_col * base;
 
     // View dir (from point to eye)
-    M3DVector3f V; m3dCopyVector3(V, view); m3dScaleVector3(V, -1.0f); m3dNormalizeVector(V);
+    Vec3 V = vec_normalize(-Vec3(view));
 
     // Reflection
-    float twoNL = 2.0f * m3dDotProduct(N, L);
-    M3DVector3f R; m3dLoadVector3(R, twoNL * N[0] - L[0], twoNL * N[1] - L[1], twoNL * N[2] - L[2]);
-    m3dNormalizeVector(R);
+    float twoNL = 2.0f * vec_dot(N, L);
+    Vec3 R = vec_normalize(twoNL * N - L);
 
-    float rdotv = std::max(0.0f, m3dDotProduct(R, V));
+    float rdotv = std::max(0.0f, vec_dot(R, V));
     float spec = ks * powf(rdotv, shininess);
-    for (int i = 0; i < 3; ++i) color[i] += spec * light_col[i];
+    c += spec * light_col;
 
     // Clamp
-    for (int i = 0; i < 3; ++i) { if (color[i] < 0.0f) color[i] = 0.0f; if (color[i] > 1.0f) color[i] = 1.0f; }
-}
-
-// (Required by pure virtual in base — not used for local shading path)
-void Sphere::get_reflect_direct(const M3DVector3f direct,
-    const M3DVector3f intersect_p,
-    M3DVector3f reflect_direct)
-{
-    // Simple perfect mirror reflection around normal
-    M3DVector3f N; m3dSubtractVectors3(N, intersect_p, _pos); m3dNormalizeVector(N);
-    float k = 2.0f * m3dDotProduct(direct, N);
-    M3DVector3f term; m3dCopyVector3(term, N); m3dScaleVector3(term, k);
-    m3dSubtractVectors3(reflect_direct, direct, term);
-    m3dNormalizeVector(reflect_direct);
+    vec_saturate(c).store(color);
 }
 
 bool Sphere::get_refract_direct(const M3DVector3f, const M3DVector3f, M3DVector3f, float, bool)
@@ -1,29 +1,25 @@
 #pragma once
 #include "../common/common.h"
 #include "Basic_Primitive.h"
+#include "Packed_Primitives.h"
 #include "../common/image_volume.h"
 #include <string>
 
 class Sphere: public Basic_Primitive
 {
 public:
-	Sphere(M3DVector3f pos, float rad, M3DVector3f color)
-	:Basic_Primitive(_k_sphere,  0.35)
+	Sphere(M3DVector3f pos, float rad, Material_Id material)
+	:Basic_Primitive(_k_sphere, material)
 	,_rad(rad)
-	,_texture(NULL)
 	{
 		_rad2 = rad* rad;
 		m3dCopyVector3(_pos,pos);
-		m3dCopyVector3(_color,color);
-		_kd = 0.6;
-		_ka = 0.2;
-		_ks = 0.2;
-
-		_ks2 = _ks;
-		_kt	 = 0.5;	
+	}
 
-		_ws  = 0.2;
-		_wt  = 0.5;	
+	// The look spheres always had, for Scene::add_material
+	static Material	default_material(const M3DVector3f color)
+	{
+		return Material(color, 0.2f, 0.6f, 0.2f, 20.0f, 0.5f, 0.2f, 0.5f, 0.35f);
 	}
 
 	~Sphere()
@@ -37,15 +33,26 @@ public:
 		m3dCopyVector3(pos,_pos);
 		rad = _rad;
 	}
+	// What Prim_Arrays stores for this sphere
+	void	pack(Packed_Sphere & s) const
+	{
+		m3dCopyVector3(s.center, _pos);
+		s.rad2 = _rad2;
+	}
 public:
-	Intersect_Cond	intersection_check(const M3DVector3f start, const M3DVector3f dir, float & distance, M3DVector3f intersection_p);
-	void	shade(M3DVector3f view,M3DVector3f intersect_p,const Light & sp_light, M3DVector3f am_light, M3DVector3f color,bool shadow);
-	void	get_properties(float & ks,float & kt, float & ws, float & wt) const { ks = _ks2; kt = _kt; ws = _ws; wt = _wt;	}
-	void	set_properties(float ks, float  kt, float  ws, float  wt) { _ks2 = _ks = ks; _kt = kt; _ws = ws; _wt = wt;	}
-	virtual void get_reflect_direct(const M3DVector3f direct,
-		const M3DVector3f intersect_p,
-		M3DVector3f reflect_direct);
-
+	Intersect_Cond	intersection_check(const M3DVector3f start, const M3DVector3f dir, float & distance, int & face);
+	void	fill_hit(const M3DVector3f start, const M3DVector3f dir, Hit_Record & hit) const;
+	bool	occluded(const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax);
+	int		intersection_check_packet(const Ray_Packet & packet, int mask, float * t);
+	int		occluded_packet(const Ray_Packet & packet, int mask, float tmin, const float * tmax);
+	void	shade(M3DVector3f view,const Hit_Record & hit,const Light & sp_light, M3DVector3f am_light, const Material & material, M3DVector3f color,bool shadow);
+	void	translate(const M3DVector3f offset) { m3dAddVectors3(_pos, _pos, offset); }
+	unsigned long long	hash(unsigned long long h) const { return fnv1a(&_rad, sizeof(_rad), fnv1a(_pos, sizeof(_pos), h)); }
+	void	get_bounds(Bounding_Box & box) const
+	{
+		box.reset();
+		for (int i = 0; i < 3; i++) { box.lo[i] = _pos[i] - _rad; box.hi[i] = _pos[i] + _rad; }
+	}
 	virtual bool get_refract_direct(const M3DVector3f direct,
 		const M3DVector3f intersect_p,
 		M3DVector3f refract_direct,
@@ -54,17 +61,6 @@ public:
 
 private:
 	M3DVector3f	_pos;
-	M3DVector3f	_color;
 	float		_rad;
 	float		_rad2;
-	float		_ws;
-	float		_wt;
-	float		_kt;
-	float		_ks2;
-
-	float		_kd;
-	float		_ks;
-	float		_ka;
-private:
-	Image *	_texture;
 };
@@ -1,79 +1,85 @@
 ﻿#include "Triangle.h"
 #include "../common/math3d.h"
+#include "../common/simd_vector.h"
 #include <math.h>
 #include <algorithm>
 
-// Compute face normal (unnormalized)
-void Triangle::normal(M3DVector3f n)
+// Edges and unit face normal, computed once per vertex change
+void Triangle::update_cache()
 {
-    M3DVector3f e1, e2;
-    m3dSubtractVectors3(e1, _v1, _v0);
-    m3dSubtractVectors3(e2, _v2, _v0);
-    m3dCrossProduct(n, e1, e2);
-    m3dNormalizeVector(n);
+    m3dSubtractVectors3(_e1, _v1, _v0);
+    m3dSubtractVectors3(_e2, _v2, _v0);
+    m3dCrossProduct(_n, _e1, _e2);
+    m3dNormalizeVector(_n);
 }
 
-// Möller–Trumbore ray-triangle
+// Möller–Trumbore, the Packed_Primitives tests on this triangle's packed copy
 Intersect_Cond Triangle::intersection_check(const M3DVector3f start, const M3DVector3f dir,
-    float& distance, M3DVector3f intersection_p)
+    float& distance, int& face)
 {
-    const float EPS = 1e-6f;
-    M3DVector3f e1, e2;
-    m3dSubtractVectors3(e1, _v1, _v0);
-    m3dSubtractVectors3(e2, _v2, _v0);
-
-    M3DVector3f pvec; m3dCrossProduct(pvec, dir, e2);
-    float det = m3dDotProduct(e1, pvec);
-    if (fabs(det) < EPS) return _k_miss;
+    Packed_Triangle tri; pack(tri);
+    face = -1;
+    return hit_triangle(tri, start, dir, distance) ? _k_hit : _k_miss;
+}
 
-    float invDet = 1.0f / det;
-    M3DVector3f tvec; m3dSubtractVectors3(tvec, start, _v0);
-    float u = m3dDotProduct(tvec, pvec) * invDet;
-    if (u < 0.0f || u > 1.0f) return _k_miss;
+void Triangle::fill_hit(const M3DVector3f start, const M3DVector3f dir, Hit_Record& hit) const
+{
+    hit_point(start, dir, hit.t, hit.point);
+    m3dCopyVector3(hit.normal, _n);
+    triangle_barycentrics(_v0, _e1, _e2, hit.point, hit.u, hit.v);
+}
 
-    M3DVector3f qvec; m3dCrossProduct(qvec, tvec, e1);
-    float v = m3dDotProduct(dir, qvec) * invDet;
-    if (v < 0.0f || u + v > 1.0f) return _k_miss;
+bool Triangle::occluded(const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax)
+{
+    Packed_Triangle tri; pack(tri);
+    float t;
+    return hit_triangle(tri, start, dir, t) && t >= tmin && t <= tmax;
+}
 
-    distance = m3dDotProduct(e2, qvec) * invDet;
-    if (distance < EPS) return _k_miss;
+int Triangle::intersection_check_packet(const Ray_Packet& packet, int mask, float* t)
+{
+    Packed_Triangle tri; pack(tri);
+    return hit_triangle_packet(tri, packet, mask, t);
+}
 
-    M3DVector3f step; m3dCopyVector3(step, dir); m3dScaleVector3(step, distance);
-    m3dAddVectors3(intersection_p, start, step);
-    return _k_hit;
+int Triangle::occluded_packet(const Ray_Packet& packet, int mask, float tmin, const float* tmax)
+{
+    Packed_Triangle tri; pack(tri);
+    float t[RT_PACKET_SIZE];
+    return packet_in_range(hit_triangle_packet(tri, packet, mask, t), t, tmin, tmax);
 }
 
-// Flat gray Phong shading (used for wall triangles if needed)
+// Flat Phong shading (used for wall triangles if needed)
 void Triangle::shade(M3DVector3f view,
-    M3DVector3f intersect_p,
+    const Hit_Record& hit,
     const Light& sp_light,
     M3DVector3f am_light,
+    const Material& material,
     M3DVector3f color,
     bool shadow)
 {
-    float ka = 0.2f, kd = 0.7f, ks = 0.3f, shininess = 12.0f;
-    M3DVector3f base; m3dLoadVector3(base, 0.8f, 0.8f, 0.8f);
+    float ka = material.ka, kd = material.kd, ks = material.ks, shininess = material.shininess;
+    Vec3 base(material.color);
 
-    for (int i = 0; i < 3; ++i) color[i] = ka * am_light[i] * base[i];
-    if (shadow) return;
+    Vec3 c = ka * Vec3(am_light) * base;
+    if (shadow) { c.store(color); return; }
 
-    M3DVector3f N; normal(N);
+    Vec3 N(hit.normal);
 
-    M3DVector3f L, lpos, lcol; sp_light.get_light(lpos, lcol);
-    m3dSubtractVectors3(L, lpos, intersect_p); m3dNormalizeVector(L);
+    Vec3 lpos, lcol; sp_light.get_light(lpos, lcol);
+    Vec3 L = vec_normalize(lpos - Vec3(hit.point));
 
-    float ndotl = std::max(0.0f, m3dDotProduct(N, L));
-    for (int i = 0; i < 3; ++i) color[i] += kd * ndotl * lcol[i] * base[i];
+    float ndotl = std::max(0.0f, vec_dot(N, L));
+    c += kd * ndotl * lcol * base;
 
-    M3DVector3f V; m3dCopyVector3(V, view); m3dScaleVector3(V, -1.0f); m3dNormalizeVector(V);
+    Vec3 V = vec_normalize(-Vec3(view));
 
-    float twoNL = 2.0f * m3dDotProduct(N, L);
-    M3DVector3f R; m3dLoadVector3(R, twoNL * N[0] - L[0], twoNL * N[1] - L[1], twoNL * N[2] - L[2]);
-    m3dNormalizeVector(R);
+    float twoNL = 2.0f * vec_dot(N, L);
+    Vec3 R = vec_normalize(twoNL * N - L);
 
-    float rdotv = std::max(0.0f, m3dDotProduct(R, V));
+    float rdotv = std::max(0.0f, vec_dot(R, V));
     float spec = ks * powf(rdotv, shininess);
-    for (int i = 0; i < 3; ++i) color[i] += spec * lcol[i];
+    c += spec * lcol;
 
-    for (int i = 0; i < 3; ++i) { if (color[i] < 0.0f) color[i] = 0.0f; if (color[i] > 1.0f) color[i] = 1.0f; }
+    vec_saturate(c).store(color);
 }
@@ -1,15 +1,19 @@
 ﻿#pragma once
 #include "Basic_Primitive.h"
+#include "Triangle_Soa.h"
+#include "Packed_Primitives.h"
 
 class Triangle : public Basic_Primitive
 {
 public:
-    Triangle(M3DVector3f v0, M3DVector3f v1, M3DVector3f v2)
-        : Basic_Primitive(_k_triangle)
+    // Material 0 is the default flat gray
+    Triangle(M3DVector3f v0, M3DVector3f v1, M3DVector3f v2, Material_Id material = 0)
+        : Basic_Primitive(_k_triangle, material)
     {
         m3dCopyVector3(_v0, v0);
         m3dCopyVector3(_v1, v1);
         m3dCopyVector3(_v2, v2);
+        update_cache();
     }
     ~Triangle() {}
 
@@ -19,20 +23,47 @@ public:
     }
 
     Intersect_Cond intersection_check(const M3DVector3f start, const M3DVector3f dir,
-        float& distance, M3DVector3f intersection_p);
-    void normal(M3DVector3f n);
+        float& distance, int& face);
+    void fill_hit(const M3DVector3f start, const M3DVector3f dir, Hit_Record& hit) const;
+    bool occluded(const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax);
+    int intersection_check_packet(const Ray_Packet& packet, int mask, float* t);
+    int occluded_packet(const Ray_Packet& packet, int mask, float tmin, const float* tmax);
+    inline void normal(M3DVector3f n) const { m3dCopyVector3(n, _n); }
 
-    // Local Phong shade for a flat triangle (gray)
-    void shade(M3DVector3f view, M3DVector3f intersect_p, const Light& sp_light,
-        M3DVector3f am_light, M3DVector3f color, bool shadow);
+    // What Prim_Arrays stores for this triangle
+    inline void pack(Packed_Triangle& tri) const
+    {
+        m3dCopyVector3(tri.v0, _v0); m3dCopyVector3(tri.e1, _e1); m3dCopyVector3(tri.e2, _e2);
+    }
+
+    // Local Phong shade for a flat triangle
+    void shade(M3DVector3f view, const Hit_Record& hit, const Light& sp_light,
+        M3DVector3f am_light, const Material& material, M3DVector3f color, bool shadow);
+
+    void translate(const M3DVector3f offset)
+    {
+        // Edges and normal are unchanged by a translation
+        m3dAddVectors3(_v0, _v0, offset); m3dAddVectors3(_v1, _v1, offset); m3dAddVectors3(_v2, _v2, offset);
+    }
 
-    void get_reflect_direct(const M3DVector3f, const M3DVector3f, M3DVector3f) {}
+    void get_bounds(Bounding_Box& box) const
+    {
+        box.reset();
+        box.extend(_v0); box.extend(_v1); box.extend(_v2);
+    }
 
-    void get_properties(float& ks, float& kt, float& ws, float& wt) const
+    unsigned long long hash(unsigned long long h) const
     {
-        ks = 0.2f; kt = 0.0f; ws = 0.0f; wt = 0.0f;
+        h = fnv1a(_v0, sizeof(_v0), h);
+        h = fnv1a(_v1, sizeof(_v1), h);
+        return fnv1a(_v2, sizeof(_v2), h);
     }
 
+private:
+    void update_cache();
+
 private:
     M3DVector3f _v0, _v1, _v2;
+    M3DVector3f _e1, _e2;   // v1 - v0, v2 - v0
+    M3DVector3f _n;         // unit normal, e1 x e2
 };
@@ -0,0 +1,275 @@
+#include "Triangle_Mesh.h"
+#include "Packed_Primitives.h"
+#include "../common/math3d.h"
+#include "../common/simd_vector.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+Triangle_Mesh::Triangle_Mesh(const std::vector<float> & positions, const std::vector<unsigned int> & indices, Material_Id material)
+    : Basic_Primitive(_k_mesh, material)
+    , _positions(positions)
+    , _indices(indices)
+{
+    build_blas();
+}
+
+void Triangle_Mesh::build_blas()
+{
+    int n = get_triangle_count();
+    std::vector<Bounding_Box> boxes(n);
+    _bounds.reset();
+    _triangles.clear();
+    _triangles.reserve(n);
+    for (int i = 0; i < n; ++i)
+    {
+        _triangles.add(vertex(i, 0), vertex(i, 1), vertex(i, 2));
+        _triangles.get_bounds(i, boxes[i]);
+        _bounds.extend(boxes[i]);
+    }
+    _blas.build(boxes);
+#if RT_BVH_WIDTH > 2
+    // Only the wide tree is traversed; drop the binary one it was collapsed from
+    _wide_blas.build(_blas);
+    _blas.clear();
+#endif
+}
+
+void Triangle_Mesh::translate(const M3DVector3f offset)
+{
+    for (size_t i = 0; i < _positions.size(); i += 3)
+        m3dAddVectors3(&_positions[i], &_positions[i], offset);
+    build_blas();
+}
+
+unsigned long long Triangle_Mesh::hash(unsigned long long h) const
+{
+    if (!_positions.empty()) h = fnv1a(&_positions[0], _positions.size() * sizeof(float), h);
+    if (!_indices.empty()) h = fnv1a(&_indices[0], _indices.size() * sizeof(unsigned int), h);
+    return h;
+}
+
+// BLAS leaf callbacks
+struct Mesh_Closest_Test
+{
+    const float*            start;
+    const float*            dir;
+    const Triangle_Soa*     triangles;
+    int                     best;
+
+    inline bool operator()(int tri, float& tmax)
+    {
+        float t;
+        if (!triangles->intersect(tri, start, dir, t))
+            return false;
+        if (t < tmax || (t == tmax && tri < best))
+        {
+            tmax = t;
+            best = tri;
+            return true;
+        }
+        return false;
+    }
+};
+
+struct Mesh_Occlusion_Test
+{
+    const float*            start;
+    const float*            dir;
+    const Triangle_Soa*     triangles;
+    float                   tmin;
+    float                   tmax;
+
+    inline bool operator()(int tri)
+    {
+        float t;
+        return triangles->intersect(tri, start, dir, t) && t >= tmin && t <= tmax;
+    }
+};
+
+int Triangle_Mesh::closest_triangle(const M3DVector3f start, const M3DVector3f dir, float & distance) const
+{
+    if (_indices.empty()) return -1;
+
+    Mesh_Closest_Test test = { start, dir, &_triangles, -1 };
+    float tmax = 1e30f;
+#if RT_BVH_WIDTH > 2
+    _wide_blas.closest_hit(start, dir, tmax, test);
+#else
+    _blas.closest_hit(start, dir, tmax, test);
+#endif
+    if (test.best >= 0) distance = tmax;
+    return test.best;
+}
+
+Intersect_Cond Triangle_Mesh::intersection_check(const M3DVector3f start, const M3DVector3f dir,
+    float & distance, int & face)
+{
+    float t = 0.0f;
+    int tri = closest_triangle(start, dir, t);
+    if (tri < 0) return _k_miss;
+
+    distance = t;
+    face = tri;
+    return _k_hit;
+}
+
+// The face comes from intersection_check, so nothing is traced again here
+void Triangle_Mesh::fill_hit(const M3DVector3f start, const M3DVector3f dir, Hit_Record & hit) const
+{
+    hit_point(start, dir, hit.t, hit.point);
+    triangle_normal(hit.face, hit.normal);
+
+    M3DVector3f e1, e2;
+    const float * v0 = vertex(hit.face, 0);
+    m3dSubtractVectors3(e1, vertex(hit.face, 1), v0);
+    m3dSubtractVectors3(e2, vertex(hit.face, 2), v0);
+    triangle_barycentrics(v0, e1, e2, hit.point, hit.u, hit.v);
+}
+
+bool Triangle_Mesh::occluded(const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax)
+{
+    if (_indices.empty()) return false;
+
+    Mesh_Occlusion_Test test = { start, dir, &_triangles, tmin, tmax };
+#if RT_BVH_WIDTH > 2
+    return _wide_blas.any_hit(start, dir, tmax, test);
+#else
+    return _blas.any_hit(start, dir, tmax, test);
+#endif
+}
+
+void Triangle_Mesh::triangle_normal(int tri, M3DVector3f n) const
+{
+    _triangles.get_normal(tri, n);
+}
+
+// Flat Phong shading with the face normal facing the viewer
+void Triangle_Mesh::shade(M3DVector3f view,
+    const Hit_Record & hit,
+    const Light & sp_light,
+    M3DVector3f am_light,
+    const Material & material,
+    M3DVector3f color,
+    bool shadow)
+{
+    const float shininess = material.shininess;
+
+    Vec3 base(material.color);
+    Vec3 c = material.ka * Vec3(am_light) * base;
+    c.store(color);
+    if (shadow) return;
+
+    Vec3 N(hit.normal);
+    Vec3 v(view);
+    if (vec_dot(N, v) > 0.0f) N = -N;
+
+    Vec3 lpos, lcol; sp_light.get_light(lpos, lcol);
+    Vec3 L = vec_normalize(lpos - Vec3(hit.point));
+
+    float ndotl = std::max(0.0f, vec_dot(N, L));
+    c += material.kd * ndotl * lcol * base;
+
+    Vec3 V = vec_normalize(-v);
+
+    float twoNL = 2.0f * vec_dot(N, L);
+    Vec3 R = vec_normalize(twoNL * N - L);
+
+    float rdotv = std::max(0.0f, vec_dot(R, V));
+    float spec = material.ks * powf(rdotv, shininess);
+    c += spec * lcol;
+
+    vec_saturate(c).store(color);
+}
+
+// One whole line, however long, without the line break; false at the end of the file
+static bool read_line(FILE * fp, std::string & line)
+{
+    char chunk[512];
+    line.clear();
+    while (fgets(chunk, sizeof(chunk), fp) != NULL)
+    {
+        line += chunk;
+        if (line[line.size() - 1] == '\n')
+        {
+            line.erase(line.size() - 1);
+            return true;
+        }
+    }
+    return !line.empty();
+}
+
+Triangle_Mesh * Triangle_Mesh::load_obj(const std::string & file_name, Material_Id material)
+{
+    FILE * fp = fopen(file_name.c_str(), "r");
+    if (fp == NULL)
+    {
+        printf("Can't open mesh file %s.\n", file_name.c_str());
+        return NULL;
+    }
+
+    std::vector<float> positions;
+    std::vector<unsigned int> indices;
+    std::vector<unsigned int> corners;
+    std::string line;
+    int line_number = 0;
+    while (read_line(fp, line))
+    {
+        ++line_number;
+        if (line.size() < 2) continue;
+        if (line[0] == 'v' && line[1] == ' ')
+        {
+            float x, y, z;
+            if (sscanf(line.c_str() + 2, "%f %f %f", &x, &y, &z) == 3)
+            {
+                positions.push_back(x); positions.push_back(y); positions.push_back(z);
+            }
+        }
+        else if (line[0] == 'f' && line[1] == ' ')
+        {
+            // Face corners look like "i", "i/t", "i//n" or "i/t/n"; negative i counts from the end
+            corners.clear();
+            const char * p = line.c_str() + 2;
+            bool bad = false;
+            for (;;)
+            {
+                while (*p == ' ' || *p == '\t' || *p == '\r') ++p;
+                if (*p == '\0') break;
+                char * end;
+                long id = strtol(p, &end, 10);
+                if (id < 0) id += (long)(positions.size() / 3) + 1;
+                if (end == p || id <= 0) { bad = true; break; }
+                corners.push_back((unsigned int)(id - 1));
+                for (p = end; *p != '\0' && *p != ' ' && *p != '\t' && *p != '\r'; ++p) {}
+            }
+
+            // Dropping a corner would change the fan, so the face cannot be read
+            if (bad || corners.size() < 3)
+            {
+                printf("Mesh file %s has a bad face at line %d.\n", file_name.c_str(), line_number);
+                fclose(fp);
+                return NULL;
+            }
+            for (size_t k = 2; k < corners.size(); ++k)
+            {
+                indices.push_back(corners[0]); indices.push_back(corners[k - 1]); indices.push_back(corners[k]);
+            }
+        }
+    }
+    fclose(fp);
+
+    unsigned int vertex_count = (unsigned int)(positions.size() / 3);
+    for (size_t i = 0; i < indices.size(); ++i)
+    {
+        if (indices[i] >= vertex_count)
+        {
+            printf("Mesh file %s references a missing vertex.\n", file_name.c_str());
+            return NULL;
+        }
+    }
+
+    printf("Read mesh %s: %u vertices, %u triangles\n", file_name.c_str(), vertex_count, (unsigned int)(indices.size() / 3));
+    return new Triangle_Mesh(positions, indices, material);
+}
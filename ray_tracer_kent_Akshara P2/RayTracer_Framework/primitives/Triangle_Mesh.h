@@ -0,0 +1,57 @@
+#pragma once
+#include "Basic_Primitive.h"
+#include "Triangle_Soa.h"
+#include "../accel/BVH.h"
+#include "../accel/Wide_BVH.h"
+#include <vector>
+#include <string>
+
+// Indexed triangle mesh traced as a single primitive. Vertices are shared
+// through one position buffer and triangles are three indices into it. For
+// tracing, every triangle also keeps vertex 0, its edges and its normal in a
+// Triangle_Soa (48 bytes). The mesh carries its own bottom-level BVH over the
+// triangles; the scene BVH only sees its box.
+class Triangle_Mesh : public Basic_Primitive
+{
+public:
+	// positions: x,y,z per vertex, indices: three vertex indices per triangle
+	Triangle_Mesh(const std::vector<float> & positions, const std::vector<unsigned int> & indices, Material_Id material);
+	~Triangle_Mesh() {}
+
+	// Minimal Wavefront OBJ reader (v and f records, polygons fanned into triangles)
+	static Triangle_Mesh *	load_obj(const std::string & file_name, Material_Id material);
+
+	// The look meshes always had, for Scene::add_material
+	static Material	default_material(const M3DVector3f color) { return Material(color, 0.2f, 0.6f, 0.2f, 10.0f); }
+
+public:
+	Intersect_Cond	intersection_check(const M3DVector3f start, const M3DVector3f dir, float & distance, int & face);
+	void	fill_hit(const M3DVector3f start, const M3DVector3f dir, Hit_Record & hit) const;
+	bool	occluded(const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax);
+	void	shade(M3DVector3f view, const Hit_Record & hit, const Light & sp_light, M3DVector3f am_light, const Material & material, M3DVector3f color, bool shadow);
+	void	get_bounds(Bounding_Box & box) const { box = _bounds; }
+	// Moves every vertex and rebuilds the BLAS; wrap the mesh in an Instance
+	// to move it cheaply instead
+	void	translate(const M3DVector3f offset);
+	unsigned long long	hash(unsigned long long h) const;
+
+	inline int	get_triangle_count() const { return (int)(_indices.size() / 3); }
+
+	// Closest triangle along the ray, or -1
+	int		closest_triangle(const M3DVector3f start, const M3DVector3f dir, float & distance) const;
+	void	triangle_normal(int tri, M3DVector3f n) const;
+
+private:
+	void	build_blas();
+	inline const float *	vertex(int tri, int corner) const { return &_positions[3 * _indices[3 * tri + corner]]; }
+
+private:
+	std::vector<float>			_positions;
+	std::vector<unsigned int>	_indices;
+	Triangle_Soa				_triangles;	// precomputed copy of the above, by triangle index
+	Bounding_Box				_bounds;
+	BVH							_blas;
+#if RT_BVH_WIDTH > 2
+	Wide_BVH					_wide_blas;
+#endif
+};
@@ -0,0 +1,138 @@
+#include "Triangle_Soa.h"
+#include <float.h>
+
+int Triangle_Soa::add(const M3DVector3f v0, const M3DVector3f v1, const M3DVector3f v2)
+{
+    int i = size();
+    for (int c = 0; c < 3; ++c)
+    {
+        _v0[c].push_back(0.0f);
+        _e1[c].push_back(0.0f);
+        _e2[c].push_back(0.0f);
+        _n[c].push_back(0.0f);
+    }
+    set(i, v0, v1, v2);
+    return i;
+}
+
+void Triangle_Soa::set(int i, const M3DVector3f v0, const M3DVector3f v1, const M3DVector3f v2)
+{
+    M3DVector3f e1, e2, n;
+    m3dSubtractVectors3(e1, v1, v0);
+    m3dSubtractVectors3(e2, v2, v0);
+    m3dCrossProduct(n, e1, e2);
+    m3dNormalizeVector(n);
+    for (int c = 0; c < 3; ++c)
+    {
+        _v0[c][i] = v0[c];
+        _e1[c][i] = e1[c];
+        _e2[c][i] = e2[c];
+        _n[c][i] = n[c];
+    }
+}
+
+// Edges and normals do not change under translation
+void Triangle_Soa::translate(const M3DVector3f offset)
+{
+    for (int c = 0; c < 3; ++c)
+        for (size_t i = 0; i < _v0[c].size(); ++i)
+            _v0[c][i] += offset[c];
+}
+
+void Triangle_Soa::reserve(int count)
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        _v0[c].reserve(count);
+        _e1[c].reserve(count);
+        _e2[c].reserve(count);
+        _n[c].reserve(count);
+    }
+}
+
+void Triangle_Soa::clear()
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        _v0[c].clear();
+        _e1[c].clear();
+        _e2[c].clear();
+        _n[c].clear();
+    }
+}
+
+void Triangle_Soa::get_vertex(int i, M3DVector3f v0, M3DVector3f v1, M3DVector3f v2) const
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        v0[c] = _v0[c][i];
+        v1[c] = _v0[c][i] + _e1[c][i];
+        v2[c] = _v0[c][i] + _e2[c][i];
+    }
+}
+
+void Triangle_Soa::get_bounds(int i, Bounding_Box & box) const
+{
+    M3DVector3f v0, v1, v2;
+    get_vertex(i, v0, v1, v2);
+    box.reset();
+    box.extend(v0);
+    box.extend(v1);
+    box.extend(v2);
+}
+
+// Möller–Trumbore written lane by lane: every triangle runs the same
+// arithmetic and the accept test is a single select at the end
+void Triangle_Soa::intersect(int first, int count, const M3DVector3f start, const M3DVector3f dir, float * t) const
+{
+    const float EPS = 1e-6f;
+    const float * v0x = &_v0[0][first]; const float * v0y = &_v0[1][first]; const float * v0z = &_v0[2][first];
+    const float * e1x = &_e1[0][first]; const float * e1y = &_e1[1][first]; const float * e1z = &_e1[2][first];
+    const float * e2x = &_e2[0][first]; const float * e2y = &_e2[1][first]; const float * e2z = &_e2[2][first];
+    const float sx = start[0], sy = start[1], sz = start[2];
+    const float dx = dir[0], dy = dir[1], dz = dir[2];
+
+    for (int k = 0; k < count; ++k)
+    {
+        float px = dy * e2z[k] - dz * e2y[k];
+        float py = dz * e2x[k] - dx * e2z[k];
+        float pz = dx * e2y[k] - dy * e2x[k];
+        float det = e1x[k] * px + e1y[k] * py + e1z[k] * pz;
+        float inv_det = 1.0f / det;
+
+        float tx = sx - v0x[k], ty = sy - v0y[k], tz = sz - v0z[k];
+        float u = (tx * px + ty * py + tz * pz) * inv_det;
+
+        float qx = ty * e1z[k] - tz * e1y[k];
+        float qy = tz * e1x[k] - tx * e1z[k];
+        float qz = tx * e1y[k] - ty * e1x[k];
+        float v = (dx * qx + dy * qy + dz * qz) * inv_det;
+        float d = (e2x[k] * qx + e2y[k] * qy + e2z[k] * qz) * inv_det;
+
+        bool hit = fabs(det) >= EPS && u >= 0.0f && u <= 1.0f && v >= 0.0f && u + v <= 1.0f && d >= EPS;
+        t[k] = hit ? d : FLT_MAX;
+    }
+}
+
+int Triangle_Soa::closest(int first, int count, const M3DVector3f start, const M3DVector3f dir, float & distance) const
+{
+    const int k_batch = 16;
+    float t[k_batch];
+    int best = -1;
+    float best_t = FLT_MAX;
+    for (int base = first; base < first + count; base += k_batch)
+    {
+        int n = first + count - base < k_batch ? first + count - base : k_batch;
+        intersect(base, n, start, dir, t);
+        for (int k = 0; k < n; ++k)
+        {
+            if (t[k] < best_t)
+            {
+                best_t = t[k];
+                best = base + k;
+            }
+        }
+    }
+    if (best >= 0) distance = best_t;
+    return best;
+}
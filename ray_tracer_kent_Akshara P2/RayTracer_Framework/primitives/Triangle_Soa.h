@@ -0,0 +1,121 @@
+#pragma once
+#include "../common/math3d.h"
+#include "../common/bounding_box.h"
+#include "../common/ray_packet.h"
+#include <vector>
+
+// Möller–Trumbore with the edges precomputed (e1 = v1 - v0, e2 = v2 - v0).
+// Writes t and returns true for a hit at t >= 1e-6.
+inline bool ray_triangle(const M3DVector3f v0, const M3DVector3f e1, const M3DVector3f e2,
+	const M3DVector3f start, const M3DVector3f dir, float & t)
+{
+	const float EPS = 1e-6f;
+	M3DVector3f pvec; m3dCrossProduct(pvec, dir, e2);
+	float det = m3dDotProduct(e1, pvec);
+	if (fabs(det) < EPS) return false;
+
+	float inv_det = 1.0f / det;
+	M3DVector3f tvec; m3dSubtractVectors3(tvec, start, v0);
+	float u = m3dDotProduct(tvec, pvec) * inv_det;
+	M3DVector3f qvec; m3dCrossProduct(qvec, tvec, e1);
+	float v = m3dDotProduct(dir, qvec) * inv_det;
+	float d = m3dDotProduct(e2, qvec) * inv_det;
+	if (u < 0.0f || u > 1.0f || v < 0.0f || u + v > 1.0f || d < EPS) return false;
+	t = d;
+	return true;
+}
+
+// Barycentric weights of v1 and v2 at p, a point in the triangle's plane:
+// the u, v of ray_triangle, recovered from the hit point once the closest
+// hit is known
+inline void triangle_barycentrics(const M3DVector3f v0, const M3DVector3f e1, const M3DVector3f e2,
+	const M3DVector3f p, float & u, float & v)
+{
+	M3DVector3f q; m3dSubtractVectors3(q, p, v0);
+	float d11 = m3dDotProduct(e1, e1), d12 = m3dDotProduct(e1, e2), d22 = m3dDotProduct(e2, e2);
+	float q1 = m3dDotProduct(q, e1), q2 = m3dDotProduct(q, e2);
+	float det = d11 * d22 - d12 * d12;
+	if (det == 0.0f) { u = v = 0.0f; return; }
+	float inv_det = 1.0f / det;
+	u = (d22 * q1 - d12 * q2) * inv_det;
+	v = (d11 * q2 - d12 * q1) * inv_det;
+}
+
+// ray_triangle on every lane of a packet: returns the lanes of 'mask' that
+// hit and writes their distances to t
+inline int ray_triangle_packet(const M3DVector3f v0, const M3DVector3f e1, const M3DVector3f e2,
+	const Ray_Packet & packet, int mask, float * t)
+{
+	const Packet_Float EPS(1e-6f);
+	Packet_Float org[3], dir[3], pe1[3], pe2[3];
+	packet.load_origin(org);
+	packet.load_direction(dir);
+	for (int i = 0; i < 3; i++) { pe1[i] = Packet_Float(e1[i]); pe2[i] = Packet_Float(e2[i]); }
+
+	Packet_Float pvec[3]; packet_cross(pvec, dir, pe2);
+	Packet_Float det = packet_dot(pe1, pvec);
+	Packet_Float inv_det = Packet_Float(1.0f) / det;
+	Packet_Float tvec[3];
+	for (int i = 0; i < 3; i++) tvec[i] = org[i] - Packet_Float(v0[i]);
+	Packet_Float u = packet_dot(tvec, pvec) * inv_det;
+	Packet_Float qvec[3]; packet_cross(qvec, tvec, pe1);
+	Packet_Float v = packet_dot(dir, qvec) * inv_det;
+	Packet_Float d = packet_dot(pe2, qvec) * inv_det;
+
+	const Packet_Float zero(0.0f), one(1.0f);
+	int hit = mask & packet_mask((packet_abs(det) >= EPS) & (u >= zero) & (u <= one) & (v >= zero) & (u + v <= one) & (d >= EPS));
+	if (hit) d.store(t);
+	return hit;
+}
+
+// Triangles stored as structure-of-arrays with vertex 0, both edges and the
+// unit normal computed once, so a ray test is a handful of multiply-adds and
+// shading reads the normal instead of rebuilding it. intersect() over a range
+// has no data-dependent branches and vectorizes across the triangles.
+class Triangle_Soa
+{
+public:
+	Triangle_Soa() {}
+	~Triangle_Soa() {}
+
+	int		add(const M3DVector3f v0, const M3DVector3f v1, const M3DVector3f v2);
+	void	set(int i, const M3DVector3f v0, const M3DVector3f v1, const M3DVector3f v2);
+	void	translate(const M3DVector3f offset);
+	void	reserve(int count);
+	void	clear();
+
+	inline int	size() const { return (int)_v0[0].size(); }
+
+	void	get_vertex(int i, M3DVector3f v0, M3DVector3f v1, M3DVector3f v2) const;
+	void	get_bounds(int i, Bounding_Box & box) const;
+	inline void get_normal(int i, M3DVector3f n) const { n[0] = _n[0][i]; n[1] = _n[1][i]; n[2] = _n[2][i]; }
+
+	// One triangle; t is only written on a hit
+	inline bool intersect(int i, const M3DVector3f start, const M3DVector3f dir, float & t) const
+	{
+		M3DVector3f v0 = { _v0[0][i], _v0[1][i], _v0[2][i] };
+		M3DVector3f e1 = { _e1[0][i], _e1[1][i], _e1[2][i] };
+		M3DVector3f e2 = { _e2[0][i], _e2[1][i], _e2[2][i] };
+		return ray_triangle(v0, e1, e2, start, dir, t);
+	}
+
+	inline int intersect_packet(int i, const Ray_Packet & packet, int mask, float * t) const
+	{
+		M3DVector3f v0 = { _v0[0][i], _v0[1][i], _v0[2][i] };
+		M3DVector3f e1 = { _e1[0][i], _e1[1][i], _e1[2][i] };
+		M3DVector3f e2 = { _e2[0][i], _e2[1][i], _e2[2][i] };
+		return ray_triangle_packet(v0, e1, e2, packet, mask, t);
+	}
+
+	// Triangles [first, first + count): t[k] is the hit distance or FLT_MAX
+	void	intersect(int first, int count, const M3DVector3f start, const M3DVector3f dir, float * t) const;
+
+	// Closest of triangles [first, first + count), or -1; ties go to the lower index
+	int		closest(int first, int count, const M3DVector3f start, const M3DVector3f dir, float & distance) const;
+
+private:
+	std::vector<float>	_v0[3];
+	std::vector<float>	_e1[3];
+	std::vector<float>	_e2[3];
+	std::vector<float>	_n[3];
+};
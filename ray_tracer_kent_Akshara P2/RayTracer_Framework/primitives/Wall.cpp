@@ -1,6 +1,6 @@
 #include "Wall.h"
-#include "Triangle.h"
 #include "../common/math3d.h"
+#include "../common/simd_vector.h"
 #include <math.h>
 #include <algorithm>
 
@@ -8,115 +8,180 @@ void Wall::load_texture(std::string) {
     // Texture support not used in this project
 }
 
-void Wall::texture_color(M3DVector3f, M3DVector3f color) {
-    // For now, fallback to solid color (texture optional)
-    m3dCopyVector3(color, _color);
+void Wall::texture_color(const Hit_Record& hit, const Material& material, M3DVector3f color) {
+    // The hit record already carries the position across the wall
+    get_texel(hit.u, hit.v, material, color);
 }
 
-void Wall::get_texel(float, float, M3DVector3f color) {
+void Wall::get_texel(float, float, const Material& material, M3DVector3f color) {
     // Texture not used, so apply flat color
-    m3dCopyVector3(color, _color);
+    m3dCopyVector3(color, material.color);
 }
 
-// Intersection: check both triangles and pick nearest
-Intersect_Cond Wall::intersection_check(const M3DVector3f start, const M3DVector3f dir,
-    float& distance, M3DVector3f intersection_p)
+// Pick the cheapest exact test for this quad. Room walls are axis-aligned
+// rectangles; other rectangles and parallelograms are handled in the wall's
+// own (u, v) frame; only a general quad keeps the two triangle tests.
+void Wall::setup_quad(const M3DVector3f left_up, const M3DVector3f right_up,
+    const M3DVector3f right_down, const M3DVector3f left_down)
 {
-    float d1 = 0.0f, d2 = 0.0f;
-    M3DVector3f p1, p2;
+    Bounding_Box rect;
+    rect.extend(left_up);
+    rect.extend(right_up);
+    rect.extend(right_down);
+    rect.extend(left_down);
+    m3dCopyVector3(_quad.lo, rect.lo);
+    m3dCopyVector3(_quad.hi, rect.hi);
+
+    // The two halves, (left_up, right_up, left_down) and (right_up, right_down, left_down)
+    m3dCopyVector3(_quad.half[0].v0, left_up);
+    m3dSubtractVectors3(_quad.half[0].e1, right_up, left_up);
+    m3dSubtractVectors3(_quad.half[0].e2, left_down, left_up);
+    m3dCopyVector3(_quad.half[1].v0, right_up);
+    m3dSubtractVectors3(_quad.half[1].e1, right_down, right_up);
+    m3dSubtractVectors3(_quad.half[1].e2, left_down, right_up);
+    m3dCopyVector3(_quad.origin, left_down);
+
+    _quad.axis = _is_yz ? 0 : (_is_xz ? 1 : (_is_xy ? 2 : -1));
+    if (_quad.axis >= 0)
+        _quad.plane = left_down[_quad.axis];
+
+    // Both halves share the first one's unit normal, e1 x e2
+    M3DVector3f n;
+    m3dCrossProduct(n, _quad.half[0].e1, _quad.half[0].e2);
+    m3dNormalizeVector(n);
+    m3dCopyVector3(_quad.normal, n);
+
+    // Parallelogram when the top edge matches the bottom edge
+    M3DVector3f eu, ev, top;
+    m3dSubtractVectors3(eu, right_down, left_down);
+    m3dSubtractVectors3(ev, left_up, left_down);
+    m3dSubtractVectors3(top, right_up, left_up);
+    if (_quad.axis < 0)
+        _quad.plane = m3dDotProduct(n, left_down);
+
+    float tol = 1e-4f * (m3dGetVectorLength(eu) + m3dGetVectorLength(ev));
+    _quad.parallelogram = fabs(top[0] - eu[0]) <= tol && fabs(top[1] - eu[1]) <= tol && fabs(top[2] - eu[2]) <= tol;
+    if (!_quad.parallelogram) return;
+
+    // u_axis is perpendicular to ev and v_axis to eu, scaled so the far
+    // edges land on u = 1 and v = 1
+    M3DVector3f cu, cv;
+    m3dCrossProduct(cu, ev, n);
+    m3dCrossProduct(cv, n, eu);
+    float su = m3dDotProduct(eu, cu), sv = m3dDotProduct(ev, cv);
+    if (fabs(su) < 1e-12f || fabs(sv) < 1e-12f)
+    {
+        _quad.parallelogram = 0;
+        return;
+    }
+    m3dScaleVector3(cu, 1.0f / su);
+    m3dScaleVector3(cv, 1.0f / sv);
+    m3dCopyVector3(_quad.u_axis, cu);
+    m3dCopyVector3(_quad.v_axis, cv);
+}
 
-    Intersect_Cond r1 = _tr1.intersection_check(start, dir, d1, p1);
-    Intersect_Cond r2 = _tr2.intersection_check(start, dir, d2, p2);
+void Wall::translate(const M3DVector3f offset)
+{
+    m3dAddVectors3(_left_down, _left_down, offset);
+    m3dAddVectors3(_quad.origin, _quad.origin, offset);
+    m3dAddVectors3(_quad.half[0].v0, _quad.half[0].v0, offset);
+    m3dAddVectors3(_quad.half[1].v0, _quad.half[1].v0, offset);
+    m3dAddVectors3(_quad.lo, _quad.lo, offset);
+    m3dAddVectors3(_quad.hi, _quad.hi, offset);
+    if (_quad.axis >= 0)
+        _quad.plane += offset[_quad.axis];
+    else
+        _quad.plane += m3dDotProduct(_quad.normal, offset);
+}
 
-    if (r1 == _k_miss && r2 == _k_miss) return _k_miss;
+Intersect_Cond Wall::intersection_check(const M3DVector3f start, const M3DVector3f dir,
+    float& distance, int& face)
+{
+    face = -1;
+    return hit_wall(_quad, start, dir, distance) ? _k_hit : _k_miss;
+}
 
-    if (r1 != _k_miss && (r2 == _k_miss || d1 < d2)) {
-        distance = d1;
-        m3dCopyVector3(intersection_p, p1);
-        return r1;
-    }
-    else {
-        distance = d2;
-        m3dCopyVector3(intersection_p, p2);
-        return r2;
+// u, v across the wall from the left-down corner when it is a
+// parallelogram (every room wall is); a general quad leaves them at 0
+void Wall::fill_hit(const M3DVector3f start, const M3DVector3f dir, Hit_Record& hit) const
+{
+    wall_hit_point(_quad, start, dir, hit.t, hit.point);
+    m3dCopyVector3(hit.normal, _quad.normal);
+    hit.u = hit.v = 0.0f;
+    if (_quad.parallelogram)
+    {
+        Vec3 q = Vec3(hit.point) - Vec3(_quad.origin);
+        hit.u = vec_dot(q, Vec3(_quad.u_axis));
+        hit.v = vec_dot(q, Vec3(_quad.v_axis));
     }
 }
 
+bool Wall::occluded(const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax)
+{
+    float t;
+    return hit_wall(_quad, start, dir, t) && t >= tmin && t <= tmax;
+}
+
+int Wall::intersection_check_packet(const Ray_Packet& packet, int mask, float* t)
+{
+    return hit_wall_packet(_quad, packet, mask, t);
+}
+
+int Wall::occluded_packet(const Ray_Packet& packet, int mask, float tmin, const float* tmax)
+{
+    float t[RT_PACKET_SIZE];
+    return packet_in_range(hit_wall_packet(_quad, packet, mask, t), t, tmin, tmax);
+}
+
 // Local Phong shading
 void Wall::shade(M3DVector3f view,
-    M3DVector3f intersect_p,
+    const Hit_Record& hit,
     const Light& sp_light,
     M3DVector3f am_light,
+    const Material& material,
     M3DVector3f color,
     bool shadow)
 {
-    float ka = _ka, kd = _kd, ks = _ks;
-    const float shininess = 10.0f;
+    float ka = material.ka, kd = material.kd, ks = material.ks;
+    const float shininess = material.shininess;
 
     // Base color from wall
-    M3DVector3f base;
-    get_color(intersect_p, base);
+    Vec3 base;
+    get_color(hit, material, base);
 
     // Ambient
-    for (int i = 0; i < 3; ++i)
-        color[i] = ka * am_light[i] * base[i];
+    Vec3 c = ka * Vec3(am_light) * base;
 
-    if (shadow) return;
+    if (shadow) {
+        c.store(color);
+        return;
+    }
 
-    // Normal from triangle 1 (shared plane)
-    M3DVector3f N;
-    _tr1.normal(N);
+    // Normal of the shared plane, from the hit record
+    Vec3 N(hit.normal);
 
     // Light direction
-    M3DVector3f L, lpos, lcol;
+    Vec3 lpos, lcol;
     sp_light.get_light(lpos, lcol);
-    m3dSubtractVectors3(L, lpos, intersect_p);
-    m3dNormalizeVector(L);
+    Vec3 L = vec_normalize(lpos - Vec3(hit.point));
 
-    float ndotl = std::max(0.0f, m3dDotProduct(N, L));
+    float ndotl = std::max(0.0f, vec_dot(N, L));
 
     // Diffuse
-    for (int i = 0; i < 3; ++i)
-        color[i] += kd * ndotl * lcol[i] * base[i];
+    c += kd * ndotl * lcol * base;
 
     // View direction
-    M3DVector3f V;
-    m3dCopyVector3(V, view);
-    m3dScaleVector3(V, -1.0f);
-    m3dNormalizeVector(V);
+    Vec3 V = vec_normalize(-Vec3(view));
 
     // Reflection vector
-    float twoNL = 2.0f * m3dDotProduct(N, L);
-    M3DVector3f R;
-    m3dLoadVector3(R, twoNL * N[0] - L[0], twoNL * N[1] - L[1], twoNL * N[2] - L[2]);
-    m3dNormalizeVector(R);
+    float twoNL = 2.0f * vec_dot(N, L);
+    Vec3 R = vec_normalize(twoNL * N - L);
 
-    float rdotv = std::max(0.0f, m3dDotProduct(R, V));
+    float rdotv = std::max(0.0f, vec_dot(R, V));
     float spec = ks * powf(rdotv, shininess);
 
-    for (int i = 0; i < 3; ++i)
-        color[i] += spec * lcol[i];
+    c += spec * lcol;
 
     // Clamp final color
-    for (int i = 0; i < 3; ++i) {
-        if (color[i] < 0.0f) color[i] = 0.0f;
-        if (color[i] > 1.0f) color[i] = 1.0f;
-    }
-}
-
-void Wall::get_reflect_direct(const M3DVector3f direct,
-    const M3DVector3f intersect_p,
-    M3DVector3f reflect_direct)
-{
-    // Reflect off wall normal
-    M3DVector3f N;
-    _tr1.normal(N);
-
-    float k = 2.0f * m3dDotProduct(direct, N);
-    M3DVector3f term;
-    m3dCopyVector3(term, N);
-    m3dScaleVector3(term, k);
-
-    m3dSubtractVectors3(reflect_direct, direct, term);
-    m3dNormalizeVector(reflect_direct);
+    vec_saturate(c).store(color);
 }
@@ -1,16 +1,14 @@
 #pragma once
 #include "Basic_Primitive.h"
-#include "Triangle.h"
+#include "Packed_Primitives.h"
 #include "../common/image_volume.h"
 #include <string>
 
 class Wall:public Basic_Primitive
 {
 public:
-	Wall(M3DVector3f left_up, M3DVector3f right_up, M3DVector3f right_down, M3DVector3f left_down, M3DVector3f color)
-		:Basic_Primitive(_k_wall)
-		,_tr1(left_up,right_up,left_down)
-		,_tr2(right_up,right_down,left_down)
+	Wall(M3DVector3f left_up, M3DVector3f right_up, M3DVector3f right_down, M3DVector3f left_down, Material_Id material)
+		:Basic_Primitive(_k_wall, material)
 		,_texture(NULL)
 	{
 		_is_xy = _is_xz = _is_yz = false;
@@ -42,21 +40,14 @@ public:
 			_is_yz = true;
 		}
 
-		m3dCopyVector3(_color,color);
 		m3dCopyVector3(_left_down, left_down);
-		_kd = 0.6;
-		_ka = 0.2;
-		_ks = 0.2;
-
-		//_kd = 0.8;
-		//_ka = 0.1;
-		//_ks = 0.1;
-
-		_ks2 = _ks;
-		_kt	 = 0.0;	
+		setup_quad(left_up, right_up, right_down, left_down);
+	}
 
-		_ws  = 0.0;
-		_wt  = 0.0;	//No Refraction
+	// The look walls always had (no reflection or refraction), for Scene::add_material
+	static Material	default_material(const M3DVector3f color)
+	{
+		return Material(color, 0.2f, 0.6f, 0.2f, 10.0f);
 	}
 
 public:
@@ -70,30 +61,29 @@ public:
 	}
 
 public:
-	Intersect_Cond	intersection_check(const M3DVector3f start, const M3DVector3f dir, float & distance, M3DVector3f intersection_p);
-	void	shade(M3DVector3f view,M3DVector3f intersect_p,const Light & sp_light, M3DVector3f am_light, M3DVector3f color, bool shadow);
-	//void	get_reflect_direction(M3DVector3f dir);
-	void	get_reflect_direct(const M3DVector3f direct,const M3DVector3f intersect_p,M3DVector3f reflect_direct);
-	void	get_properties(float & ks,float & kt, float & ws, float & wt) const { ks = _ks2; kt = _kt; ws = _ws; wt = _wt;	}
-	void	set_properties(float ks, float  kt, float  ws, float  wt) { _ks2 = _ks = ks; _kt = kt; _ws = ws; _wt = wt;	}
+	Intersect_Cond	intersection_check(const M3DVector3f start, const M3DVector3f dir, float & distance, int & face);
+	void	fill_hit(const M3DVector3f start, const M3DVector3f dir, Hit_Record & hit) const;
+	bool	occluded(const M3DVector3f start, const M3DVector3f dir, float tmin, float tmax);
+	int		intersection_check_packet(const Ray_Packet & packet, int mask, float * t);
+	int		occluded_packet(const Ray_Packet & packet, int mask, float tmin, const float * tmax);
+	void	shade(M3DVector3f view,const Hit_Record & hit,const Light & sp_light, M3DVector3f am_light, const Material & material, M3DVector3f color, bool shadow);
+	void	translate(const M3DVector3f offset);
+	unsigned long long	hash(unsigned long long h) const { return fnv1a(&_quad, sizeof(_quad), h); }
+	void	get_bounds(Bounding_Box & box) const
+	{
+		m3dCopyVector3(box.lo, _quad.lo);
+		m3dCopyVector3(box.hi, _quad.hi);
+	}
+
+	// What Prim_Arrays stores for this wall
+	inline const Packed_Wall &	get_packed() const { return _quad; }
 public:
 	void load_texture(std::string file_name) ;
 private:
-	inline void	get_color(M3DVector3f pos, M3DVector3f color) { if(_texture == NULL) m3dCopyVector3(color, _color); else texture_color(pos, color); }
-	void	texture_color(M3DVector3f pos, M3DVector3f color);
-	void	get_texel(float x, float y, M3DVector3f color);
-private:
-	Triangle	_tr1;
-	Triangle	_tr2;
-	M3DVector3f _color;
-	float		_kd;
-	float		_ks;
-	float		_ka;
-
-	float		_ws;
-	float		_wt;
-	float		_kt;
-	float		_ks2;
+	inline void	get_color(const Hit_Record & hit, const Material & material, M3DVector3f color) { if(_texture == NULL) m3dCopyVector3(color, material.color); else texture_color(hit, material, color); }
+	void	texture_color(const Hit_Record & hit, const Material & material, M3DVector3f color);
+	void	get_texel(float x, float y, const Material & material, M3DVector3f color);
+	void	setup_quad(const M3DVector3f left_up, const M3DVector3f right_up, const M3DVector3f right_down, const M3DVector3f left_down);
 
 private:
 	Image *	_texture;
@@ -103,4 +93,6 @@ private:
 	bool		_is_xy;
 	bool		_is_yz;
 	bool		_is_xz;
+
+	Packed_Wall	_quad;				// intersection path and data picked by setup_quad; also the bounds and normal
 };
@@ -0,0 +1,64 @@
+#pragma once
+#include "../common/common.h"
+#include <stdio.h>
+#include <vector>
+
+// Index into the scene's Material_Table; primitives keep only this
+typedef unsigned short Material_Id;
+
+// Phong coefficients and color, plus the reflection / refraction weights a
+// recursive tracer would read. The default is the flat gray triangle look.
+struct Material
+{
+	M3DVector3f	color;
+	float		ka;			// ambient
+	float		kd;			// diffuse
+	float		ks;			// specular
+	float		shininess;	// specular exponent
+	float		kt;			// transmission
+	float		ws;			// weight of the reflected ray
+	float		wt;			// weight of the refracted ray
+	float		delta;		// refraction factor
+
+	Material()
+		: ka(0.2f), kd(0.7f), ks(0.3f), shininess(12.0f), kt(0.0f), ws(0.0f), wt(0.0f), delta(1.0f)
+	{
+		m3dLoadVector3(color, 0.8f, 0.8f, 0.8f);
+	}
+
+	Material(const M3DVector3f c, float a, float d, float s, float shine,
+		float t = 0.0f, float reflect = 0.0f, float refract = 0.0f, float refract_factor = 1.0f)
+		: ka(a), kd(d), ks(s), shininess(shine), kt(t), ws(reflect), wt(refract), delta(refract_factor)
+	{
+		m3dCopyVector3(color, c);
+	}
+};
+
+// Materials of one scene, shared by id: any number of primitives can point
+// at the same entry. Id 0 always exists and holds Material().
+class Material_Table
+{
+public:
+	enum { k_max_materials = 65536 };
+
+	Material_Table() { _materials.push_back(Material()); }
+
+	// Appends m; once the table is full, warns and hands back id 0
+	inline Material_Id add(const Material & m)
+	{
+		if (_materials.size() >= k_max_materials)
+		{
+			printf("Material table full, using the default material.\n");
+			return 0;
+		}
+		_materials.push_back(m);
+		return (Material_Id)(_materials.size() - 1);
+	}
+
+	inline const Material & get(Material_Id id) const { return _materials[id]; }
+	inline Material & get(Material_Id id) { return _materials[id]; }
+	inline int size() const { return (int)_materials.size(); }
+
+private:
+	std::vector<Material>	_materials;
+};
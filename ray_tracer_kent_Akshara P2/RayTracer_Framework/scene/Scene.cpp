@@ -1,9 +1,12 @@
 ﻿#include "Scene.h"
 #include "../primitives/Wall.h"
 #include "../primitives/Sphere.h"
+#include "../primitives/Instance.h"
 #include "../common/math3d.h"
+#include "../common/hash.h"
 
 Scene::Scene()
+    : _accel((Accel_Type)RT_DEFAULT_ACCEL)
 {
     // Ambient light
     m3dLoadVector3(_am_light, 0.25f, 0.25f, 0.25f);
@@ -16,13 +19,52 @@ Scene::Scene()
 
 Scene::~Scene()
 {
-    Basic_Primitive* prim = NULL;
-    for (Prim_List::iterator it = _prim_list.begin(); it != _prim_list.end(); )
+    // Destructors first (walls and meshes own vectors), then every arena
+    // block at once
+    for (Prim_List::iterator it = _prim_list.begin(); it != _prim_list.end(); ++it)
+        destroy(*it);
+    _prim_list.clear();
+
+    for (Prim_List::iterator it = _geometry_list.begin(); it != _geometry_list.end(); ++it)
+        destroy(*it);
+    _geometry_list.clear();
+    _free_slots.clear();
+    _arena.release();
+}
+
+// Primitives may come from the arena or from new. An arena slot goes on the
+// free list of the primitive's type, for create_primitive to reuse.
+void Scene::destroy(Basic_Primitive* prim)
+{
+    if (_arena.owns(prim))
     {
-        prim = *it;
-        _prim_list.erase(it++);
-        delete prim;
+        std::vector<void*>& slots = free_slots(typeid(*prim));
+        void* slot = dynamic_cast<void*>(prim);
+        prim->~Basic_Primitive();
+        slots.push_back(slot);
     }
+    else delete prim;
+}
+
+std::vector<void*>& Scene::free_slots(const std::type_info& type)
+{
+    for (size_t i = 0; i < _free_slots.size(); ++i)
+        if (*_free_slots[i].type == type) return _free_slots[i].slots;
+    Free_Slots list;
+    list.type = &type;
+    _free_slots.push_back(list);
+    return _free_slots.back().slots;
+}
+
+Basic_Primitive* Scene::add_geometry(Basic_Primitive* geometry)
+{
+    _geometry_list.push_back(geometry);
+    return geometry;
+}
+
+void Scene::add_instance(Basic_Primitive* geometry, const M3DMatrix44f xform)
+{
+    add_primitive(create_primitive<Instance>(geometry, xform));
 }
 
 void Scene::assemble()
@@ -45,48 +87,384 @@ void Scene::assemble()
     M3DVector3f wall_color_back;   m3dLoadVector3(wall_color_back, 0.45f, 0.25f, 0.10f); // Brown (Updated)
 
     // Walls
-    _prim_list.push_back(new Wall(x0y1z0, x0y1z1, x0y0z1, x0y0z0, wall_color_left));   // Left
-    _prim_list.push_back(new Wall(x1y1z1, x1y1z0, x1y0z0, x1y0z1, wall_color_right));  // Right
-    _prim_list.push_back(new Wall(x1y1z1, x0y1z1, x0y1z0, x1y1z0, wall_color_top));    // Top
-    _prim_list.push_back(new Wall(x1y0z1, x1y0z0, x0y0z0, x0y0z1, wall_color_bottom)); // Bottom
-    _prim_list.push_back(new Wall(x1y1z0, x0y1z0, x0y0z0, x1y0z0, wall_color_back));   // Back (BROWN)
+    _prim_list.push_back(create_primitive<Wall>(x0y1z0, x0y1z1, x0y0z1, x0y0z0, add_material(Wall::default_material(wall_color_left))));   // Left
+    _prim_list.push_back(create_primitive<Wall>(x1y1z1, x1y1z0, x1y0z0, x1y0z1, add_material(Wall::default_material(wall_color_right))));  // Right
+    _prim_list.push_back(create_primitive<Wall>(x1y1z1, x0y1z1, x0y1z0, x1y1z0, add_material(Wall::default_material(wall_color_top))));    // Top
+    _prim_list.push_back(create_primitive<Wall>(x1y0z1, x1y0z0, x0y0z0, x0y0z1, add_material(Wall::default_material(wall_color_bottom)))); // Bottom
+    _prim_list.push_back(create_primitive<Wall>(x1y1z0, x0y1z0, x0y0z0, x1y0z0, add_material(Wall::default_material(wall_color_back))));   // Back (BROWN)
 
     // Sphere #1 (Hot Pink)
     float rad1 = _dim[2] / 4.0f;
     M3DVector3f sp1_col; m3dLoadVector3(sp1_col, 1.00f, 0.41f, 0.71f);
     M3DVector3f sp1_pos; m3dLoadVector3(sp1_pos, _dim[0] - rad1 - 20.0f, rad1, _dim[2] * 2.0f / 3.0f - rad1);
-    _prim_list.push_back(new Sphere(sp1_pos, rad1, sp1_col));
+    _prim_list.push_back(create_primitive<Sphere>(sp1_pos, rad1, add_material(Sphere::default_material(sp1_col))));
 
     // Sphere #2 (Lime)
     float rad2 = rad1 / 1.5f;
     M3DVector3f sp2_col; m3dLoadVector3(sp2_col, 0.75f, 1.00f, 0.00f);
     M3DVector3f sp2_pos; m3dLoadVector3(sp2_pos, rad2 + 20.0f, rad2, rad2 + 20.0f);
-    _prim_list.push_back(new Sphere(sp2_pos, rad2, sp2_col));
+    _prim_list.push_back(create_primitive<Sphere>(sp2_pos, rad2, add_material(Sphere::default_material(sp2_col))));
+
+    build_accel();
+}
+
+void Scene::build_accel()
+{
+    _prim_boxes.resize(_prim_list.size());
+    _prim_arrays.clear();
+    for (size_t i = 0; i < _prim_list.size(); ++i)
+    {
+        _prim_list[i]->set_id((int)i);
+        _prim_list[i]->get_bounds(_prim_boxes[i]);
+        _prim_arrays.add(_prim_list[i]);
+    }
+    if (_accel == _k_accel_grid)
+    {
+        _grid.build(_prim_boxes);
+        return;
+    }
+#if RT_BVH_WIDTH > 2
+    Wide_BVH* wide = &_wide_bvh;
+#else
+    Wide_BVH* wide = NULL;
+#endif
+    unsigned long long hash = 0;
+    if (!_accel_cache_path.empty())
+    {
+        hash = Accel_Cache::hash_boxes(_prim_boxes);
+        if (_accel_cache.load(_accel_cache_path.c_str(), hash, _prim_boxes, _bvh, wide))
+        {
+            _bvh.clear_changes();
+            return;
+        }
+    }
+
+    _bvh.build(_prim_boxes);
+    if (wide) wide->build(_bvh);
+    _bvh.clear_changes();
+    _accel_cache.close();
+    if (!_accel_cache_path.empty())
+        Accel_Cache::save(_accel_cache_path.c_str(), hash, _prim_boxes, _bvh, wide);
+}
+
+unsigned long long Scene::content_hash() const
+{
+    // The primitives themselves, not their boxes: two scenes can share
+    // every box and still differ, e.g. in a quad's corners or a mesh's faces
+    unsigned long long h = k_fnv_offset;
+    for (size_t i = 0; i < _prim_list.size(); ++i)
+    {
+        int type = (int)_prim_list[i]->get_type();
+        Material_Id material = _prim_list[i]->get_material();
+        h = fnv1a(&type, sizeof(type), h);
+        h = fnv1a(&material, sizeof(material), h);
+        h = _prim_list[i]->hash(h);
+    }
+    for (int m = 0; m < _materials.size(); ++m)
+        h = fnv1a(&_materials.get((Material_Id)m), sizeof(Material), h);
+
+    M3DVector3f light[3];
+    _sp_light.get_light(light[0], light[1]);
+    m3dCopyVector3(light[2], _am_light);
+    return fnv1a(light, sizeof(light), h);
+}
+
+void Scene::set_accel(Accel_Type type)
+{
+    _accel = type;
+    _bvh.clear();
+#if RT_BVH_WIDTH > 2
+    _wide_bvh.clear();
+#endif
+    _grid.clear();
+    _accel_cache.close();
+    if (!_prim_list.empty()) build_accel();
+}
+
+// Bring the traversed structure in line with the updated primitive boxes
+void Scene::commit_accel()
+{
+    if (_accel == _k_accel_grid)
+    {
+        _grid.build(_prim_boxes);
+        return;
+    }
+    if (_bvh.garbage_ratio() > 0.5f)
+    {
+        build_accel();
+        return;
+    }
+#if RT_BVH_WIDTH > 2
+    if (_bvh.was_rebuilt() || _wide_bvh.garbage_ratio() > 0.5f)
+        _wide_bvh.build(_bvh);
+    else
+        _wide_bvh.update(_bvh);
+#endif
+    _bvh.clear_changes();
+
+    // The first update copies a mapped tree into owned storage
+    if (!_bvh.is_mapped()) _accel_cache.close();
+}
+
+void Scene::add_primitive(Basic_Primitive* prim)
+{
+    int id = (int)_prim_list.size();
+    prim->set_id(id);
+    _prim_list.push_back(prim);
+    _prim_arrays.add(prim);
+    _prim_boxes.resize(_prim_list.size());
+    prim->get_bounds(_prim_boxes[id]);
+    if (_accel == _k_accel_bvh) _bvh.insert(_prim_boxes, id);
+    commit_accel();
+}
+
+void Scene::remove_primitive(Basic_Primitive* prim)
+{
+    int id = prim->get_id();
+    int last = (int)_prim_list.size() - 1;
+    if (_accel == _k_accel_bvh) _bvh.remove(id);
+
+    // Swap-remove so ids stay dense
+    if (id != last)
+    {
+        _prim_list[id] = _prim_list[last];
+        _prim_list[id]->set_id(id);
+        _prim_boxes[id] = _prim_boxes[last];
+        if (_accel == _k_accel_bvh) _bvh.rename(last, id);
+    }
+    _prim_list.pop_back();
+    _prim_boxes.pop_back();
+    _prim_arrays.remove(id);
+    destroy(prim);
+    commit_accel();
+}
+
+void Scene::move_primitive(Basic_Primitive* prim, const M3DVector3f offset)
+{
+    int id = prim->get_id();
+    prim->translate(offset);
+    prim->get_bounds(_prim_boxes[id]);
+    _prim_arrays.update(id, prim);
+    if (_accel == _k_accel_bvh) _bvh.refit(_prim_boxes, id);
+    commit_accel();
+}
+
+// Leaf callback for the BVH and grid: keeps the closest hit, ties go to the primitive
+// listed first so the result matches a linear scan of _prim_list.
+struct Closest_Prim_Test
+{
+    const Prim_Arrays&  prims;
+    const float*        start;
+    const float*        dir;
+    int                 best;
+    Intersect_Cond      cond;
+    float               t;
+    int                 face;
+
+    Closest_Prim_Test(const Prim_Arrays& p, const M3DVector3f s, const M3DVector3f d)
+        : prims(p), start(s), dir(d), best(-1), cond(_k_miss), t(0.0f), face(-1) {}
+
+    inline bool operator()(int id, float& tmax)
+    {
+        float distance = 0.0f;
+        int f = -1;
+        Intersect_Cond tmp = prims.intersection_check(id, start, dir, distance, f);
+        if (tmp == _k_miss) return false;
+        if (distance < tmax || (distance == tmax && id < best))
+        {
+            tmax = distance;
+            best = id;
+            cond = tmp;
+            t = distance;
+            face = f;
+            return true;
+        }
+        return false;
+    }
+};
+
+// The rest of the record, for the closest hit only
+void Scene::fill_hit(int id, Intersect_Cond cond, float t, int face,
+    const M3DVector3f start, const M3DVector3f dir, Hit_Record& hit) const
+{
+    hit.prim = _prim_list[id];
+    hit.prim_id = id;
+    hit.material = hit.prim->get_material();
+    hit.cond = cond;
+    hit.t = t;
+    hit.face = face;
+    hit.prim->fill_hit(start, dir, hit);
+}
+
+// What a miss leaves in the record
+static inline void clear_hit(Hit_Record& hit)
+{
+    hit.prim = NULL;
+    hit.prim_id = -1;
+    hit.face = -1;
+    hit.cond = _k_miss;
+}
+
+// Leaf callback for shadow rays: any primitive in range ends the query
+struct Occlusion_Test
+{
+    const Prim_Arrays&  prims;
+    const float*        start;
+    const float*        dir;
+    float               tmin;
+    float               tmax;
+
+    Occlusion_Test(const Prim_Arrays& p, const M3DVector3f s, const M3DVector3f d, float t0, float t1)
+        : prims(p), start(s), dir(d), tmin(t0), tmax(t1) {}
+
+    inline bool operator()(int id)
+    {
+        return prims.occluded(id, start, dir, tmin, tmax);
+    }
+};
+
+bool Scene::occluded(const M3DVector3f origin, const M3DVector3f dir, float tmax, float tmin)
+{
+    Occlusion_Test test(_prim_arrays, origin, dir, tmin, tmax);
+    if (_accel == _k_accel_grid)
+        return _grid.any_hit(origin, dir, tmax, test);
+#if RT_BVH_WIDTH > 2
+    return _wide_bvh.any_hit(origin, dir, tmax, test);
+#else
+    return _bvh.any_hit(origin, dir, tmax, test);
+#endif
+}
+
+// Packet twins of the two callbacks above
+struct Closest_Packet_Test
+{
+    const Prim_Arrays&  prims;
+    const Ray_Packet&   packet;
+    float*              tmax;
+    int                 best[RT_PACKET_SIZE];
+
+    Closest_Packet_Test(const Prim_Arrays& p, const Ray_Packet& r, float* t)
+        : prims(p), packet(r), tmax(t)
+    {
+        for (int k = 0; k < RT_PACKET_SIZE; ++k) best[k] = -1;
+    }
+
+    inline void operator()(int id, int lanes)
+    {
+        float t[RT_PACKET_SIZE];
+        int hit = prims.intersection_check_packet(id, packet, lanes, t);
+        for (int k = 0; hit != 0; ++k, hit >>= 1)
+        {
+            if (!(hit & 1)) continue;
+            if (t[k] < tmax[k] || (t[k] == tmax[k] && id < best[k]))
+            {
+                tmax[k] = t[k];
+                best[k] = id;
+            }
+        }
+    }
+};
+
+struct Occlusion_Packet_Test
+{
+    const Prim_Arrays&  prims;
+    const Ray_Packet&   packet;
+    float               tmin;
+    const float*        tmax;
+
+    Occlusion_Packet_Test(const Prim_Arrays& p, const Ray_Packet& r, float t0, const float* t1)
+        : prims(p), packet(r), tmin(t0), tmax(t1) {}
+
+    inline int operator()(int id, int lanes)
+    {
+        return prims.occluded_packet(id, packet, lanes, tmin, tmax);
+    }
+};
+
+void Scene::intersection_check_packet(const Ray_Packet& packet,
+    Hit_Record hit[RT_PACKET_SIZE])
+{
+#if RT_BVH_WIDTH > 2
+    if (_accel == _k_accel_bvh)
+    {
+        float tmax[RT_PACKET_SIZE];
+        for (int k = 0; k < RT_PACKET_SIZE; ++k) tmax[k] = 1e30f;
+        Closest_Packet_Test test(_prim_arrays, packet, tmax);
+        _wide_bvh.closest_hit_packet(packet, tmax, test);
+
+        // The packet only picks the primitive; its single-ray test supplies
+        // t, the face and the condition, so shading sees the same values.
+        // If that re-test disagrees and misses, the lane is traced on its own.
+        for (int k = 0; k < RT_PACKET_SIZE; ++k)
+        {
+            if (!(packet.active & (1 << k))) continue;
+            clear_hit(hit[k]);
+            if (test.best[k] < 0) continue;
+
+            M3DVector3f start, dir;
+            float distance;
+            int face = -1;
+            packet.get(k, start, dir);
+            Intersect_Cond cond = _prim_arrays.intersection_check(test.best[k], start, dir, distance, face);
+            if (cond != _k_miss) fill_hit(test.best[k], cond, distance, face, start, dir, hit[k]);
+            else intersection_check(start, dir, hit[k]);
+        }
+        return;
+    }
+#endif
+    for (int k = 0; k < RT_PACKET_SIZE; ++k)
+    {
+        if (!(packet.active & (1 << k))) continue;
+        M3DVector3f start, dir;
+        packet.get(k, start, dir);
+        intersection_check(start, dir, hit[k]);
+    }
+}
+
+int Scene::occluded_packet(const Ray_Packet& packet, const float* tmax, float tmin)
+{
+#if RT_BVH_WIDTH > 2
+    if (_accel == _k_accel_bvh)
+    {
+        Occlusion_Packet_Test test(_prim_arrays, packet, tmin, tmax);
+        return _wide_bvh.any_hit_packet(packet, tmax, test);
+    }
+#endif
+    int blocked = 0;
+    for (int k = 0; k < RT_PACKET_SIZE; ++k)
+    {
+        if (!(packet.active & (1 << k))) continue;
+        M3DVector3f start, dir;
+        packet.get(k, start, dir);
+        if (occluded(start, dir, tmax[k], tmin)) blocked |= 1 << k;
+    }
+    return blocked;
 }
 
 Intersect_Cond Scene::intersection_check(const M3DVector3f start,
     const M3DVector3f dir,
-    Basic_Primitive** prim_intersect,
-    M3DVector3f closest_point)
+    Hit_Record& hit)
 {
-    Basic_Primitive* prim = NULL;
-    float distance = 0.0f;
-    M3DVector3f point;
     float min_distance = 1e30f;
-    *prim_intersect = NULL;
+    clear_hit(hit);
 
-    Intersect_Cond ret = _k_miss;
-    for (Prim_List::iterator it = _prim_list.begin(); it != _prim_list.end(); ++it)
+    Closest_Prim_Test test(_prim_arrays, start, dir);
+    if (_accel == _k_accel_grid)
     {
-        prim = *it;
-        Intersect_Cond tmp = prim->intersection_check(start, dir, distance, point);
-        if (tmp != _k_miss && distance < min_distance)
-        {
-            min_distance = distance;
-            *prim_intersect = prim;
-            m3dCopyVector3(closest_point, point);
-            ret = tmp;
-        }
+        if (!_grid.closest_hit(start, dir, min_distance, test))
+            return _k_miss;
     }
-    return ret;
+    else
+    {
+#if RT_BVH_WIDTH > 2
+        if (!_wide_bvh.closest_hit(start, dir, min_distance, test))
+            return _k_miss;
+#else
+        if (!_bvh.closest_hit(start, dir, min_distance, test))
+            return _k_miss;
+#endif
+    }
+
+    fill_hit(test.best, test.cond, test.t, test.face, start, dir, hit);
+    return test.cond;
 }
@@ -1,11 +1,23 @@
 #pragma once
 #include "../common/common.h"
 #include "../primitives/Basic_Primitive.h"
+#include "../primitives/Prim_Arrays.h"
 #include "Light.h"
+#include "Material.h"
+#include "../accel/BVH.h"
+#include "../accel/Wide_BVH.h"
+#include "../accel/Grid.h"
+#include "../accel/Accel_Cache.h"
+#include "../common/arena.h"
+#include <string>
+#include <typeinfo>
 #include <vector>
 
 typedef std::vector<Basic_Primitive*> Prim_List;
 
+// Acceleration structure behind intersection_check() and occluded()
+enum Accel_Type { _k_accel_bvh = 0, _k_accel_grid = 1 };
+
 class Scene
 {
 public:
@@ -15,16 +27,114 @@ public:
     inline void set_dim(M3DVector3f dim) { m3dCopyVector3(_dim, dim); }
     void assemble();
 
+    // Switch the acceleration structure; rebuilds it if the scene has primitives
+    void set_accel(Accel_Type type);
+    inline Accel_Type get_accel() const { return _accel; }
+
+    // Keep the built BVH in this file: later starts with the same primitive
+    // boxes map it instead of building. Set before assemble(); empty disables.
+    inline void set_accel_cache(const char* path) { _accel_cache_path = path ? path : ""; }
+
+    // Hash of the primitive boxes, the key of the BVH cache; changes with
+    // the geometry but not with materials or lights
+    inline unsigned long long geometry_hash() const { return Accel_Cache::hash_boxes(_prim_boxes); }
+
+    // Hash of everything a frame's pixels depend on in the scene: the data
+    // of every primitive (Basic_Primitive::hash), its type and material id,
+    // the material table and the lights
+    unsigned long long content_hash() const;
+
+    // A primitive (or shared geometry) placed in the scene's arena, right
+    // after the previous one; hand it to add_primitive() / add_geometry()
+    // like a new'ed one. The arena goes away with the scene in one step.
+    // The slot of a removed primitive is kept on a free list for its type
+    // and taken by the next one of that type, so the arena only grows with
+    // the most primitives of each type alive at once. It never shrinks
+    // before the scene goes away; new'ed primitives are freed on removal.
+    template <class T, class... Args> inline T* create_primitive(Args&&... args)
+    {
+        std::vector<void*>& slots = free_slots(typeid(T));
+        if (slots.empty()) return _arena.create<T>(std::forward<Args>(args)...);
+        T* prim = new (slots.back()) T(std::forward<Args>(args)...);
+        slots.pop_back();
+        return prim;
+    }
+
+    // Materials are shared by id: add one, then hand the id to any number of
+    // primitive constructors. Id 0 is the default material.
+    inline Material_Id add_material(const Material& material) { return _materials.add(material); }
+    inline const Material& get_material(Material_Id id) const { return _materials.get(id); }
+    inline Material& get_material(Material_Id id) { return _materials.get(id); }
+
+    // Instancing: shared geometry is owned by the scene but never traced on
+    // its own; each add_instance() adds a transformed reference to it
+    // through add_primitive(), so the scene BVH acts as the top-level
+    // structure over instances while meshes keep their own BLAS. Both work
+    // on an assembled scene as well as on an empty one.
+    Basic_Primitive* add_geometry(Basic_Primitive* geometry);
+    void add_instance(Basic_Primitive* geometry, const M3DMatrix44f xform);
+
+    // Animation updates on an assembled scene. Each one refits the BVH along
+    // a single leaf-to-root path (rebuilding a subtree only when its quality
+    // has degraded), so a frame costs O(changed primitives * log n). The grid
+    // is rebuilt instead, which is O(n) per update.
+    void add_primitive(Basic_Primitive* prim);      // the scene takes ownership
+    void remove_primitive(Basic_Primitive* prim);   // destroys prim
+    void move_primitive(Basic_Primitive* prim, const M3DVector3f offset);
+
+    // Queries only read the scene, so render threads may run them concurrently
+    // as long as no update above runs at the same time. The closest hit
+    // comes back as a full record (point, normal, u, v, ids), built once
+    // after traversal; a miss leaves hit.prim NULL.
     Intersect_Cond intersection_check(const M3DVector3f start,
         const M3DVector3f dir,
-        Basic_Primitive** prim_intersect,
-        M3DVector3f closest_point);
+        Hit_Record& hit);
+
+    // Any-hit query for shadow rays: true if something blocks the ray within [tmin, tmax]
+    bool occluded(const M3DVector3f origin, const M3DVector3f dir, float tmax, float tmin = 0.0f);
+
+    // Packet versions of the two queries for coherent rays (packet.finish()
+    // must have been called). Every active lane gets exactly what the
+    // single-ray query returns for its ray; the wide BVH traverses the whole
+    // packet, the binary BVH and the grid trace the lanes one at a time.
+    void intersection_check_packet(const Ray_Packet& packet,
+        Hit_Record hit[RT_PACKET_SIZE]);
+    int occluded_packet(const Ray_Packet& packet, const float* tmax, float tmin = 0.0f);
 
     const Light& get_sp_light() const { return _sp_light; }
     inline void get_amb_light(M3DVector3f am_light) const { m3dCopyVector3(am_light, _am_light); }
 
 private:
-    Prim_List   _prim_list;
+    void build_accel();
+    void commit_accel();
+    void destroy(Basic_Primitive* prim);
+    std::vector<void*>& free_slots(const std::type_info& type);
+    void fill_hit(int id, Intersect_Cond cond, float t, int face,
+        const M3DVector3f start, const M3DVector3f dir, Hit_Record& hit) const;
+
+private:
+    // Arena slots of removed primitives, one list per primitive type
+    struct Free_Slots
+    {
+        const std::type_info*   type;
+        std::vector<void*>      slots;
+    };
+
+    Arena       _arena;        // the scene's own primitives, see create_primitive
+    std::vector<Free_Slots> _free_slots;   // a handful of types; searched in order
+    Prim_List   _prim_list;    // owns the primitives; what the queries return
+    Prim_Arrays _prim_arrays;  // what the queries test, by the same ids
+    Material_Table _materials; // indexed by Basic_Primitive::get_material()
+    Prim_List   _geometry_list; // shared geometry referenced by instances
+    std::vector<Bounding_Box> _prim_boxes;  // per primitive, what the accelerator was fitted to
+    Accel_Type  _accel;
+    Grid        _grid;         // used instead of the BVH when _accel is _k_accel_grid
+    std::string _accel_cache_path;
+    Accel_Cache _accel_cache;  // mapping the BVH points into after a cache hit
+    BVH         _bvh;          // built over _prim_list at the end of assemble()
+#if RT_BVH_WIDTH > 2
+    Wide_BVH    _wide_bvh;     // _bvh collapsed to RT_BVH_WIDTH children per node
+#endif
     M3DVector3f _dim;
     Light       _sp_light;     // configured in constructor
     M3DVector3f _am_light;     // ambient color
@@ -50,6 +50,25 @@ void View_Plane::get_orth_ray(M3DVector3f vector) const
 	m3dNormalizeVector(vector);
 }
 
+void View_Plane::get_per_ray_packet(Ray_Packet & packet, int i, int j, int width) const
+{
+	float move_u[RT_PACKET_SIZE], move_v[RT_PACKET_SIZE];
+	for (int k = 0; k < RT_PACKET_SIZE; k++)
+	{
+		move_u[k] = (float)(i + k % width);
+		move_v[k] = (float)(j + k / width);
+	}
+	Packet_Float mu = Packet_Float::load(move_u), mv = Packet_Float::load(move_v);
+
+	for (int c = 0; c < 3; c++)
+	{
+		Packet_Float p = Packet_Float(u_[c]) * mu + Packet_Float(v_[c]) * mv + Packet_Float(origin_[c]);
+		p.store(packet.org[c]);
+		(p - Packet_Float(eye_[c])).store(packet.dir[c]);
+	}
+	packet.normalize();
+}
+
 void View_Plane::get_per_ray(M3DVector3f vVector, M3DVector3f vPoint) const
 { 
 	m3dSubtractVectors3(vVector, vPoint, eye_);
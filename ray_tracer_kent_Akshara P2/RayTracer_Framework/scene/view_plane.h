@@ -1,6 +1,7 @@
 #ifndef __VIEW_PLANE_H
 #define __VIEW_PLANE_H
 #include "../common/common.h"
+#include "../common/ray_packet.h"
 class View_Plane
 {
 public:
@@ -74,6 +75,9 @@ public:
 
 	void get_orth_ray(M3DVector3f vector) const;
 	void get_per_ray(M3DVector3f vVector, M3DVector3f vPoint) const;
+	// get_pij + get_per_ray for a block of pixels, 'width' wide, starting at (i, j):
+	// lane k is pixel (i + k % width, j + k / width); all lanes are filled
+	void get_per_ray_packet(Ray_Packet & packet, int i, int j, int width) const;
 private:
 	M3DVector3f origin_;
 	M3DVector3f eye_;
@@ -86,4 +90,4 @@ private:
 	M3DVector3f v_backup_;
 
 };
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file